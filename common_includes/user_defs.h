@@ -27,4 +27,15 @@ typedef union failures_reg_t
 } failure_chain_t;
 
 
+// Boot phases completion time (esp_timer, us since boot), 0 while 
+// the phase is not reached
+typedef struct boot_timing_t
+{
+    int64_t i2c_ready_us; // TCA configured and first input read done
+    int64_t ip_us;        // Ethernet address obtained
+    int64_t http_us;      // Web server started
+    int64_t broker_us;    // First broker connection
+} boot_timing_t;
+
+
 #endif
\ No newline at end of file
@@ -25,8 +25,9 @@
 
 esp_err_t tca9555_init();
 esp_err_t tca_config_mode(i2c_master_dev_handle_t device, uint16_t bits);
-void tca_set(i2c_master_dev_handle_t device, uint16_t bits);
-uint16_t tca_get(i2c_master_dev_handle_t device);
+esp_err_t tca_set(i2c_master_dev_handle_t device, uint16_t bits);
+esp_err_t tca_get(i2c_master_dev_handle_t device, uint16_t* bits);
+esp_err_t tca_read_reg(i2c_master_dev_handle_t device, uint8_t reg, uint16_t* bits);
 
 
 #endif
\ No newline at end of file
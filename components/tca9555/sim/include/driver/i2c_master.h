@@ -0,0 +1,46 @@
+#ifndef TCA9555_SIM_I2C_MASTER_H
+#define TCA9555_SIM_I2C_MASTER_H
+
+// Host simulation stand-in for driver/i2c_master.h
+// Only the calls and fields user_i2c uses. Every device handle is 
+// a simulated TCA9555, see tca9555_sim.c
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "driver/gpio.h"
+
+typedef struct tca_sim_bus_t*    i2c_master_bus_handle_t;
+typedef struct tca_sim_device_t* i2c_master_dev_handle_t;
+
+typedef enum { I2C_NUM_0, I2C_NUM_1 } i2c_port_num_t;
+typedef enum { I2C_CLK_SRC_DEFAULT } i2c_clock_source_t;
+typedef enum { I2C_ADDR_BIT_LEN_7, I2C_ADDR_BIT_LEN_10 } i2c_addr_bit_len_t;
+
+typedef struct
+{
+    i2c_port_num_t     i2c_port;
+    gpio_num_t         sda_io_num;
+    gpio_num_t         scl_io_num;
+    i2c_clock_source_t clk_source;
+    uint8_t            glitch_ignore_cnt;
+    struct
+    {
+        uint32_t enable_internal_pullup:1;
+    } flags;
+} i2c_master_bus_config_t;
+
+typedef struct
+{
+    i2c_addr_bit_len_t dev_addr_length;
+    uint16_t           device_address;
+    uint32_t           scl_speed_hz;
+} i2c_device_config_t;
+
+esp_err_t i2c_new_master_bus(const i2c_master_bus_config_t* bus_config, i2c_master_bus_handle_t* ret_bus_handle);
+esp_err_t i2c_master_bus_add_device(i2c_master_bus_handle_t bus_handle, const i2c_device_config_t* dev_config, 
+                                    i2c_master_dev_handle_t* ret_handle);
+esp_err_t i2c_master_probe(i2c_master_bus_handle_t bus_handle, uint16_t address, int xfer_timeout_ms);
+esp_err_t i2c_master_bus_reset(i2c_master_bus_handle_t bus_handle);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef TCA9555_SIM_H
+#define TCA9555_SIM_H
+
+// TCA9555 model for the host simulation build (linux target)
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define TCA_SIM_ADDR_BASE   0x20 // A2..A0 = 000
+#define TCA_SIM_DEVICES     8
+#define TCA_SIM_LATENCY_US  60   // 3 bytes at 400 kHz, register write or read
+
+
+// -----------------------------------------------------
+// Simulated bus counters
+typedef struct tca_sim_stats_t
+{
+    uint32_t transactions; // tca_set + tca_get + tca_config_mode
+    uint32_t writes;       // tca_set
+    uint32_t reads;        // tca_get + tca_read_reg
+    uint32_t edges;        // Input changes that pulled the interruption line
+    uint32_t faults;       // Transactions failed by tca_sim_fault_inject
+    uint32_t bus_resets;   // i2c_master_bus_reset
+} tca_sim_stats_t;
+
+
+// -----------------------------------------------------
+void      tca_sim_set_present(uint8_t mask);
+void      tca_sim_set_latency_us(uint32_t latency_us);
+esp_err_t tca_sim_input_set(uint16_t address, uint16_t pins);
+uint16_t  tca_sim_output_get(uint16_t address);
+uint16_t  tca_sim_driven_get(uint16_t address);
+esp_err_t tca_sim_fault_inject(uint16_t address, uint32_t count, bool power_cycle);
+void      tca_sim_intr_enable(bool enable);
+void      tca_sim_stats_get(tca_sim_stats_t* stats);
+void      tca_sim_stats_reset(void);
+
+#endif
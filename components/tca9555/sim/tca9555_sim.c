@@ -0,0 +1,353 @@
+/*
+ * TCA9555 model for the host simulation build
+ * Implements the tca9555 API and the few I2C master calls used by 
+ * user_i2c on the linux target, so the I2C task, MQTT handler and 
+ * command pipeline run unchanged on a plain Linux box
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+
+#include "driver/i2c_master.h"
+
+#include "user_i2c.h"
+#include "tca9555.h"
+#include "tca9555_sim.h"
+
+static const char* TAG = "TCA9555 SIM";
+
+// Register file of one simulated expander
+typedef struct tca_sim_device_t
+{
+    uint16_t address;
+    uint16_t config;   // 1 = input, power on value 0xFFFF
+    uint16_t output;   // Output port registers, power on value 0xFFFF
+    uint16_t pins;     // Level applied on the input pins
+    uint16_t latched;  // Input port value at the last read, for the interruption
+    uint32_t faults;   // Next transactions to fail, see tca_sim_fault_inject
+    uint16_t driven;   // Pins ever driven high, see tca_sim_driven_get
+} tca_sim_device_t;
+
+typedef struct tca_sim_bus_t
+{
+    bool ready;
+} tca_sim_bus_t;
+
+static tca_sim_bus_t    tca_sim_bus;
+static tca_sim_device_t tca_sim_device[TCA_SIM_DEVICES];
+static uint8_t          tca_sim_present = 0xFF;
+static uint32_t         tca_sim_latency_us = TCA_SIM_LATENCY_US;
+static bool            tca_sim_intr = true;
+static tca_sim_stats_t  tca_sim_stats;
+static portMUX_TYPE     tca_sim_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+// -------------------------------------------------------------------
+// Bus time of one transaction. The real driver blocks the caller 
+// for the transfer, so does the model
+static void tca_sim_transaction(void)
+{
+    int64_t end = esp_timer_get_time() + tca_sim_latency_us;
+
+    while(esp_timer_get_time() < end)
+        ;
+
+    portENTER_CRITICAL(&tca_sim_mux);
+    tca_sim_stats.transactions++;
+    portEXIT_CRITICAL(&tca_sim_mux);
+}
+
+// -------------------------------------------------------------------
+// Injected fault: the transaction is not acknowledged and the 
+// registers are left untouched
+static bool tca_sim_fault(tca_sim_device_t* dev)
+{
+    bool fault = false;
+
+    portENTER_CRITICAL(&tca_sim_mux);
+    if(dev->faults)
+    {
+        dev->faults--;
+        tca_sim_stats.faults++;
+        fault = true;
+    }
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    return fault;
+}
+
+// -------------------------------------------------------------------
+// Power on values of the registers
+static void tca_sim_power_on(tca_sim_device_t* dev)
+{
+    dev->config  = 0xFFFF;
+    dev->output  = 0xFFFF;
+    dev->latched = 0xFFFF;
+}
+
+// -------------------------------------------------------------------
+// Port value as read on IN_PORT0/1: outputs read back the output 
+// register, inputs the applied level
+static uint16_t tca_sim_port(const tca_sim_device_t* dev)
+{
+    return (dev->output & ~dev->config) | (dev->pins & dev->config);
+}
+
+
+// -------------------------------------------------------------------
+// I2C master API subset
+esp_err_t i2c_new_master_bus(const i2c_master_bus_config_t* bus_config, i2c_master_bus_handle_t* ret_bus_handle)
+{
+    for(int i = 0; i < TCA_SIM_DEVICES; i++)
+    {
+        tca_sim_device[i].address = TCA_SIM_ADDR_BASE + i;
+        tca_sim_device[i].pins    = 0xFFFF; // Pulled up
+        tca_sim_device[i].faults  = 0;
+        tca_sim_power_on(&tca_sim_device[i]);
+    }
+
+    tca_sim_bus.ready = true;
+    *ret_bus_handle = &tca_sim_bus;
+    ESP_LOGI(TAG,"Simulated bus, %"PRIu32" us per transaction",tca_sim_latency_us);
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_probe(i2c_master_bus_handle_t bus_handle, uint16_t address, int xfer_timeout_ms)
+{
+    int index = address - TCA_SIM_ADDR_BASE;
+
+    tca_sim_transaction();
+    if((index < 0) || (index >= TCA_SIM_DEVICES) || !(tca_sim_present & BIT(index)))
+        return ESP_ERR_NOT_FOUND;
+    if(tca_sim_fault(&tca_sim_device[index]))
+        return ESP_ERR_NOT_FOUND;
+    return ESP_OK;
+}
+
+// Nothing is stuck on a simulated bus, only counted
+esp_err_t i2c_master_bus_reset(i2c_master_bus_handle_t bus_handle)
+{
+    portENTER_CRITICAL(&tca_sim_mux);
+    tca_sim_stats.bus_resets++;
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_bus_add_device(i2c_master_bus_handle_t bus_handle, const i2c_device_config_t* dev_config, 
+                                    i2c_master_dev_handle_t* ret_handle)
+{
+    int index = dev_config->device_address - TCA_SIM_ADDR_BASE;
+
+    if((index < 0) || (index >= TCA_SIM_DEVICES))
+        return ESP_ERR_INVALID_ARG;
+
+    *ret_handle = &tca_sim_device[index];
+    return ESP_OK;
+}
+
+
+// -------------------------------------------------------------------
+// tca9555 API
+esp_err_t tca_config_mode(i2c_master_dev_handle_t device, uint16_t bits)
+{
+    tca_sim_transaction();
+    if(tca_sim_fault(device))
+        return ESP_ERR_TIMEOUT;
+
+    portENTER_CRITICAL(&tca_sim_mux);
+    device->config  = bits;
+    device->driven |= device->output & ~device->config;
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    return ESP_OK;
+}
+
+esp_err_t tca_set(i2c_master_dev_handle_t device, uint16_t bits)
+{
+    tca_sim_transaction();
+    if(tca_sim_fault(device))
+        return ESP_ERR_TIMEOUT;
+
+    portENTER_CRITICAL(&tca_sim_mux);
+    device->output  = bits;
+    device->driven |= device->output & ~device->config;
+    tca_sim_stats.writes++;
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    return ESP_OK;
+}
+
+esp_err_t tca_get(i2c_master_dev_handle_t device, uint16_t* bits)
+{
+    tca_sim_transaction();
+    if(tca_sim_fault(device))
+        return ESP_ERR_TIMEOUT;
+
+    // Reading the input port releases the interruption line
+    portENTER_CRITICAL(&tca_sim_mux);
+    *bits = tca_sim_port(device);
+    device->latched = *bits;
+    tca_sim_stats.reads++;
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    return ESP_OK;
+}
+
+// Register pairs, a read of the input port does not release the 
+// interruption line here: only tca_get() is used for that
+esp_err_t tca_read_reg(i2c_master_dev_handle_t device, uint8_t reg, uint16_t* bits)
+{
+    tca_sim_transaction();
+    if(tca_sim_fault(device))
+        return ESP_ERR_TIMEOUT;
+
+    portENTER_CRITICAL(&tca_sim_mux);
+    switch(reg)
+    {
+        case TCA9555_IN_PORT0:     *bits = tca_sim_port(device); break;
+        case TCA9555_OUT_PORT0:    *bits = device->output;       break;
+        case TCA9555_CONFIG_PORT0: *bits = device->config;       break;
+        default:                   *bits = 0x0000;               break; // No polarity inversion
+    }
+    tca_sim_stats.reads++;
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    return ESP_OK;
+}
+
+// -------------------------------------------------------------------
+// Same boot sequence as the hardware, without the interruption pin
+esp_err_t tca9555_init()
+{
+    i2c_access_ctrl_handle_t tca_default = {0};
+
+    tca_default.i2c_action = TCA_DEV_INIT;
+    user_i2c_send_to_front(&tca_default,portMAX_DELAY);
+
+    return ESP_OK;
+}
+
+
+// -------------------------------------------------------------------
+// Simulation controls
+
+// Devices answering on the bus, bit n for address 0x20 + n
+// Call before user_i2c0_init()
+void tca_sim_set_present(uint8_t mask)
+{
+    tca_sim_present = mask;
+}
+
+void tca_sim_set_latency_us(uint32_t latency_us)
+{
+    tca_sim_latency_us = latency_us;
+}
+
+// Apply a level on the pins of a device. A change on an input pin 
+// pulls the interruption line, like the hardware: the edge reaches 
+// the I2C task through the same path as the GPIO ISR
+esp_err_t tca_sim_input_set(uint16_t address, uint16_t pins)
+{
+    int index = address - TCA_SIM_ADDR_BASE;
+    bool edge;
+
+    if((index < 0) || (index >= TCA_SIM_DEVICES))
+        return ESP_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&tca_sim_mux);
+    tca_sim_device[index].pins = pins;
+    edge = tca_sim_intr && (((tca_sim_port(&tca_sim_device[index]) ^ tca_sim_device[index].latched) & 
+                             tca_sim_device[index].config) != 0);
+    if(edge)
+        tca_sim_stats.edges++;
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    if(edge)
+        user_i2c_intr_from_isr();
+
+    return ESP_OK;
+}
+
+// Pins driven high by any register state since the previous call, 
+// glitches between two writes included
+uint16_t tca_sim_driven_get(uint16_t address)
+{
+    int index = address - TCA_SIM_ADDR_BASE;
+    uint16_t bits;
+
+    if((index < 0) || (index >= TCA_SIM_DEVICES))
+        return 0;
+
+    portENTER_CRITICAL(&tca_sim_mux);
+    bits = tca_sim_device[index].driven;
+    tca_sim_device[index].driven = tca_sim_device[index].output & ~tca_sim_device[index].config;
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    return bits;
+}
+
+// Interruption line cut (false): input changes no longer reach the 
+// I2C task, only the polling of the scrubber finds them
+void tca_sim_intr_enable(bool enable)
+{
+    tca_sim_intr = enable;
+}
+
+uint16_t tca_sim_output_get(uint16_t address)
+{
+    int index = address - TCA_SIM_ADDR_BASE;
+    uint16_t bits;
+
+    if((index < 0) || (index >= TCA_SIM_DEVICES))
+        return 0;
+
+    portENTER_CRITICAL(&tca_sim_mux);
+    bits = tca_sim_device[index].output & ~tca_sim_device[index].config;
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    return bits;
+}
+
+// Fail the next transactions addressed to a device, probes included. 
+// With power_cycle the device also loses its registers, like a 
+// brown-out of the expander: directions and outputs go back to the 
+// power on values until the I2C task restores them
+esp_err_t tca_sim_fault_inject(uint16_t address, uint32_t count, bool power_cycle)
+{
+    int index = address - TCA_SIM_ADDR_BASE;
+
+    if((index < 0) || (index >= TCA_SIM_DEVICES))
+        return ESP_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&tca_sim_mux);
+    tca_sim_device[index].faults = count;
+    if(power_cycle)
+        tca_sim_power_on(&tca_sim_device[index]);
+    portEXIT_CRITICAL(&tca_sim_mux);
+
+    return ESP_OK;
+}
+
+void tca_sim_stats_get(tca_sim_stats_t* stats)
+{
+    portENTER_CRITICAL(&tca_sim_mux);
+    *stats = tca_sim_stats;
+    portEXIT_CRITICAL(&tca_sim_mux);
+}
+
+void tca_sim_stats_reset(void)
+{
+    portENTER_CRITICAL(&tca_sim_mux);
+    tca_sim_stats = (tca_sim_stats_t){0};
+    portEXIT_CRITICAL(&tca_sim_mux);
+}
@@ -16,28 +16,14 @@
 #include "user_i2c.h"
 #include "tca9555.h"
 
-extern i2c_master_dev_handle_t i2c0_tca_output;
-extern i2c_master_dev_handle_t i2c0_tca_input;
-extern QueueHandle_t i2C_access_queue;
-
 static const char* TAG = "TCA9555";
 
 // -------------------------------------------------------------------
 // External interruption handle
+// Only latches the edge, the input read is done by the I2C task
 static void IRAM_ATTR tca_change_isr_handler(void* PvParameters)   
 {
-   i2c_access_ctrl_handle_t tca_change_int;
-   tca_change_int.i2c_action = TCA_INTR_CHANGE;
-
-   BaseType_t xHigherPriorityTaskWoken = pdTRUE;
-   xQueueSendFromISR(i2C_access_queue,
-        &tca_change_int,
-        &xHigherPriorityTaskWoken);
-
-    //check if the interrupt raised the task priorit
-    if(xHigherPriorityTaskWoken)
-        portYIELD_FROM_ISR (); //force context switch
-
+    user_i2c_intr_from_isr();
 }
 
 
@@ -49,13 +35,13 @@ static void IRAM_ATTR tca_change_isr_handler(void* PvParameters)
 // -- 0: for output
 esp_err_t tca_config_mode(i2c_master_dev_handle_t device, uint16_t bits)
 {
-    // Send most significant bits
+    // Port 0 (bits 0-7) first, the register pointer moves on to port 1
     esp_err_t err = ESP_OK;
     uint8_t reg[] = {0, 0, 0};
 
     reg[0] = TCA9555_CONFIG_PORT0;
-    reg[1] = ((0xFF00 & bits) >> 8); // 8 most significant bits
-    reg[2] = ((0x00FF & bits)); // 8 less significant bits
+    reg[1] = ((0x00FF & bits)); // 8 less significant bits
+    reg[2] = ((0xFF00 & bits) >> 8); // 8 most significant bits
     err = i2c_master_transmit(device,reg,3,50);
 
     return err;
@@ -67,35 +53,50 @@ esp_err_t tca_config_mode(i2c_master_dev_handle_t device, uint16_t bits)
 // - bits: 16 bits register where each bit control the output level
 // -- 1: Set for high level
 // -- 0: Clear pin to low level
-void tca_set(i2c_master_dev_handle_t device, uint16_t bits)
+// Bus errors are returned, retries and recovery are up to the I2C task
+esp_err_t tca_set(i2c_master_dev_handle_t device, uint16_t bits)
 {
     uint8_t reg[] = {0, 0, 0};
     reg[0] = TCA9555_OUT_PORT0;
     reg[1] = (uint8_t)(0x00FF & bits);
     reg[2] = (uint8_t)((0xFF00 & bits) >> 8);
-    ESP_ERROR_CHECK(i2c_master_transmit(device,reg,3,50));
 
-    return;
+    return i2c_master_transmit(device,reg,3,50);
 }
 
 // -------------------------------------------------------------------
 // Get TCA pins states
 // - device: Device handler for communitation with
-// - bits: 16 bits register where each bit control the output level
-uint16_t tca_get(i2c_master_dev_handle_t device)
+// - bits: 16 bits register where each bit control the output level, 
+//   left unchanged on a bus error
+esp_err_t tca_get(i2c_master_dev_handle_t device, uint16_t* bits)
 {
-    uint8_t  address =  TCA9555_IN_PORT0;
-    uint8_t  read_ports[] = {0,0};
-    uint16_t bits = 0;
     // Read the port actual status
     // TCA9555_IN_PORTx reflects the incoming logic levels of the pins,
     // regardless of whether the pin is IN or OUT
-    ESP_ERROR_CHECK(i2c_master_transmit_receive(device,&address,1,read_ports,2,50));
+    return tca_read_reg(device,TCA9555_IN_PORT0,bits);
+}
+
+// -------------------------------------------------------------------
+// Read a register pair
+// - device: Device handler for communitation with
+// - reg: port 0 register of the pair (TCA9555_IN_PORT0, TCA9555_OUT_PORT0, 
+//   TCA9555_POL_INV_PORT0 or TCA9555_CONFIG_PORT0), the register pointer 
+//   moves on to port 1
+// - bits: port 1 in the 8 most significant bits, left unchanged on a bus error
+esp_err_t tca_read_reg(i2c_master_dev_handle_t device, uint8_t reg, uint16_t* bits)
+{
+    uint8_t  read_ports[] = {0,0};
+    esp_err_t err;
 
-    bits = (0xFF & read_ports[1]) << 8;   // Get MSBs
-    bits = bits | (0xFF & read_ports[0]); // Get LSBs
+    err = i2c_master_transmit_receive(device,&reg,1,read_ports,2,50);
+    if(err != ESP_OK)
+        return err;
 
-    return bits;
+    *bits = (uint16_t)((0xFF & read_ports[1]) << 8); // Get MSBs
+    *bits = *bits | (0xFF & read_ports[0]);          // Get LSBs
+
+    return ESP_OK;
 }
 
 // -------------------------------------------------------------------
@@ -103,7 +104,7 @@ uint16_t tca_get(i2c_master_dev_handle_t device)
 esp_err_t tca9555_init()
 {
     esp_err_t err  = ESP_OK;
-    i2c_access_ctrl_handle_t tca_default;
+    i2c_access_ctrl_handle_t tca_default = {0};
     // -----------------------------------------------------------
     // Configure a pin for TCA input port change interruption
     gpio_config_t ioConfig = 
@@ -122,21 +123,13 @@ esp_err_t tca9555_init()
     // Create an interruption service routine to handle the port change interruption
     err = gpio_isr_handler_add(TCA9555_INTR_PIN,tca_change_isr_handler,NULL);
     
-    // Config TCA on 0x20 as input buffer
-    tca_default.i2c_action = TCA_CFG_OUTPUT;
-    xQueueSendToFront(i2C_access_queue,&tca_default,portMAX_DELAY);
-
-    // Initialize the inputs on low 
-    tca_default.i2c_action = TCA_OUT_INIT;
-    xQueueSendToFront(i2C_access_queue,&tca_default,portMAX_DELAY);
-
-    // Config TCA on 0x27 as input buffer
-    tca_default.i2c_action = TCA_CFG_INPUT;
-    xQueueSendToFront(i2C_access_queue,&tca_default,pdMS_TO_TICKS(50));
-
-    // Update input status on 
-    tca_default.i2c_action = TCA_REFRESH_INP;
-    xQueueSendToFront(i2C_access_queue,&tca_default,pdMS_TO_TICKS(50));
+    // One command for the whole boot configuration: every detected TCA 
+    // gets its boot output levels (saved state or low), then its 
+    // direction mask, then is read back (outputs and inputs). A single 
+    // message cannot be split by the I2C task, no relay is driven 
+    // before its level is written
+    tca_default.i2c_action = TCA_DEV_INIT;
+    user_i2c_send_to_front(&tca_default,portMAX_DELAY);
 
     return err;
 }
\ No newline at end of file
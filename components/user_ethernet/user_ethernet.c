@@ -168,6 +168,8 @@ static esp_eth_handle_t eth_init_internal(esp_eth_mac_t **mac_out, esp_eth_phy_t
 
 // ------------------------------------------------------
 // user ethernet driver initialization
+// Returns once the driver is started, the link and the address 
+// come up in background
 esp_err_t ethernet_setup(void)
 {
     // esp_err_t err = ESP_OK;
@@ -218,26 +220,9 @@ esp_err_t ethernet_setup(void)
     // Start Ethernet driver state machine
     ESP_ERROR_CHECK(esp_eth_start(eth_handle));
 
-    /*
-     * Wait until the connection is stabilished (WIFI_CONNECTED_BIT) or
-     * connection failure for the maximum number o re-tries (WIFI_FAIL_BIT) 
-     */  
-    EventBits_t bits = xEventGroupWaitBits(s_eth_event_group,
-                                           ETHERNET_CONNECTED_BIT | ETHERNET_FAIL_BIT,
-                                           pdFALSE,
-                                           pdFALSE,
-                                           portMAX_DELAY);
-
-    if (bits & ETHERNET_CONNECTED_BIT) 
-    {
-        ESP_LOGI(TAG, "Ethernet Connection established.\n");
-        return ESP_OK;
-    } 
-    else if (bits & ETHERNET_FAIL_BIT)
-        ESP_LOGE(TAG, "Ethernet Connection Failed.");
-    else
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
-    return ESP_FAIL;
+    // No wait for the link or DHCP: IP_EVENT_ETH_GOT_IP reports the 
+    // address, see user_eth_con_status()
+    return ESP_OK;
 }
 
 
@@ -0,0 +1,37 @@
+#ifndef USER_JSON_H
+#define USER_JSON_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// -----------------------------------------------------
+// Streaming JSON encoder writing into a caller provided buffer.
+// No allocation and no formatting calls, overflow is sticky and 
+// reported by json_finish()
+typedef struct json_writer_t
+{
+    char*  buf;
+    size_t size;
+    size_t len;
+    bool   need_comma; // A value was written at the current level
+    bool   overflow;
+} json_writer_t;
+
+
+// -----------------------------------------------------
+void   json_init(json_writer_t* w, char* buf, size_t size);
+size_t json_finish(json_writer_t* w);
+
+void json_obj_begin(json_writer_t* w);
+void json_obj_end(json_writer_t* w);
+void json_key(json_writer_t* w, const char* key);
+
+void json_u32(json_writer_t* w, uint32_t value);
+void json_bool(json_writer_t* w, bool value);
+void json_hex16(json_writer_t* w, uint16_t value);
+void json_bitmap16(json_writer_t* w, uint16_t bits);
+void json_hex_words(json_writer_t* w, const uint16_t* word, uint8_t count);
+void json_bitmap_words(json_writer_t* w, const uint16_t* word, uint8_t count);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef USER_PROM_H
+#define USER_PROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// -----------------------------------------------------
+// Prometheus text exposition writer into a caller provided 
+// buffer. No allocation and no formatting calls, overflow 
+// is sticky and reported by prom_finish()
+typedef struct prom_writer_t
+{
+    char*  buf;
+    size_t size;
+    size_t len;
+    bool   overflow;
+} prom_writer_t;
+
+
+// -----------------------------------------------------
+void   prom_init(prom_writer_t* w, char* buf, size_t size);
+size_t prom_finish(prom_writer_t* w);
+
+// # HELP / # TYPE lines, type is "counter" or "gauge"
+void prom_family(prom_writer_t* w, const char* name, const char* type, const char* help);
+
+// One sample, label may be NULL: name{label="value"} 123
+void prom_u64(prom_writer_t* w, const char* name, const char* label, 
+              const char* label_value, uint64_t value);
+// Same with a microseconds value written in seconds: 1.000250
+void prom_seconds(prom_writer_t* w, const char* name, const char* label, 
+                  const char* label_value, uint64_t us);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef WWW_ASSETS_H
+#define WWW_ASSETS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// -----------------------------------------------------
+// Web UI asset, gzipped at build time by tools/pack_www.py
+typedef struct www_asset_t
+{
+    const char*    uri;
+    const char*    type;          // Content-Type
+    const char*    cache_control; // Cache-Control header value
+    const char*    etag;          // Strong ETag (quoted content hash)
+    const uint8_t* data;          // gzip stream
+    size_t         len;
+} www_asset_t;
+
+
+#endif
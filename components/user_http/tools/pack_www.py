@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+#
+# Web UI asset packer for user_http
+# Minifies, gzips and content-hashes the files in www/ and writes a C
+# header holding the compressed bytes and the www_assets[] table.
+#
+# - index.html is served on "/" and revalidated through its ETag
+# - every other asset is renamed name.<hash>.ext and the references in
+#   index.html are rewritten, so they can be cached forever
+#
+# Usage: pack_www.py --out www_assets_data.h index.html style.css app.js
+
+import argparse
+import gzip
+import hashlib
+import os
+import re
+
+MIME_TYPES = {
+    ".html": "text/html",
+    ".css":  "text/css",
+    ".js":   "application/javascript",
+    ".svg":  "image/svg+xml",
+    ".ico":  "image/x-icon",
+}
+
+CACHE_REVALIDATE = "no-cache"
+CACHE_IMMUTABLE  = "public, max-age=31536000, immutable"
+
+
+# ----------------------------------------------------------
+# Minifiers, conservative: only whitespace and comments
+def minify_html(text):
+    text = re.sub(r"<!--.*?-->", "", text, flags=re.S)
+    text = re.sub(r">\s+<", "><", text)
+    text = re.sub(r"\s+", " ", text)
+    return text.strip()
+
+
+def minify_css(text):
+    text = re.sub(r"/\*.*?\*/", "", text, flags=re.S)
+    text = re.sub(r"\s+", " ", text)
+    text = re.sub(r"\s*([{};:,>])\s*", r"\1", text)
+    text = text.replace(";}", "}")
+    return text.strip()
+
+
+def minify_js(text):
+    lines = []
+    for line in text.splitlines():
+        line = line.strip()
+        if not line or line.startswith("//"):
+            continue
+        lines.append(line)
+    return "\n".join(lines)
+
+
+MINIFIERS = {".html": minify_html, ".css": minify_css, ".js": minify_js}
+
+
+# ----------------------------------------------------------
+def content_hash(data):
+    return hashlib.sha256(data).hexdigest()[:16]
+
+
+def compress(data):
+    # mtime=0 keeps the output reproducible between builds
+    return gzip.compress(data, compresslevel=9, mtime=0)
+
+
+def c_identifier(name):
+    return "www_" + re.sub(r"[^0-9a-zA-Z]", "_", name)
+
+
+def c_bytes(data):
+    rows = []
+    for i in range(0, len(data), 16):
+        rows.append("    " + ",".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+    return "\n".join(rows)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack the web UI assets in a C header")
+    parser.add_argument("--out", required=True, help="Generated header")
+    parser.add_argument("files", nargs="+", help="Asset source files, index.html first")
+    args = parser.parse_args()
+
+    assets = []   # (uri, mime, cache, raw bytes)
+    renames = {}  # original name -> hashed name
+    index = None
+
+    for path in args.files:
+        name = os.path.basename(path)
+        ext = os.path.splitext(name)[1]
+        with open(path, "r", encoding="utf-8") as f:
+            text = MINIFIERS.get(ext, lambda t: t)(f.read())
+
+        if name == "index.html":
+            index = text
+            continue
+
+        raw = text.encode("utf-8")
+        stem, ext = os.path.splitext(name)
+        hashed = "%s.%s%s" % (stem, content_hash(raw)[:8], ext)
+        renames[name] = hashed
+        assets.append(("/" + hashed, MIME_TYPES.get(ext, "application/octet-stream"),
+                       CACHE_IMMUTABLE, raw))
+
+    if index is None:
+        raise SystemExit("pack_www.py: index.html is required")
+
+    for name, hashed in renames.items():
+        index = re.sub(r"(['\"])%s\1" % re.escape(name), r"\g<1>%s\g<1>" % hashed, index)
+    assets.insert(0, ("/", "text/html", CACHE_REVALIDATE, index.encode("utf-8")))
+
+    out = []
+    out.append("// Generated by pack_www.py, do not edit")
+    out.append("#ifndef WWW_ASSETS_DATA_H")
+    out.append("#define WWW_ASSETS_DATA_H")
+    out.append("")
+    out.append("#include \"www_assets.h\"")
+    out.append("")
+
+    table = []
+    for uri, mime, cache, raw in assets:
+        gz = compress(raw)
+        ident = c_identifier(uri.lstrip("/") or "index")
+        etag = "\\\"%s\\\"" % content_hash(gz)
+        out.append("// %s: %d bytes, %d gzipped" % (uri, len(raw), len(gz)))
+        out.append("static const uint8_t %s[] =" % ident)
+        out.append("{")
+        out.append(c_bytes(gz))
+        out.append("};")
+        out.append("")
+        table.append("    { \"%s\", \"%s\", \"%s\", \"%s\", %s, sizeof(%s) },"
+                     % (uri, mime, cache, etag, ident, ident))
+
+    out.append("static const www_asset_t www_assets[] =")
+    out.append("{")
+    out.extend(table)
+    out.append("};")
+    out.append("")
+    out.append("#define WWW_ASSETS_COUNT (sizeof(www_assets) / sizeof(www_assets[0]))")
+    out.append("")
+    out.append("#endif")
+    out.append("")
+
+    with open(args.out, "w", encoding="utf-8") as f:
+        f.write("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()
@@ -4,157 +4,58 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_check.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 
 #include "esp_http_server.h"
 #include "user_http.h"
 #include "user_i2c.h"
 #include "user_mqtt.h"
+#include "user_json.h"
+#include "user_prom.h"
+#include "user_trace.h"
+#include "user_persist.h"
 
 static const char* TAG = "HTTP SERVER";
-static bool outputs[16] = {0};
-static bool inputs[16]  = {0};
+static httpd_handle_t http_server = NULL;
+
+// Last state pushed to the WebSocket clients, only used in the httpd context
+typedef struct http_ws_state_t
+{
+    tca_bank_t out;
+    tca_bank_t in;
+    bool     mqtt;
+    bool     valid;
+} http_ws_state_t;
+
+static http_ws_state_t ws_last_sent = {0};
 
 #define ERROR_MSG_MAX_LEN 256
+#define HTTP_I2C_REPLY_TIMEOUT_MS 200
+#define HTTP_JSON_BUFFER_LEN      2048 // Fits the legacy /status maps of TCA_MAX_CHANNELS
+#define HTTP_WS_BUFFER_LEN        (64 + 8*TCA_MAX_DEVICES)
+#define HTTP_PUSH_POLL_MS         500 // MQTT connectivity check period of the push task
+#define HTTP_WS_MAX_CLIENTS       7   // Same as the default max_open_sockets
+#define HTTP_METRICS_BUFFER_LEN   10240 // Every /metrics family with its HELP and TYPE lines
 static char error_message[ERROR_MSG_MAX_LEN] = "Unknown error";
 
-extern QueueHandle_t http_tca_out_get_queue; // Get input status
-extern QueueHandle_t http_tca_inp_get_queue; // Get input status
+// JSON responses, the httpd task runs one handler at a time
+static char http_json_buffer[HTTP_JSON_BUFFER_LEN];
+static char http_metrics_buffer[HTTP_METRICS_BUFFER_LEN];
+
+static TaskHandle_t http_push_task_handle = NULL;
+static int64_t      http_metrics_render_us = 0; // Render time of the previous scrape
+
 extern QueueHandle_t i2C_access_queue;  // Write and reqeuest on i2C bus
 
 
-// HTML main page
-static const char index_html[] =
-"<!DOCTYPE html>"
-"<html>"
-"<head>"
-  "<meta charset='utf-8'>"
-  "<title>Output status</title>"
-  "<style>"
-    "body {"
-      "font-family: Arial, sans-serif;"
-      "text-align: center;"
-      "margin: 0;"
-      "padding: 20px;"
-      "background: #f4f6f8;"
-      "color: #333;"
-    "}"
-    "h2 {"
-      "margin-bottom: 20px;"
-    "}"
-    ".grid {"
-      "display: grid;"
-      "grid-template-columns: repeat(8, 70px);"
-      "grid-gap: 15px;"
-      "justify-content: center;"
-      "margin-bottom: 20px;"
-    "}"
-    ".btn {"
-      "width: 60px; height: 60px;"
-      "border-radius: 50%;"
-      "border: none;"
-      "cursor: pointer;"
-      "color: #fff;"
-      "font-size: 14px;"
-      "font-weight: bold;"
-      "box-shadow: 0 3px 6px rgba(0,0,0,0.2);"
-      "transition: transform 0.15s, box-shadow 0.2s;"
-    "}"
-    ".btn:active {"
-      "transform: scale(0.92);"
-      "box-shadow: 0 2px 4px rgba(0,0,0,0.2);"
-    "}"
-    ".on {"
-      "background: linear-gradient(145deg, #28a745, #218838);"
-    "}"
-    ".off {"
-      "background: linear-gradient(145deg, #dc3545, #c82333);"
-    "}"
-  "</style>"
-"</head>"
-"<body>"
-  "<h2>Remote Relay WEB Control</h2>"
-    "<div id='mqtt-status' style='margin-bottom:20px; font-weight:bold;'>"
-      "MQTT Status: <span id='mqtt-indicator' style='color:red;'>Desconectado</span>"
-    "</div>"
-  "<h3>Outputs</h3>"
-"<div class='grid' id='row_out1'></div>"
-"<div class='grid' id='row_out2'></div>"
-"<h3>Inputs</h3>"
-"<div class='grid' id='row_in1'></div>"
-"<div class='grid' id='row_in2'></div>"
-"<script>"
-"function createButtons() {"
-  "for (let i = 0; i < 16; i++) {"
-   "let btnOut = document.createElement('button');"
-    "btnOut.id = 'out'+i;"
-    "btnOut.className = 'btn off';"
-    "btnOut.innerText = i;"
-    "btnOut.onclick = () => toggle(i);"
-    "if (i < 8) document.getElementById('row_out1').appendChild(btnOut);"
-    "else document.getElementById('row_out2').appendChild(btnOut);"
-    "let btnIn = document.createElement('button');"
-    "btnIn.id = 'in'+i;"
-    "btnIn.className = 'btn off';"
-    "btnIn.innerText = i;"
-    "btnIn.disabled = true;"
-    "if (i < 8) document.getElementById('row_in1').appendChild(btnIn);"
-    "else document.getElementById('row_in2').appendChild(btnIn);"
-  "}"
-"}"
-"function toggle(pin) {"
-    "fetch(`/toggle?pin=${pin}`)"
-      ".then(r => r.json())"
-     ".then(data => updateUI(data));"
- "}"
-"function updateUI(states) {"
-  "for (let pin in states.outputs) {"
-    "let btn = document.getElementById('out'+pin);"
-    "if (states.outputs[pin] == 1) {"
-      "btn.classList.remove('off'); btn.classList.add('on');"
-    "} else {"
-      "btn.classList.remove('on'); btn.classList.add('off');"
-    "}"
-  "}"
-  "for (let pin in states.inputs) {"
-    "let btn = document.getElementById('in'+pin);"
-    "if (states.inputs[pin] == 1) {"
-      "btn.classList.remove('off'); btn.classList.add('on');"
-    "} else {"
-      "btn.classList.remove('on'); btn.classList.add('off');"
-    "}"
-  "}"
-"}"
-"function refresh() {"
-  "fetch('/status')"
-  ".then(r => r.json())"
-  ".then(data => updateUI(data));"
-"}"
-"function refreshMqtt() {"
-  "fetch('/mqtt_status')"
-  ".then(r => r.json())"
-  ".then(data => {"
-    "let indicator = document.getElementById('mqtt-indicator');"
-      "if (data.mqtt == 1) {"
-        "indicator.innerText = \"Connected\";"
-        "indicator.style.color = \"green\";"
-      "} else {"
-        "indicator.innerText = \"Disconnected\";"
-        "indicator.style.color = \"red\";"
-      "}"
-    "});"
-"}"
-    "createButtons();"
-    "setInterval(refresh, 1000);"
-    "setInterval(refreshMqtt, 2000);"
-    "refresh();"
-    "refreshMqtt();"
-  "</script>"
-"</body>"
-"</html>";
+// Web UI assets (www/), gzipped and hashed at build time
+#include "www_assets_data.h"
 
 
 static esp_err_t error_handler(httpd_req_t *req)
@@ -192,11 +93,28 @@ static esp_err_t error_handler(httpd_req_t *req)
 
 
 // ------------------------------------------------
-// Handler of initial (index) page
-static esp_err_t index_handler(httpd_req_t *req)
+// Handler of the web UI assets (index page, css, js)
+// Sent gzipped as built, If-None-Match on the current ETag
+// is answered with 304 Not Modified and no body
+static esp_err_t asset_handler(httpd_req_t *req)
 {
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, index_html, HTTPD_RESP_USE_STRLEN);
+    const www_asset_t* asset = (const www_asset_t*)req->user_ctx;
+    char if_none_match[64];
+
+    httpd_resp_set_hdr(req, "ETag", asset->etag);
+    httpd_resp_set_hdr(req, "Cache-Control", asset->cache_control);
+
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        strstr(if_none_match, asset->etag) != NULL)
+    {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+
+    httpd_resp_set_type(req, asset->type);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    httpd_resp_send(req, (const char*)asset->data, asset->len);
     return ESP_OK;
 }
 
@@ -215,85 +133,343 @@ static esp_err_t mqtt_status_handler(httpd_req_t *req)
 
 
 // ------------------------------------------------
-// Handler of /status → returning a JSON
-// Status page handler, the webpage buttons status are 
-// updated according to the output states 
-static esp_err_t status_handler(httpd_req_t *req)
+// Handler of I2C task counters
+// cmd_received / i2c_transactions is the coalescing ratio
+static esp_err_t i2c_stats_handler(httpd_req_t *req)
 {
-    char buffer[256];
-    int offset = 0;
+    char buffer[96];
+    i2c_stats_t i2c_stats;
+
+    user_i2c_stats_get(&i2c_stats);
+    snprintf(buffer, sizeof(buffer), 
+        "{ \"cmd_received\": %"PRIu32", \"i2c_transactions\": %"PRIu32", \"batches\": %"PRIu32" }",
+        i2c_stats.cmd_received, i2c_stats.i2c_transactions, i2c_stats.batches);
 
-    BaseType_t x_queue_answer = pdTRUE;
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, buffer, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
 
-    // uint16_t out_data = 0, inp_data = 0;
-    i2c_access_ctrl_handle_t i2c_access_handle;
 
-    // Send a message to i2c task asking for output status
-    i2c_access_handle.i2c_action = HTTP_TCA_OUT_GET; // send a requisition of output status
-    x_queue_answer = xQueueSend(i2C_access_queue,&i2c_access_handle,pdMS_TO_TICKS(50));
-    // Wait for output status
-    if(x_queue_answer == pdTRUE)
+// ------------------------------------------------
+// Send the encoded JSON, 500 if it did not fit in the buffer
+static esp_err_t http_send_json(httpd_req_t *req, json_writer_t* w)
+{
+    size_t len = json_finish(w);
+    if(len == 0)
     {
-      x_queue_answer = xQueueReceive(http_tca_out_get_queue,&(i2c_access_handle.tca_out_stat),pdMS_TO_TICKS(100));
-      ESP_LOGI(TAG,"Received output: %d", i2c_access_handle.tca_out_stat);
+      ESP_LOGE(TAG,"JSON response overflow on %s", req->uri);
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Response overflow");
+      return ESP_FAIL;
     }
-    else 
-      ESP_LOGW(TAG,"Status input queue answer timeout");
-    
-    // Transfer output data to outputs array
-    if(x_queue_answer == pdTRUE)
-      for (int i = 0; i < 16; i++) 
-        outputs[i] = (bool)(((i2c_access_handle.tca_out_stat) >> i) & 0x0001);
-
-    // send a requisition of input status
-    i2c_access_handle.i2c_action = HTTP_TCA_INP_GET;
-    x_queue_answer = xQueueSend(i2C_access_queue,&i2c_access_handle,pdMS_TO_TICKS(50));
-    if(x_queue_answer == pdTRUE)
+
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, w->buf, len);
+}
+
+// ------------------------------------------------
+// Handler of /trace → command latency histograms
+// {"ingress":{"n":N,"p50":us,"p99":us,"max":us},...}, 
+// ?reset=1 clears them after the response is built
+static esp_err_t trace_handler(httpd_req_t *req)
+{
+    char query[16];
+    char param[4];
+    json_writer_t w;
+    trace_summary_t summary;
+    esp_err_t err;
+
+    json_init(&w, http_json_buffer, sizeof(http_json_buffer));
+    json_obj_begin(&w);
+    for (int stage = 0; stage < TRACE_STAGES; stage++)
     {
-      x_queue_answer = xQueueReceive(http_tca_inp_get_queue,&(i2c_access_handle.tca_in_stat),pdMS_TO_TICKS(100));
-      ESP_LOGI(TAG,"Received output: %d", i2c_access_handle.tca_in_stat);
+      trace_summary_get((trace_stage_t)stage, &summary);
+      json_key(&w, trace_stage_name((trace_stage_t)stage));
+      json_obj_begin(&w);
+      json_key(&w, "n");
+      json_u32(&w, summary.count);
+      json_key(&w, "p50");
+      json_u32(&w, summary.p50_us);
+      json_key(&w, "p99");
+      json_u32(&w, summary.p99_us);
+      json_key(&w, "max");
+      json_u32(&w, summary.max_us);
+      json_obj_end(&w);
     }
-    else 
-      ESP_LOGW(TAG,"Status output queue answer timeout");
-    
-    // Transfer input data to inputs array 
-    if(x_queue_answer == pdTRUE)
-      for (int i = 0; i < 16; i++)
-        inputs[i] = (bool)(((i2c_access_handle.tca_in_stat) >> i) & 0x0001);
-    
-    // Create a JSON string 
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "{");
-    // outputs
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "\"outputs\":{");
-    for (int i = 0; i < 16; i++) {
-        offset += snprintf(buffer + offset, sizeof(buffer) - offset,
-            "\"%d\":%d%s", i, outputs[i], (i < 15 ? "," : ""));
+    json_obj_end(&w);
+    err = http_send_json(req, &w);
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "reset", param, sizeof(param)) == ESP_OK &&
+        param[0] == '1')
+      trace_reset();
+
+    return err;
+}
+
+// ------------------------------------------------
+// Handler of /metrics → Prometheus text exposition format
+// Counters are read from the modules without queue round trips 
+// and rendered in a static buffer, one scrape stays well under 
+// a millisecond. relay_metrics_render_seconds is the render 
+// time of the previous scrape
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+    int64_t start_us = esp_timer_get_time();
+    prom_writer_t w;
+    i2c_stats_t  i2c;
+    mqtt_stats_t mqtt;
+    persist_stats_t persist;
+    size_t len;
+
+    user_i2c_stats_get(&i2c);
+    user_mqtt_stats_get(&mqtt);
+    persist_stats_get(&persist);
+
+    prom_init(&w, http_metrics_buffer, sizeof(http_metrics_buffer));
+
+    prom_family(&w, "relay_queue_depth", "gauge", "Messages waiting on the queue");
+    prom_u64(&w, "relay_queue_depth", "queue", "i2c", i2c.queue_depth);
+    prom_u64(&w, "relay_queue_depth", "queue", "mqtt", mqtt.queue_depth);
+    prom_family(&w, "relay_queue_high_water", "gauge", "Most messages ever waiting on the queue");
+    prom_u64(&w, "relay_queue_high_water", "queue", "i2c", i2c.queue_high_water);
+    prom_u64(&w, "relay_queue_high_water", "queue", "mqtt", mqtt.queue_high_water);
+    prom_family(&w, "relay_queue_capacity", "gauge", "Queue length");
+    prom_u64(&w, "relay_queue_capacity", "queue", "i2c", I2C_ACCESS_QUEUE_LEN);
+    prom_u64(&w, "relay_queue_capacity", "queue", "mqtt", MQTT_PUB_QUEUE_LEN);
+
+    prom_family(&w, "relay_i2c_commands_total", "counter", "Commands taken by the I2C task");
+    prom_u64(&w, "relay_i2c_commands_total", NULL, NULL, i2c.cmd_received);
+    prom_family(&w, "relay_i2c_commands_dropped_total", "counter", "Commands refused by a full I2C queue");
+    prom_u64(&w, "relay_i2c_commands_dropped_total", NULL, NULL, i2c.cmd_dropped);
+    prom_family(&w, "relay_i2c_transactions_total", "counter", "I2C bus transactions");
+    prom_u64(&w, "relay_i2c_transactions_total", NULL, NULL, i2c.i2c_transactions);
+    prom_family(&w, "relay_i2c_errors_total", "counter", "I2C bus transactions that failed");
+    prom_u64(&w, "relay_i2c_errors_total", NULL, NULL, i2c.i2c_errors);
+    prom_family(&w, "relay_i2c_retries_total", "counter", "I2C transactions tried again after an error");
+    prom_u64(&w, "relay_i2c_retries_total", NULL, NULL, i2c.i2c_retries);
+    prom_family(&w, "relay_i2c_devices_down", "gauge", "Expanders not answering, served from their last good state");
+    prom_u64(&w, "relay_i2c_devices_down", NULL, NULL, i2c.devices_down);
+    prom_family(&w, "relay_i2c_device_failures_total", "counter", "Expanders marked down");
+    prom_u64(&w, "relay_i2c_device_failures_total", NULL, NULL, i2c.device_failures);
+    prom_family(&w, "relay_i2c_bus_resets_total", "counter", "I2C bus resets by the recovery");
+    prom_u64(&w, "relay_i2c_bus_resets_total", NULL, NULL, i2c.bus_resets);
+    prom_family(&w, "relay_i2c_recoveries_total", "counter", "Expanders brought back");
+    prom_u64(&w, "relay_i2c_recoveries_total", NULL, NULL, i2c.recoveries);
+    prom_family(&w, "relay_i2c_recovery_failures_total", "counter", "Recovery attempts that failed");
+    prom_u64(&w, "relay_i2c_recovery_failures_total", NULL, NULL, i2c.recovery_failures);
+    prom_family(&w, "relay_i2c_recovery_seconds", "gauge", "Down time of the last expander brought back");
+    prom_seconds(&w, "relay_i2c_recovery_seconds", NULL, NULL, (uint64_t)i2c.recovery_last_us);
+    prom_family(&w, "relay_i2c_recovery_max_seconds", "gauge", "Longest expander down time");
+    prom_seconds(&w, "relay_i2c_recovery_max_seconds", NULL, NULL, (uint64_t)i2c.recovery_max_us);
+    prom_family(&w, "relay_scrub_passes_total", "counter", "Scrubber passes over the expanders");
+    prom_u64(&w, "relay_scrub_passes_total", NULL, NULL, i2c.scrub_passes);
+    prom_family(&w, "relay_scrub_yields_total", "counter", "Scrubber passes interrupted by a relay command");
+    prom_u64(&w, "relay_scrub_yields_total", NULL, NULL, i2c.scrub_yields);
+    prom_family(&w, "relay_scrub_discrepancies_total", "counter", "Register drifts and missed input edges found by the scrubber");
+    prom_u64(&w, "relay_scrub_discrepancies_total", "register", "config", i2c.scrub_config);
+    prom_u64(&w, "relay_scrub_discrepancies_total", "register", "output", i2c.scrub_output);
+    prom_u64(&w, "relay_scrub_discrepancies_total", "register", "input", i2c.scrub_input);
+    prom_family(&w, "relay_i2c_batches_total", "counter", "I2C commits");
+    prom_u64(&w, "relay_i2c_batches_total", NULL, NULL, i2c.batches);
+    prom_family(&w, "relay_i2c_bus_seconds_total", "counter", "Time spent in I2C bus transactions");
+    prom_seconds(&w, "relay_i2c_bus_seconds_total", NULL, NULL, i2c.bus_time_us);
+    prom_family(&w, "relay_i2c_interrupts_total", "counter", "TCA9555 interruption edges");
+    prom_u64(&w, "relay_i2c_interrupts_total", NULL, NULL, i2c.intr_edges);
+    prom_family(&w, "relay_timers_active", "gauge", "Output timers pending");
+    prom_u64(&w, "relay_timers_active", NULL, NULL, i2c.timers_active);
+    prom_family(&w, "relay_timer_expiries_total", "counter", "Output timers expired");
+    prom_u64(&w, "relay_timer_expiries_total", NULL, NULL, i2c.timer_expiries);
+    prom_family(&w, "relay_timer_commits_total", "counter", "I2C commits triggered by timer expiries");
+    prom_u64(&w, "relay_timer_commits_total", NULL, NULL, i2c.timer_commits);
+    prom_family(&w, "relay_seq_steps_total", "counter", "Output sequence steps written");
+    prom_u64(&w, "relay_seq_steps_total", NULL, NULL, i2c.seq_steps);
+    prom_family(&w, "relay_rules_active", "gauge", "Input to output rules in use");
+    prom_u64(&w, "relay_rules_active", NULL, NULL, i2c.rules_active);
+    prom_family(&w, "relay_rule_evaluations_total", "counter", "Input reads followed by a rules evaluation");
+    prom_u64(&w, "relay_rule_evaluations_total", NULL, NULL, i2c.rule_evals);
+    prom_family(&w, "relay_rule_writes_total", "counter", "Rules evaluations that changed an output");
+    prom_u64(&w, "relay_rule_writes_total", NULL, NULL, i2c.rule_writes);
+    prom_family(&w, "relay_boot_restore_seconds", "gauge", "Time from reset to the boot output levels written");
+    prom_seconds(&w, "relay_boot_restore_seconds", NULL, NULL, (uint64_t)i2c.restore_us);
+
+    prom_family(&w, "relay_nvs_writes_total", "counter", "Output state writes in NVS");
+    prom_u64(&w, "relay_nvs_writes_total", NULL, NULL, persist.writes);
+    prom_family(&w, "relay_nvs_write_errors_total", "counter", "Output state writes in NVS that failed");
+    prom_u64(&w, "relay_nvs_write_errors_total", NULL, NULL, persist.write_errors);
+    prom_family(&w, "relay_nvs_state_updates_total", "counter", "State updates seen by the NVS writer");
+    prom_u64(&w, "relay_nvs_state_updates_total", NULL, NULL, persist.changes);
+
+    prom_family(&w, "relay_mqtt_connected", "gauge", "Broker connection up");
+    prom_u64(&w, "relay_mqtt_connected", NULL, NULL, user_mqtt_con_status() ? 1 : 0);
+    prom_family(&w, "relay_mqtt_published_total", "counter", "Messages handed to the MQTT client");
+    prom_u64(&w, "relay_mqtt_published_total", NULL, NULL, mqtt.published);
+    prom_family(&w, "relay_mqtt_publish_errors_total", "counter", "Messages refused by the MQTT client");
+    prom_u64(&w, "relay_mqtt_publish_errors_total", NULL, NULL, mqtt.publish_errors);
+    prom_family(&w, "relay_mqtt_received_total", "counter", "Messages received from the broker");
+    prom_u64(&w, "relay_mqtt_received_total", NULL, NULL, mqtt.received);
+    prom_family(&w, "relay_mqtt_rejected_total", "counter", "Messages too large or incomplete");
+    prom_u64(&w, "relay_mqtt_rejected_total", NULL, NULL, mqtt.rejected);
+    prom_family(&w, "relay_mqtt_dropped_total", "counter", "Publications refused by a full MQTT queue");
+    prom_u64(&w, "relay_mqtt_dropped_total", NULL, NULL, mqtt.dropped);
+    prom_family(&w, "relay_mqtt_state_overwritten_total", "counter", "States replaced in their mailbox before publication");
+    prom_u64(&w, "relay_mqtt_state_overwritten_total", NULL, NULL, mqtt.overwritten);
+    prom_family(&w, "relay_mqtt_duplicates_total", "counter", "Commands replayed by a client and not applied again");
+    prom_u64(&w, "relay_mqtt_duplicates_total", NULL, NULL, mqtt.duplicates);
+    prom_family(&w, "relay_mqtt_ack_dropped_total", "counter", "Commands applied without acknowledgement");
+    prom_u64(&w, "relay_mqtt_ack_dropped_total", NULL, NULL, mqtt.ack_dropped);
+
+    prom_family(&w, "relay_heap_free_bytes", "gauge", "Free heap");
+    prom_u64(&w, "relay_heap_free_bytes", NULL, NULL, esp_get_free_heap_size());
+    prom_family(&w, "relay_heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+    prom_u64(&w, "relay_heap_min_free_bytes", NULL, NULL, esp_get_minimum_free_heap_size());
+
+    prom_family(&w, "relay_task_stack_free_bytes", "gauge", "Task stack never used (high water mark)");
+    prom_u64(&w, "relay_task_stack_free_bytes", "task", "I2CCtrl", i2c.stack_free);
+    prom_u64(&w, "relay_task_stack_free_bytes", "task", "MQTTPubTask", mqtt.stack_free);
+    prom_u64(&w, "relay_task_stack_free_bytes", "task", "httpd", uxTaskGetStackHighWaterMark(NULL));
+    if (http_push_task_handle != NULL)
+      prom_u64(&w, "relay_task_stack_free_bytes", "task", "HTTPPushTask", 
+               uxTaskGetStackHighWaterMark(http_push_task_handle));
+
+    prom_family(&w, "relay_uptime_seconds", "counter", "Time since boot");
+    prom_seconds(&w, "relay_uptime_seconds", NULL, NULL, (uint64_t)start_us);
+    prom_family(&w, "relay_metrics_render_seconds", "gauge", "Render time of the previous scrape");
+    prom_seconds(&w, "relay_metrics_render_seconds", NULL, NULL, (uint64_t)http_metrics_render_us);
+
+    len = prom_finish(&w);
+    http_metrics_render_us = esp_timer_get_time() - start_us;
+    if (len == 0)
+    {
+      ESP_LOGE(TAG, "Metrics response overflow");
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Response overflow");
+      return ESP_FAIL;
     }
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "},");
-    // inputs
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "\"inputs\":{");
-    for (int i = 0; i < 16; i++) {
-        offset += snprintf(buffer + offset, sizeof(buffer) - offset,
-            "\"%d\":%d%s", i, inputs[i], (i < 15 ? "," : ""));
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    return httpd_resp_send(req, http_metrics_buffer, len);
+}
+
+// ------------------------------------------------
+// Get the TCA state for a status request: the snapshot published 
+// by the i2c task (no queue round trip), or a fresh input read 
+// from the i2c task when the query has sync=1
+static void http_status_get(const char* query, tca_state_t* tca_state)
+{
+    char param[4];
+    i2c_access_ctrl_handle_t i2c_access_handle = {0};
+
+    if((query != NULL) &&
+       (httpd_query_key_value(query, "sync", param, sizeof(param)) == ESP_OK) &&
+       (param[0] == '1'))
+    {
+      i2c_access_handle.i2c_action = TCA_REFRESH_INP;
+      if(user_i2c_request(&i2c_access_handle,tca_state,pdMS_TO_TICKS(HTTP_I2C_REPLY_TIMEOUT_MS)) == ESP_OK)
+        return;
     }
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "}");
+    user_i2c_state_get(tca_state);
+}
 
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "}");
+// ------------------------------------------------
+// Handler of /status → returning a JSON
+// Status page handler, the webpage buttons status are 
+// updated according to the output states 
+// - default: {"outputs":{"0":1,...},"inputs":{...},"seq":N,"stale":0}
+// - fmt=hex: {"out":"00ff","in":"ffff","seq":N,"stale":0}, 4 digits 
+//   per 16 channels word, most significant word first
+// stale is 1 while an expander is down, its words are the last 
+// good state
+static esp_err_t status_handler(httpd_req_t *req)
+{
+    char query[32];
+    char param[8];
+    bool has_query = (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK);
+    json_writer_t w;
+    tca_state_t tca_state;
+
+    http_status_get(has_query ? query : NULL, &tca_state);
+
+    json_init(&w, http_json_buffer, sizeof(http_json_buffer));
+    json_obj_begin(&w);
+    if(has_query && 
+       httpd_query_key_value(query, "fmt", param, sizeof(param)) == ESP_OK &&
+       strcmp(param, "hex") == 0)
+    {
+      json_key(&w, "out");
+      json_hex_words(&w, tca_state.out.word, tca_state.out_words);
+      json_key(&w, "in");
+      json_hex_words(&w, tca_state.in.word, tca_state.in_words);
+    }
+    else
+    {
+      json_key(&w, "outputs");
+      json_bitmap_words(&w, tca_state.out.word, tca_state.out_words);
+      json_key(&w, "inputs");
+      json_bitmap_words(&w, tca_state.in.word, tca_state.in_words);
+    }
+    json_key(&w, "seq");
+    json_u32(&w, tca_state.seq);
+    json_key(&w, "stale");
+    json_bool(&w, tca_state.stale);
+    json_obj_end(&w);
 
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, buffer, HTTPD_RESP_USE_STRLEN);
-    return ESP_OK;
+    return http_send_json(req, &w);
+}
+
+// ------------------------------------------------
+// Handler of /status.bin → raw binary state, little endian:
+// out0(u16) in0(u16) seq(u32) timestamp_us(i64) out_words(u8) in_words(u8)
+// out(u16 * out_words) in(u16 * in_words)
+// The first 16 bytes keep the single expander layout
+static esp_err_t status_bin_handler(httpd_req_t *req)
+{
+    char query[16];
+    uint8_t buffer[18 + 4*TCA_MAX_DEVICES];
+    size_t len = 18;
+    tca_state_t tca_state;
+
+    http_status_get((httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) ? query : NULL, 
+                    &tca_state);
+
+    buffer[0] = (uint8_t)(tca_state.out.word[0]);
+    buffer[1] = (uint8_t)(tca_state.out.word[0] >> 8);
+    buffer[2] = (uint8_t)(tca_state.in.word[0]);
+    buffer[3] = (uint8_t)(tca_state.in.word[0] >> 8);
+    for (int i = 0; i < 4; i++)
+      buffer[4 + i] = (uint8_t)(tca_state.seq >> (8 * i));
+    for (int i = 0; i < 8; i++)
+      buffer[8 + i] = (uint8_t)((uint64_t)tca_state.timestamp_us >> (8 * i));
+    buffer[16] = tca_state.out_words;
+    buffer[17] = tca_state.in_words;
+    for (int k = 0; k < tca_state.out_words; k++, len += 2)
+    {
+      buffer[len]     = (uint8_t)(tca_state.out.word[k]);
+      buffer[len + 1] = (uint8_t)(tca_state.out.word[k] >> 8);
+    }
+    for (int k = 0; k < tca_state.in_words; k++, len += 2)
+    {
+      buffer[len]     = (uint8_t)(tca_state.in.word[k]);
+      buffer[len + 1] = (uint8_t)(tca_state.in.word[k] >> 8);
+    }
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    return httpd_resp_send(req, (const char*)buffer, len);
 }
 
 // ------------------------------------------------
 // Handler of /toggle?pin=X
-// change the button status on WEB page click
+// change the button status on WEB page click. The toggle is
+// applied by the i2c task on its own output status, so
+// concurrent HTTP and MQTT clients do not overwrite each other
 static esp_err_t toggle_handler(httpd_req_t *req)
 {
     char query[32];
-    uint16_t relayData = 0;
-    i2c_access_ctrl_handle_t i2c_access_handle;
-    BaseType_t x_queue_answer =  pdTRUE;
+    i2c_access_ctrl_handle_t i2c_access_handle = {0};
+    tca_state_t tca_state;
+    esp_err_t err = ESP_OK;
+
+    i2c_access_handle.ingress_us = esp_timer_get_time(); // Command latency tracing
+    user_i2c_state_get(&tca_state);
 
     if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) 
     {
@@ -301,39 +477,314 @@ static esp_err_t toggle_handler(httpd_req_t *req)
         if (httpd_query_key_value(query, "pin", param, sizeof(param)) == ESP_OK) 
         {
             int pin = atoi(param);
-            if (pin >= 0 && pin < 16) 
+            if (pin >= 0 && pin < 16*tca_state.out_words) 
             {
-                outputs[pin] = !outputs[pin]; // 
-                ESP_LOGI(TAG, "Toggle pin %d -> %d", pin, outputs[pin]);
-                // Queue to write the value on TCA9555 
-                for(int i = 0; i< 16; i++)
-                    relayData = relayData | (outputs[i] << i);
-                printf("HTTP Toggle: 0x%x\n",relayData);
-
-                i2c_access_handle.i2c_action = HTTP_TCA_OUT_SET;
-                i2c_access_handle.tca_out_stat = relayData;
-                x_queue_answer = xQueueSendToFront(i2C_access_queue,&i2c_access_handle,pdMS_TO_TICKS(50)); // Set TCA output 
-                if(x_queue_answer != pdTRUE)
-                  ESP_LOGW(TAG,"Status output queue answer timeout");
+                ESP_LOGI(TAG, "Toggle pin %d", pin);
+
+                // Wait for the i2c task to apply the toggle and answer 
+                // with the resulting output state
+                i2c_access_handle.i2c_action   = TCA_OUT_BITS_TOGGLE;
+                i2c_access_handle.tca_word     = (uint8_t)(pin / 16);
+                i2c_access_handle.tca_out_mask = (uint16_t)(1 << (pin % 16));
+                err = user_i2c_request(&i2c_access_handle,&tca_state,pdMS_TO_TICKS(HTTP_I2C_REPLY_TIMEOUT_MS));
+                if(err != ESP_OK)
+                  ESP_LOGW(TAG,"Toggle request: %s",esp_err_to_name(err));
             }
         }
     }
 
-    char buffer[256];
-    int offset = 0;
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "{");
-    for (int i = 0; i < 16; i++) 
+    json_writer_t w;
+    json_init(&w, http_json_buffer, sizeof(http_json_buffer));
+    json_bitmap_words(&w, tca_state.out.word, tca_state.out_words);
+
+    return http_send_json(req, &w);
+}
+
+// ------------------------------------------------
+// Handler of /output?op=set|clear|toggle|write&mask=X[&value=Y][&word=K][&revert=T]
+//            /output?op=pulse|delay_off&mask=X&ms=T[&word=K]
+// Bit level output command on the 16 channels word K (default 0), 
+// mask and value in hex. Timed actions run in the I2C task: pulse 
+// (on, off after T ms), delay_off (off after T ms) and revert (back 
+// to the previous levels T ms after the command)
+static esp_err_t output_handler(httpd_req_t *req)
+{
+    char query[80];
+    char param[12];
+    i2c_access_ctrl_handle_t i2c_access_handle = {0};
+    tca_state_t tca_state;
+    esp_err_t err = ESP_OK;
+
+    i2c_access_handle.ingress_us = esp_timer_get_time(); // Command latency tracing
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, "op", param, sizeof(param)) != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing op");
+        return ESP_FAIL;
+    }
+
+    if (strcmp(param, "set") == 0)
+        i2c_access_handle.i2c_action = TCA_OUT_BITS_SET;
+    else if (strcmp(param, "clear") == 0)
+        i2c_access_handle.i2c_action = TCA_OUT_BITS_CLEAR;
+    else if (strcmp(param, "toggle") == 0)
+        i2c_access_handle.i2c_action = TCA_OUT_BITS_TOGGLE;
+    else if (strcmp(param, "write") == 0)
+        i2c_access_handle.i2c_action = TCA_OUT_BITS_WRITE;
+    else if (strcmp(param, "pulse") == 0)
     {
-        offset += snprintf(buffer + offset, sizeof(buffer) - offset,
-                           "\"%d\":%d%s", i, outputs[i], (i < 15 ? "," : ""));
+        i2c_access_handle.i2c_action = TCA_OUT_BITS_SET;
+        i2c_access_handle.tca_timer  = TCA_TIMER_OFF;
     }
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "}");
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, buffer, HTTPD_RESP_USE_STRLEN);
+    else if (strcmp(param, "delay_off") == 0)
+    {
+        i2c_access_handle.i2c_action = TCA_OUT_TIMER;
+        i2c_access_handle.tca_timer  = TCA_TIMER_OFF;
+    }
+    else
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown op");
+        return ESP_FAIL;
+    }
+
+    if (httpd_query_key_value(query, "mask", param, sizeof(param)) != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing mask");
+        return ESP_FAIL;
+    }
+    i2c_access_handle.tca_out_mask = (uint16_t)strtol(param, NULL, 16);
+
+    i2c_access_handle.tca_out_stat = 0x0000;
+    if (i2c_access_handle.i2c_action == TCA_OUT_BITS_WRITE)
+    {
+        if (httpd_query_key_value(query, "value", param, sizeof(param)) != ESP_OK)
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing value");
+            return ESP_FAIL;
+        }
+        i2c_access_handle.tca_out_stat = (uint16_t)strtol(param, NULL, 16);
+    }
+
+    if (i2c_access_handle.tca_timer == TCA_TIMER_OFF)
+    {
+        if (httpd_query_key_value(query, "ms", param, sizeof(param)) != ESP_OK)
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing ms");
+            return ESP_FAIL;
+        }
+        i2c_access_handle.duration_ms = (uint32_t)strtoul(param, NULL, 10);
+    }
+    else if (httpd_query_key_value(query, "revert", param, sizeof(param)) == ESP_OK)
+    {
+        i2c_access_handle.tca_timer   = TCA_TIMER_REVERT;
+        i2c_access_handle.duration_ms = (uint32_t)strtoul(param, NULL, 10);
+    }
+
+    if (httpd_query_key_value(query, "word", param, sizeof(param)) == ESP_OK)
+    {
+        int word = atoi(param);
+        user_i2c_state_get(&tca_state);
+        if (word < 0 || word >= tca_state.out_words)
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid word");
+            return ESP_FAIL;
+        }
+        i2c_access_handle.tca_word = (uint8_t)word;
+    }
+
+    err = user_i2c_request(&i2c_access_handle,&tca_state,pdMS_TO_TICKS(HTTP_I2C_REPLY_TIMEOUT_MS));
+    if(err != ESP_OK)
+    {
+        ESP_LOGW(TAG,"Output command: %s",esp_err_to_name(err));
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "I2C request timeout");
+        return ESP_FAIL;
+    }
+
+    // Applied state
+    json_writer_t w;
+    json_init(&w, http_json_buffer, sizeof(http_json_buffer));
+    json_obj_begin(&w);
+    json_key(&w, "out");
+    json_hex_words(&w, tca_state.out.word, tca_state.out_words);
+    json_key(&w, "in");
+    json_hex_words(&w, tca_state.in.word, tca_state.in_words);
+    json_key(&w, "seq");
+    json_u32(&w, tca_state.seq);
+    json_obj_end(&w);
+
+    return http_send_json(req, &w);
+}
+
+
+// ------------------------------------------------
+// Build a WebSocket state message. Only the fields that differ 
+// from prev are written, everything when prev is NULL
+static int ws_state_json(char* buffer, size_t size, const tca_state_t* tca_state,
+                         bool mqtt, const http_ws_state_t* prev)
+{
+    json_writer_t w;
+    json_init(&w, buffer, size);
+    json_obj_begin(&w);
+    json_key(&w, "seq");
+    json_u32(&w, tca_state->seq);
+
+    if(prev == NULL || !prev->valid || memcmp(&prev->out, &tca_state->out, sizeof(tca_bank_t)) != 0)
+    {
+      json_key(&w, "out");
+      json_hex_words(&w, tca_state->out.word, tca_state->out_words);
+    }
+    if(prev == NULL || !prev->valid || memcmp(&prev->in, &tca_state->in, sizeof(tca_bank_t)) != 0)
+    {
+      json_key(&w, "in");
+      json_hex_words(&w, tca_state->in.word, tca_state->in_words);
+    }
+    if(prev == NULL || !prev->valid || prev->mqtt != mqtt)
+    {
+      json_key(&w, "mqtt");
+      json_bool(&w, mqtt);
+    }
+
+    json_obj_end(&w);
+    return (int)json_finish(&w);
+}
+
+// ------------------------------------------------
+// Send a text frame to every connected WebSocket client (httpd context)
+static void ws_broadcast(char* payload, int len)
+{
+    int fds[HTTP_WS_MAX_CLIENTS];
+    size_t clients = HTTP_WS_MAX_CLIENTS;
+    httpd_ws_frame_t frame = 
+    {
+      .final   = true,
+      .type    = HTTPD_WS_TYPE_TEXT,
+      .payload = (uint8_t*)payload,
+      .len     = len
+    };
+
+    if(httpd_get_client_list(http_server, &clients, fds) != ESP_OK)
+      return;
+
+    for(size_t i = 0; i < clients; i++)
+      if(httpd_ws_get_fd_info(http_server, fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET)
+        httpd_ws_send_frame_async(http_server, fds[i], &frame);
+}
+
+// ------------------------------------------------
+// Push the state delta to the WebSocket clients (httpd context)
+static void ws_push_work(void* arg)
+{
+    char buffer[HTTP_WS_BUFFER_LEN];
+    tca_state_t tca_state;
+    bool mqtt = user_mqtt_con_status();
+
+    user_i2c_state_get(&tca_state);
+    if(ws_last_sent.valid && 
+       memcmp(&ws_last_sent.out, &tca_state.out, sizeof(tca_bank_t)) == 0 &&
+       memcmp(&ws_last_sent.in,  &tca_state.in,  sizeof(tca_bank_t)) == 0 &&
+       ws_last_sent.mqtt == mqtt)
+      return;
+
+    int len = ws_state_json(buffer, sizeof(buffer), &tca_state, mqtt, &ws_last_sent);
+    ws_broadcast(buffer, len);
+
+    ws_last_sent.out   = tca_state.out;
+    ws_last_sent.in    = tca_state.in;
+    ws_last_sent.mqtt  = mqtt;
+    ws_last_sent.valid = true;
+}
+
+// ------------------------------------------------
+// Send the full state to a newly connected client (httpd context)
+static void ws_hello_work(void* arg)
+{
+    char buffer[HTTP_WS_BUFFER_LEN];
+    tca_state_t tca_state;
+    int fd = (int)(intptr_t)arg;
+
+    user_i2c_state_get(&tca_state);
+    httpd_ws_frame_t frame = 
+    {
+      .final   = true,
+      .type    = HTTPD_WS_TYPE_TEXT,
+      .payload = (uint8_t*)buffer,
+      .len     = ws_state_json(buffer, sizeof(buffer), &tca_state, user_mqtt_con_status(), NULL)
+    };
+    httpd_ws_send_frame_async(http_server, fd, &frame);
+}
+
+// ------------------------------------------------
+// Handler of /ws WebSocket
+// Pushes {"seq":N,"out":"hex","in":"hex","mqtt":0|1} deltas and 
+// accepts "toggle=N" commands on the same connection
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+    char payload[32];
+    i2c_access_ctrl_handle_t i2c_access_handle = {0};
+    tca_state_t tca_state;
+    httpd_ws_frame_t frame = {0};
+
+    // Handshake, the full state follows once the connection is upgraded
+    if (req->method == HTTP_GET)
+    {
+      httpd_queue_work(req->handle, ws_hello_work, (void*)(intptr_t)httpd_req_to_sockfd(req));
+      return ESP_OK;
+    }
+
+    i2c_access_handle.ingress_us = esp_timer_get_time(); // Command latency tracing
+    frame.payload = (uint8_t*)payload;
+    if (httpd_ws_recv_frame(req, &frame, sizeof(payload) - 1) != ESP_OK)
+      return ESP_FAIL;
+    if (frame.type != HTTPD_WS_TYPE_TEXT)
+      return ESP_OK;
+    payload[frame.len] = '\0';
 
+    if (strncmp(payload, "toggle=", 7) == 0)
+    {
+      int pin = atoi(payload + 7);
+      user_i2c_state_get(&tca_state);
+      if (pin >= 0 && pin < 16*tca_state.out_words)
+      {
+        // The new state is pushed back by the push task
+        i2c_access_handle.i2c_action   = TCA_OUT_BITS_TOGGLE;
+        i2c_access_handle.tca_word     = (uint8_t)(pin / 16);
+        i2c_access_handle.tca_out_mask = (uint16_t)(1 << (pin % 16));
+        if(user_i2c_send(&i2c_access_handle,pdMS_TO_TICKS(50)) != pdTRUE)
+          ESP_LOGW(TAG,"WebSocket toggle queue answer timeout");
+      }
+    }
     return ESP_OK;
 }
 
+// ------------------------------------------------
+// Push task: woken by the i2c task on every state update and 
+// periodically to follow the MQTT connection. Nothing is sent 
+// while the state does not change
+static void http_push_task(void* PvParameters)
+{
+    tca_state_t tca_state;
+    uint32_t last_seq = 0;
+    bool last_mqtt = false;
+    bool mqtt;
+
+    user_i2c_state_subscribe(xTaskGetCurrentTaskHandle());
+
+    while(true)
+    {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HTTP_PUSH_POLL_MS));
+
+      user_i2c_state_get(&tca_state);
+      mqtt = user_mqtt_con_status();
+      if(tca_state.seq != last_seq || mqtt != last_mqtt)
+      {
+        httpd_queue_work(http_server, ws_push_work, NULL);
+        last_seq  = tca_state.seq;
+        last_mqtt = mqtt;
+      }
+    }
+}
+
 
 // ------------------------------------------------
 httpd_handle_t start_webserver(bool system_failure,char msg[])
@@ -341,18 +792,23 @@ httpd_handle_t start_webserver(bool system_failure,char msg[])
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     httpd_handle_t server = NULL;
 
+    config.max_uri_handlers = 16;
+
     if (httpd_start(&server, &config) == ESP_OK) 
     {
       if(!system_failure)
       {
-        httpd_uri_t uri_index = 
+        for (size_t i = 0; i < WWW_ASSETS_COUNT; i++)
         {
-          .uri       = "/",
-          .method    = HTTP_GET,
-          .handler   = index_handler,
-          .user_ctx  = NULL
-        };
-        httpd_register_uri_handler(server, &uri_index);
+          httpd_uri_t uri_asset = 
+          {
+            .uri       = www_assets[i].uri,
+            .method    = HTTP_GET,
+            .handler   = asset_handler,
+            .user_ctx  = (void*)&www_assets[i]
+          };
+          httpd_register_uri_handler(server, &uri_asset);
+        }
 
         httpd_uri_t uri_status = 
         {
@@ -363,6 +819,15 @@ httpd_handle_t start_webserver(bool system_failure,char msg[])
         };
         httpd_register_uri_handler(server, &uri_status);
 
+        httpd_uri_t uri_status_bin = 
+        {
+          .uri       = "/status.bin",
+          .method    = HTTP_GET,
+          .handler   = status_bin_handler,
+          .user_ctx  = NULL
+        };
+        httpd_register_uri_handler(server, &uri_status_bin);
+
         httpd_uri_t uri_toggle = 
         {
           .uri       = "/toggle",
@@ -372,6 +837,15 @@ httpd_handle_t start_webserver(bool system_failure,char msg[])
         };
         httpd_register_uri_handler(server, &uri_toggle);
 
+        httpd_uri_t uri_output = 
+        {
+          .uri       = "/output",
+          .method    = HTTP_GET,
+          .handler   = output_handler,
+          .user_ctx  = NULL
+        };
+        httpd_register_uri_handler(server, &uri_output);
+
 
         httpd_uri_t uri_mqtt_status = 
         {
@@ -382,9 +856,45 @@ httpd_handle_t start_webserver(bool system_failure,char msg[])
         };
         httpd_register_uri_handler(server, &uri_mqtt_status);
 
-        // Create queues for data exchange between ethernet and i2c
-        http_tca_out_get_queue = xQueueCreate(1,sizeof(uint16_t));
-        http_tca_inp_get_queue = xQueueCreate(1,sizeof(uint16_t));
+        httpd_uri_t uri_i2c_stats = 
+        {
+          .uri       = "/i2c_stats",
+          .method    = HTTP_GET,
+          .handler   = i2c_stats_handler,
+          .user_ctx  = NULL
+        };
+        httpd_register_uri_handler(server, &uri_i2c_stats);
+
+        httpd_uri_t uri_trace = 
+        {
+          .uri       = "/trace",
+          .method    = HTTP_GET,
+          .handler   = trace_handler,
+          .user_ctx  = NULL
+        };
+        httpd_register_uri_handler(server, &uri_trace);
+
+        httpd_uri_t uri_metrics = 
+        {
+          .uri       = "/metrics",
+          .method    = HTTP_GET,
+          .handler   = metrics_handler,
+          .user_ctx  = NULL
+        };
+        httpd_register_uri_handler(server, &uri_metrics);
+
+        httpd_uri_t uri_ws = 
+        {
+          .uri          = "/ws",
+          .method       = HTTP_GET,
+          .handler      = ws_handler,
+          .user_ctx     = NULL,
+          .is_websocket = true
+        };
+        httpd_register_uri_handler(server, &uri_ws);
+
+        http_server = server;
+        xTaskCreate(http_push_task,"HTTPPushTask",configMINIMAL_STACK_SIZE+2048,NULL,3,&http_push_task_handle);
 
         ESP_LOGI(TAG, "Start web server");
       }
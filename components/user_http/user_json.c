@@ -0,0 +1,275 @@
+/*
+ * Streaming JSON encoder for the HTTP responses
+ * Writes straight into a preallocated buffer with lookup tables
+ * instead of snprintf
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "user_json.h"
+
+// ------------------------------------------------------
+// Lookup tables
+static const char hex_digits[] = "0123456789abcdef";
+
+static const char dec_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// {"0":b,...,"15":b} with every bit digit at a fixed offset
+static const char bitmap16_template[] =
+    "{\"0\":0,\"1\":0,\"2\":0,\"3\":0,\"4\":0,\"5\":0,\"6\":0,\"7\":0,"
+    "\"8\":0,\"9\":0,\"10\":0,\"11\":0,\"12\":0,\"13\":0,\"14\":0,\"15\":0}";
+
+static const uint8_t bitmap16_digit[16] =
+{
+    5, 11, 17, 23, 29, 35, 41, 47, 53, 59, 66, 73, 80, 87, 94, 101
+};
+
+
+// ------------------------------------------------------
+// Reserve n bytes in the buffer, NULL on overflow
+static char* json_reserve(json_writer_t* w, size_t n)
+{
+    char* p;
+
+    // Keep one byte for the final '\0'
+    if(w->overflow || (w->len + n >= w->size))
+    {
+        w->overflow = true;
+        return NULL;
+    }
+
+    p = w->buf + w->len;
+    w->len += n;
+    return p;
+}
+
+// ------------------------------------------------------
+static void json_put(json_writer_t* w, const char* s, size_t n)
+{
+    char* p = json_reserve(w, n);
+    if(p != NULL)
+        memcpy(p, s, n);
+}
+
+// ------------------------------------------------------
+// Comma before a value or key at the current level
+static void json_separator(json_writer_t* w)
+{
+    if(w->need_comma)
+        json_put(w, ",", 1);
+    w->need_comma = true;
+}
+
+
+// ------------------------------------------------------
+void json_init(json_writer_t* w, char* buf, size_t size)
+{
+    w->buf  = buf;
+    w->size = size;
+    w->len  = 0;
+    w->need_comma = false;
+    w->overflow   = false;
+}
+
+// ------------------------------------------------------
+// Terminate the string, returns its length or 0 on overflow
+size_t json_finish(json_writer_t* w)
+{
+    if(w->overflow || w->size == 0)
+    {
+        if(w->size != 0)
+            w->buf[0] = '\0';
+        return 0;
+    }
+
+    w->buf[w->len] = '\0';
+    return w->len;
+}
+
+// ------------------------------------------------------
+void json_obj_begin(json_writer_t* w)
+{
+    json_separator(w);
+    json_put(w, "{", 1);
+    w->need_comma = false;
+}
+
+// ------------------------------------------------------
+void json_obj_end(json_writer_t* w)
+{
+    json_put(w, "}", 1);
+    w->need_comma = true;
+}
+
+// ------------------------------------------------------
+// Key of the next value, no escaping: keys are literals
+void json_key(json_writer_t* w, const char* key)
+{
+    size_t n = strlen(key);
+    char*  p;
+
+    json_separator(w);
+    p = json_reserve(w, n + 3);
+    if(p == NULL)
+        return;
+
+    p[0] = '"';
+    memcpy(p + 1, key, n);
+    p[n + 1] = '"';
+    p[n + 2] = ':';
+
+    // The value that follows must not get a comma
+    w->need_comma = false;
+}
+
+// ------------------------------------------------------
+// Decimal digits of value, written backwards from end
+// Returns the first digit
+static char* json_dec(char* end, uint32_t value)
+{
+    char* p = end;
+
+    // Two digits per step from the pairs table
+    while(value >= 100)
+    {
+        uint32_t pair = (value % 100) * 2;
+        value /= 100;
+        *--p = dec_pairs[pair + 1];
+        *--p = dec_pairs[pair];
+    }
+    if(value >= 10)
+    {
+        *--p = dec_pairs[value * 2 + 1];
+        *--p = dec_pairs[value * 2];
+    }
+    else
+        *--p = (char)('0' + value);
+
+    return p;
+}
+
+// ------------------------------------------------------
+void json_u32(json_writer_t* w, uint32_t value)
+{
+    char  digits[10];
+    char* end = digits + sizeof(digits);
+    char* p   = json_dec(end, value);
+
+    json_separator(w);
+    json_put(w, p, (size_t)(end - p));
+}
+
+// ------------------------------------------------------
+void json_bool(json_writer_t* w, bool value)
+{
+    json_separator(w);
+    json_put(w, value ? "1" : "0", 1);
+}
+
+// ------------------------------------------------------
+// 16 bits as a 4 digits hex string: "00ff"
+void json_hex16(json_writer_t* w, uint16_t value)
+{
+    char* p;
+
+    json_separator(w);
+    p = json_reserve(w, 6);
+    if(p == NULL)
+        return;
+
+    p[0] = '"';
+    p[1] = hex_digits[(value >> 12) & 0x0F];
+    p[2] = hex_digits[(value >> 8)  & 0x0F];
+    p[3] = hex_digits[(value >> 4)  & 0x0F];
+    p[4] = hex_digits[value & 0x0F];
+    p[5] = '"';
+}
+
+// ------------------------------------------------------
+// 16 bits as the legacy {"0":1,"1":0,...} map
+void json_bitmap16(json_writer_t* w, uint16_t bits)
+{
+    char* p;
+
+    json_separator(w);
+    p = json_reserve(w, sizeof(bitmap16_template) - 1);
+    if(p == NULL)
+        return;
+
+    memcpy(p, bitmap16_template, sizeof(bitmap16_template) - 1);
+    for(int i = 0; i < 16; i++)
+        p[bitmap16_digit[i]] = (char)('0' + ((bits >> i) & 0x0001));
+}
+
+// ------------------------------------------------------
+// count 16 bits words as one hex string, most significant 
+// word first: {0x00ff, 0x1234} -> "123400ff"
+void json_hex_words(json_writer_t* w, const uint16_t* word, uint8_t count)
+{
+    char* p;
+
+    json_separator(w);
+    p = json_reserve(w, 4 * (size_t)count + 2);
+    if(p == NULL)
+        return;
+
+    *p++ = '"';
+    for(int k = count - 1; k >= 0; k--)
+    {
+        *p++ = hex_digits[(word[k] >> 12) & 0x0F];
+        *p++ = hex_digits[(word[k] >> 8)  & 0x0F];
+        *p++ = hex_digits[(word[k] >> 4)  & 0x0F];
+        *p++ = hex_digits[word[k] & 0x0F];
+    }
+    *p = '"';
+}
+
+// ------------------------------------------------------
+// count 16 bits words as the legacy {"0":1,...,"n":0} map,
+// channel 16*k+i is bit i of word k
+void json_bitmap_words(json_writer_t* w, const uint16_t* word, uint8_t count)
+{
+    char  key[16];
+    char* end = key + sizeof(key);
+    char* p;
+    char* d;
+
+    if(count == 1)
+    {
+        json_bitmap16(w, word[0]);
+        return;
+    }
+
+    json_separator(w);
+    json_put(w, "{", 1);
+    for(uint32_t ch = 0; ch < 16 * (uint32_t)count; ch++)
+    {
+        // ,"ch":b built backwards in key[]
+        p = end;
+        *--p = (char)('0' + ((word[ch / 16] >> (ch % 16)) & 0x0001));
+        *--p = ':';
+        *--p = '"';
+        p = json_dec(p, ch);
+        *--p = '"';
+        if(ch != 0)
+            *--p = ',';
+
+        d = json_reserve(w, (size_t)(end - p));
+        if(d == NULL)
+            return;
+        memcpy(d, p, (size_t)(end - p));
+    }
+    json_put(w, "}", 1);
+}
@@ -0,0 +1,163 @@
+/*
+ * Prometheus text exposition writer for /metrics
+ * Same principle as user_json: literals are copied, numbers 
+ * are converted by hand, nothing goes through snprintf
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "user_prom.h"
+
+
+// ------------------------------------------------------
+// Reserve n bytes in the buffer, NULL on overflow
+static char* prom_reserve(prom_writer_t* w, size_t n)
+{
+    char* p;
+
+    // Keep one byte for the final '\0'
+    if(w->overflow || (w->len + n >= w->size))
+    {
+        w->overflow = true;
+        return NULL;
+    }
+
+    p = w->buf + w->len;
+    w->len += n;
+    return p;
+}
+
+// ------------------------------------------------------
+static void prom_put(prom_writer_t* w, const char* s, size_t n)
+{
+    char* p = prom_reserve(w, n);
+    if(p != NULL)
+        memcpy(p, s, n);
+}
+
+// ------------------------------------------------------
+static void prom_str(prom_writer_t* w, const char* s)
+{
+    prom_put(w, s, strlen(s));
+}
+
+// ------------------------------------------------------
+// Decimal digits of value, written backwards from end, at 
+// least min_digits (zero padded). Returns the first digit
+static char* prom_dec(char* end, uint32_t value, int min_digits)
+{
+    char* p = end;
+
+    do
+    {
+        *--p = (char)('0' + value % 10);
+        value /= 10;
+        min_digits--;
+    } while(value != 0 || min_digits > 0);
+
+    return p;
+}
+
+// ------------------------------------------------------
+// 64 bits counters are split in 9 digits groups, so that the 
+// 64 bits division only runs for values above 4294967295
+static char* prom_dec64(char* end, uint64_t value)
+{
+    char* p = end;
+
+    while(value > UINT32_MAX)
+    {
+        p = prom_dec(p, (uint32_t)(value % 1000000000u), 9);
+        value /= 1000000000u;
+    }
+
+    return prom_dec(p, (uint32_t)value, 1);
+}
+
+// ------------------------------------------------------
+// name{label="value"} 
+static void prom_sample_name(prom_writer_t* w, const char* name, 
+                             const char* label, const char* label_value)
+{
+    prom_str(w, name);
+    if(label != NULL)
+    {
+        prom_put(w, "{", 1);
+        prom_str(w, label);
+        prom_put(w, "=\"", 2);
+        prom_str(w, label_value);
+        prom_put(w, "\"}", 2);
+    }
+    prom_put(w, " ", 1);
+}
+
+
+// ------------------------------------------------------
+void prom_init(prom_writer_t* w, char* buf, size_t size)
+{
+    w->buf  = buf;
+    w->size = size;
+    w->len  = 0;
+    w->overflow = false;
+}
+
+// ------------------------------------------------------
+// Terminate the string, returns its length or 0 on overflow
+size_t prom_finish(prom_writer_t* w)
+{
+    if(w->overflow || w->size == 0)
+    {
+        if(w->size != 0)
+            w->buf[0] = '\0';
+        return 0;
+    }
+
+    w->buf[w->len] = '\0';
+    return w->len;
+}
+
+// ------------------------------------------------------
+void prom_family(prom_writer_t* w, const char* name, const char* type, const char* help)
+{
+    prom_put(w, "# HELP ", 7);
+    prom_str(w, name);
+    prom_put(w, " ", 1);
+    prom_str(w, help);
+    prom_put(w, "\n# TYPE ", 8);
+    prom_str(w, name);
+    prom_put(w, " ", 1);
+    prom_str(w, type);
+    prom_put(w, "\n", 1);
+}
+
+// ------------------------------------------------------
+void prom_u64(prom_writer_t* w, const char* name, const char* label, 
+              const char* label_value, uint64_t value)
+{
+    char  digits[21];
+    char* end = digits + sizeof(digits);
+    char* p;
+
+    prom_sample_name(w, name, label, label_value);
+    *--end = '\n';
+    p = prom_dec64(end, value);
+    prom_put(w, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+// ------------------------------------------------------
+void prom_seconds(prom_writer_t* w, const char* name, const char* label, 
+                  const char* label_value, uint64_t us)
+{
+    char  digits[28];
+    char* end = digits + sizeof(digits);
+    char* p;
+
+    prom_sample_name(w, name, label, label_value);
+    *--end = '\n';
+    p = prom_dec(end, (uint32_t)(us % 1000000u), 6);
+    *--p = '.';
+    p = prom_dec64(p, us / 1000000u);
+    prom_put(w, p, (size_t)(digits + sizeof(digits) - p));
+}
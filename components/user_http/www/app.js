@@ -0,0 +1,56 @@
+// Remote relay web control
+// State is pushed by the device on /ws, toggles are sent back on it
+// Buttons are created from the state length: 4 hex digits per
+// 16 channels, 8 buttons per row
+function ensureButtons(prefix, count) {
+  let box = document.getElementById(prefix == 'out' ? 'outputs' : 'inputs');
+  for (let i = box.querySelectorAll('button').length; i < count; i++) {
+    if (i % 8 == 0) {
+      let row = document.createElement('div');
+      row.className = 'grid';
+      box.appendChild(row);
+    }
+    let btn = document.createElement('button');
+    btn.id = prefix+i;
+    btn.className = 'btn off';
+    btn.innerText = i;
+    if (prefix == 'out') btn.onclick = () => toggle(i);
+    else btn.disabled = true;
+    box.lastChild.appendChild(btn);
+  }
+}
+function setBtn(id, on) {
+  let btn = document.getElementById(id);
+  btn.classList.toggle('on', on);
+  btn.classList.toggle('off', !on);
+}
+function setBits(prefix, hex) {
+  let words = hex.length / 4;
+  ensureButtons(prefix, 16 * words);
+  for (let k = 0; k < words; k++) {
+    // Most significant word first
+    let v = parseInt(hex.substr(hex.length - 4 * (k + 1), 4), 16);
+    for (let i = 0; i < 16; i++) setBtn(prefix+(16*k+i), !!((v >> i) & 1));
+  }
+}
+function setMqtt(on) {
+  let indicator = document.getElementById('mqtt-indicator');
+  indicator.innerText = on ? "Connected" : "Disconnected";
+  indicator.style.color = on ? "green" : "red";
+}
+let ws = null;
+function connect() {
+  ws = new WebSocket(`ws://${location.host}/ws`);
+  ws.onmessage = (e) => {
+    let d = JSON.parse(e.data);
+    if (d.out !== undefined) setBits('out', d.out);
+    if (d.in !== undefined) setBits('in', d.in);
+    if (d.mqtt !== undefined) setMqtt(d.mqtt == 1);
+  };
+  ws.onclose = () => setTimeout(connect, 2000);
+}
+function toggle(pin) {
+  if (ws && ws.readyState == 1) ws.send('toggle=' + pin);
+  else fetch(`/toggle?pin=${pin}`);
+}
+connect();
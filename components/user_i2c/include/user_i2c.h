@@ -1,7 +1,11 @@
 #ifndef USER_I2C_H
 #define USER_I2C_H
 
+#include <stdint.h>
+#include <stddef.h>
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #define I2C0_SCL_IO GPIO_NUM_17     // GPIO number used for I2C master clock
 #define I2C0_SDA_IO GPIO_NUM_5      // GPIO number used for I2C master data 
@@ -12,34 +16,182 @@
 #define TCA_ADDR_1 0x20 // I2C device address
 #define TCA_ADDR_2 0x27 // I2C device address
 
+// TCA9555 expanders on the bus (0x20 - 0x27), the device table 
+// in user_i2c.c sets their address and direction mask
+#define TCA_MAX_DEVICES  8
+#define TCA_MAX_CHANNELS (TCA_MAX_DEVICES*16)
+
+#define I2C_ACCESS_QUEUE_LEN 16 // Pending commands on the I2C task
+#define I2C_BATCH_MAX        32 // Maximum commands folded in one I2C commit
+
+#define TCA_INTR_DEBOUNCE_US 5000 // Input edges closer than this are merged in one read
+
+#define I2C_REPLY_SLOTS        8 // Concurrent requests waiting for an I2C task reply
+#define I2C_REPLY_NOTIFY_INDEX 1 // Task notification index used to signal replies
+#define I2C_NO_REPLY          -1
+
+#define I2C_STATE_SUBSCRIBERS  4 // Tasks notified on every published state update
+
+// Timed output actions. A channel has at most one pending timer, 
+// expiries within I2C_TIMER_MERGE_US of each other are written 
+// in the same I2C commit
+#define I2C_TIMERS_MAX     TCA_MAX_CHANNELS
+#define I2C_TIMER_MERGE_US 1000
+
+// Bus errors. A failed transaction is tried again I2C_RETRIES times, 
+// the wait doubling from I2C_RETRY_BACKOFF_US. A device still failing 
+// is marked down and its state is served from the last good read, 
+// flagged stale. Recovery: bus reset (SCL clocked until SDA is 
+// released), probe, direction mask, last output word written again. 
+// Tried after I2C_RECOVERY_MIN_MS, the interval doubling on every 
+// failure up to I2C_RECOVERY_MAX_MS
+#define I2C_RETRIES          2
+#define I2C_RETRY_BACKOFF_US 200
+#define I2C_RECOVERY_MIN_MS  10
+#define I2C_RECOVERY_MAX_MS  2000
+
+// Background scrubber, run by the I2C task when no command is pending. 
+// Every I2C_SCRUB_OUTPUT_MS the direction and output registers are 
+// read back and rewritten if they drifted (expander reset by a 
+// brown-out), every I2C_SCRUB_INPUT_MS the inputs are polled for a 
+// change whose edge was missed. 0 disables a check. A pass is one 
+// burst on the bus, it gives way to a queued command between devices
+#ifndef I2C_SCRUB_OUTPUT_MS
+#define I2C_SCRUB_OUTPUT_MS  1000
+#endif
+#ifndef I2C_SCRUB_INPUT_MS
+#define I2C_SCRUB_INPUT_MS   500
+#endif
+
 
 // -----------------------------------------------------
 // i2c device data exchange struct
 typedef enum 
 {   
-    TCA_CFG_INPUT,
-    TCA_CFG_OUTPUT,
-    TCA_INTR_CHANGE,  // TCA input change interruption
-    TCA_OUT_INIT,
+    TCA_DEV_INIT,         // Boot: output levels, then direction masks, then read back
     TCA_REFRESH_INP,
-    HTTP_TCA_INP_GET,     // HTTP input status request 
     HTTP_TCA_OUT_SET,     // HTTP output set pins 
-    HTTP_TCA_OUT_GET,      // HTTP output status request
-    MQTT_TCA_INP_GET,     // HTTP input status request 
-    MQTT_TCA_OUT_SET,     // HTTP output set pins 
-    MQTT_TCA_OUT_GET      // HTTP output status request
+    MQTT_TCA_OUT_SET,     // MQTT output set pins 
+    TCA_OUT_BITS_SET,     // Set the outputs selected by tca_out_mask
+    TCA_OUT_BITS_CLEAR,   // Clear the outputs selected by tca_out_mask
+    TCA_OUT_BITS_TOGGLE,  // Toggle the outputs selected by tca_out_mask
+    TCA_OUT_BITS_WRITE,   // Write tca_out_stat on the outputs selected by tca_out_mask
+    TCA_OUT_TIMER,        // No change now, only arms the timer on tca_out_mask
+    TCA_SEQ_START,        // Run the sequence loaded in slot tca_word (user_seq.h)
+    TCA_SEQ_CANCEL,       // Stop the sequence of slot tca_word
+    TCA_RULES_LOAD        // Switch to the rules table staged by rules_store()
 } i2c_action_type_t;
 
+// Timer armed by an output command, duration_ms after it is applied:
+// - TCA_TIMER_OFF:    the outputs are turned off (pulse, delayed off)
+// - TCA_TIMER_REVERT: the outputs go back to their level before the command
+// Any later command on a channel replaces (or cancels) its timer
+typedef enum
+{
+    TCA_TIMER_NONE,
+    TCA_TIMER_OFF,
+    TCA_TIMER_REVERT
+} tca_timer_type_t;
+
+// -----------------------------------------------------
+// Channel state of up to TCA_MAX_CHANNELS, word k holds 
+// channels 16*k .. 16*k+15. Outputs and inputs are numbered 
+// separately, in device table order
+typedef struct tca_bank_t
+{
+    uint16_t word[TCA_MAX_DEVICES];
+} tca_bank_t;
+
+
+// Output commands act on one 16 channel word of the output bank, 
+// or on tca_words words at once (bank commands): every word of a 
+// bank command is folded in the same batch, so it is applied whole
 typedef struct i2c_access_ctrl_t
 {
-    uint16_t tca_in_stat;
     uint16_t tca_out_stat;
+    uint16_t tca_out_mask; // Bit commands: outputs affected by the command
+    uint8_t  tca_word;     // Output word: channels 16*tca_word .. 16*tca_word+15
     i2c_action_type_t i2c_action;
+    int8_t   reply_slot;   // Reply slot of user_i2c_request(), I2C_NO_REPLY otherwise
+    uint32_t reply_tag;    // Correlation id checked against the reply slot
+    int64_t  ingress_us;   // Handler entry time (latency tracing), enqueue time if 0
+    int64_t  enqueue_us;   // Set by user_i2c_send() / user_i2c_request()
+    tca_timer_type_t tca_timer; // Output commands: timer armed on the outputs changed
+    uint32_t duration_ms;       // Timer duration
+    uint32_t ack_tag;           // MQTT acknowledgement posted once applied, 0 if none
+    uint8_t    tca_words;       // Bank commands: words in use, 0 for a tca_word command
+    tca_bank_t tca_bank_mask;   // Bank commands: tca_out_mask of each word
+    tca_bank_t tca_bank_stat;   // Bank commands: tca_out_stat of each word
 } i2c_access_ctrl_handle_t;
 
 
+// -----------------------------------------------------
+// TCA state snapshot, written only by the I2C task and 
+// readable from any task without queues or locks (seqlock)
+typedef struct tca_state_t
+{
+    tca_bank_t in;
+    tca_bank_t out;
+    uint8_t  in_words;     // Input words in use
+    uint8_t  out_words;    // Output words in use
+    uint32_t seq;          // Incremented on every published update
+    int64_t  timestamp_us; // esp_timer time of the last update
+    int64_t  inp_edge_us;  // esp_timer time of the edge behind the last input change
+    bool     stale;        // A device is down, its words hold the last good state
+} tca_state_t;
+
+
+// -----------------------------------------------------
+// I2C task counters, commands_received / i2c_transactions 
+// gives the coalescing ratio
+typedef struct i2c_stats_t
+{
+    uint32_t cmd_received;     // Commands taken from i2C_access_queue
+    uint32_t cmd_dropped;      // Commands refused by a full i2C_access_queue
+    uint32_t i2c_transactions; // Transactions issued on the bus
+    uint32_t i2c_errors;       // Transactions that returned an error
+    uint64_t bus_time_us;      // Time spent in bus transactions
+    uint32_t batches;          // I2C commits (one per queue drain)
+    uint32_t intr_edges;       // Interruption edges latched by the ISR
+    uint32_t queue_depth;      // Commands waiting on i2C_access_queue
+    uint32_t queue_high_water; // Most commands ever waiting on i2C_access_queue
+    uint32_t stack_free;       // I2CCtrl stack high water mark (bytes never used)
+    int64_t  restore_us;       // esp_timer time the boot output levels were written, 0 before
+    uint32_t timers_active;    // Output timers pending
+    uint32_t timer_expiries;   // Output timers expired
+    uint32_t timer_commits;    // I2C commits triggered by timer expiries
+    uint32_t seq_steps;        // Sequence steps written
+    uint32_t rules_active;     // Input to output rules in use
+    uint32_t rule_evals;       // Input reads followed by a rules evaluation
+    uint32_t rule_writes;      // Evaluations that changed an output
+    uint32_t i2c_retries;      // Transactions tried again after an error
+    uint32_t devices_down;     // Devices not answering, served from their last good state
+    uint32_t device_failures;  // Devices marked down
+    uint32_t bus_resets;       // Bus resets by the recovery
+    uint32_t recoveries;       // Devices brought back
+    uint32_t recovery_failures;// Recovery attempts that failed
+    int64_t  recovery_last_us; // Down time of the last device brought back
+    int64_t  recovery_max_us;  // Longest down time
+    uint32_t scrub_passes;     // Scrubber passes completed
+    uint32_t scrub_yields;     // Scrubber passes interrupted by a queued command
+    uint32_t scrub_config;     // Direction registers found wrong and rewritten
+    uint32_t scrub_output;     // Output registers found wrong and rewritten
+    uint32_t scrub_input;      // Input changes found by polling, edge missed
+} i2c_stats_t;
+
+
 // -----------------------------------------------------
 esp_err_t user_i2c0_init();
+void user_i2c_state_get(tca_state_t* state);
+void user_i2c_stats_get(i2c_stats_t* stats);
+BaseType_t user_i2c_send(const i2c_access_ctrl_handle_t* cmd, TickType_t wait);
+BaseType_t user_i2c_send_to_front(const i2c_access_ctrl_handle_t* cmd, TickType_t wait);
+void user_i2c_intr_from_isr(void);
+esp_err_t user_i2c_state_subscribe(TaskHandle_t task);
+esp_err_t user_i2c_request(const i2c_access_ctrl_handle_t* cmd, tca_state_t* reply, TickType_t timeout);
+
+int     tca_bank_to_hex(const tca_bank_t* bank, uint8_t words, char* buf, size_t size);
+uint8_t tca_bank_from_hex(const char* hex, size_t len, tca_bank_t* bank);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,32 @@
+#ifndef USER_PERSIST_H
+#define USER_PERSIST_H
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "user_i2c.h"
+
+// -----------------------------------------------------
+// Output state kept in NVS across resets. The writer task 
+// follows the published TCA state and writes the output bank 
+// at most once per PERSIST_WRITE_INTERVAL_MS, whatever the 
+// number of changes in between, the last state is always written
+#define PERSIST_NVS_NAMESPACE      "relay"
+#define PERSIST_NVS_KEY_OUT        "out"
+#define PERSIST_WRITE_INTERVAL_MS  5000
+
+typedef struct persist_stats_t
+{
+    uint32_t writes;       // Output bank written in NVS
+    uint32_t write_errors; // NVS writes or commits that failed
+    uint32_t changes;      // State updates seen by the writer (coalesced in writes)
+} persist_stats_t;
+
+
+// -----------------------------------------------------
+esp_err_t persist_out_load(tca_bank_t* bank, uint8_t words);
+esp_err_t persist_out_read(tca_bank_t* bank, uint8_t words);
+esp_err_t persist_out_save(const tca_bank_t* bank, uint8_t words);
+esp_err_t persist_start(void);
+void      persist_stats_get(persist_stats_t* stats);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef USER_RULES_H
+#define USER_RULES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "user_i2c.h"
+
+// -----------------------------------------------------
+// Local input to output rules, evaluated by the I2C task right 
+// after the input read and written in the same commit: no broker 
+// round trip. Text form kept in NVS, compiled to bank masks when 
+// loaded, rules separated by ';':
+// - "oN=C": output N follows condition C
+// - "oN+C": output N is set while C is true (latch set)
+// - "oN-C": output N is cleared while C is true (latch reset, wins on set)
+// - "oN#C": output N is forced off while C is true (interlock), 
+//           commands cannot turn it on either
+// C is "iM", "!iM" (NOT), or such terms joined by '&' (AND) or 
+// '|' (OR), not both. e.g. "o2=i0;o7#!i3;o5+i1&i4;o5-i2"
+// Follow and latch rules act on input changes, an output command 
+// holds until the next one
+#define RULES_MAX        32
+#define RULES_TEXT_LEN   512 // Longest rules text, as MQTT_RX_PAYLOAD_LEN
+#define RULES_NVS_KEY    "rules"
+
+
+// -----------------------------------------------------
+// Boot, before the I2C task starts
+esp_err_t rules_load(void);
+// Any task: compile, save and queue the new table to the I2C task. 
+// An empty text removes every rule. ESP_OK once queued, a failed 
+// NVS save is only logged (the rules are lost on reset)
+esp_err_t rules_store(const char* text, size_t len);
+
+// I2C task only, both return the output words changed (bit per word)
+void    rules_install(void);
+uint8_t rules_eval(const tca_bank_t* in, tca_bank_t* out, uint8_t out_words);
+uint8_t rules_interlock(tca_bank_t* out, uint8_t out_words);
+uint8_t rules_count(void);
+
+#endif
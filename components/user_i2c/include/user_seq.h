@@ -0,0 +1,50 @@
+#ifndef USER_SEQ_H
+#define USER_SEQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "user_i2c.h"
+
+// -----------------------------------------------------
+// Output sequences: compiled once when uploaded, kept in NVS 
+// under their name and run by the I2C task. Text form, steps 
+// separated by ';':
+// - "mask,value": value written on the outputs of mask, hex banks 
+//   as relay/output/write. All the words of a step go in one commit
+// - "wT":         wait T ms before the next step
+// e.g. "1,1;w200;e,e;w1000;f,0"
+// Step times count from the sequence start, the I2C time of the 
+// previous steps does not add up. A sequence moves one step per I2C 
+// commit: steps closer than I2C_TIMER_MERGE_US are written one after 
+// the other, never folded. Output commands received while a 
+// sequence runs are applied, the next steps write over them
+#define SEQ_NAME_LEN    12 // [A-Za-z0-9_-], NVS key is "s." + name
+#define SEQ_MAX_STEPS   32
+#define SEQ_RUNNING_MAX 2  // Sequences running at the same time
+#define SEQ_NVS_PREFIX  "s."
+#define SEQ_SLOT_ALL    0xFF // seq_end(): every running sequence
+
+typedef struct seq_step_t
+{
+    uint32_t   delay_ms; // From the previous step, from the start for the first one
+    tca_bank_t mask;     // Empty on a trailing wait
+    tca_bank_t value;
+} seq_step_t;
+
+
+// -----------------------------------------------------
+// Any task. A sequence is started (cancelled) by a command 
+// on the I2C queue, the functions do not wait for it
+esp_err_t seq_store(const char* name, size_t name_len, const char* text, size_t len);
+esp_err_t seq_run(const char* name, size_t name_len);
+esp_err_t seq_cancel(const char* name, size_t name_len);
+
+// I2C task only
+void    seq_begin(uint8_t slot, uint16_t run_id, int64_t now_us);
+void    seq_end(uint8_t slot, uint16_t run_id);
+bool    seq_step_take(int64_t limit_us, uint8_t* taken, seq_step_t* step, uint8_t* words);
+int64_t seq_next_due_us(void);
+
+#endif
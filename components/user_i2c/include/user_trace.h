@@ -0,0 +1,40 @@
+#ifndef USER_TRACE_H
+#define USER_TRACE_H
+
+#include <stdint.h>
+
+// -----------------------------------------------------
+// Command latency tracing. Each stage keeps a log2 histogram 
+// (4 sub-buckets per power of two, 1 us resolution below 4 us) 
+// in RAM, percentiles are within 25% of the recorded value
+#define TRACE_BUCKETS 124
+
+typedef enum
+{
+    TRACE_INGRESS,     // MQTT/HTTP handler entry to I2C queue enqueue
+    TRACE_QUEUE,       // I2C queue enqueue to dequeue by the I2C task
+    TRACE_BATCH,       // Dequeue to I2C start (coalescing wait)
+    TRACE_I2C,         // I2C output write and readback
+    TRACE_PUB_ENQUEUE, // I2C end to MQTT publish queue
+    TRACE_PUBLISH,     // MQTT publish queue to relay/output/pub sent
+    TRACE_ACTUATE,     // End to end: ingress to I2C end
+    TRACE_E2E_PUB,     // End to end: ingress to relay/output/pub sent
+    TRACE_STAGES
+} trace_stage_t;
+
+typedef struct trace_summary_t
+{
+    uint32_t count;
+    uint32_t p50_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} trace_summary_t;
+
+
+// -----------------------------------------------------
+void        trace_record(trace_stage_t stage, int64_t start_us, int64_t end_us);
+void        trace_summary_get(trace_stage_t stage, trace_summary_t* summary);
+const char* trace_stage_name(trace_stage_t stage);
+void        trace_reset(void);
+
+#endif
@@ -6,10 +6,15 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <string.h>
+#include <inttypes.h>
 
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_check.h"
+#include "esp_timer.h"
 
 #include "driver/gpio.h"
 #include "driver/i2c_master.h"
@@ -21,22 +26,193 @@
 #include "user_i2c.h"
 #include "tca9555.h"
 #include "user_mqtt.h"
+#include "user_trace.h"
+#include "user_persist.h"
+#include "user_seq.h"
+#include "user_rules.h"
 
 static const char* TAG = "I2C";
 
 static i2c_master_bus_handle_t i2c0BusHandler;
-i2c_master_dev_handle_t i2c0_tca_output;
-i2c_master_dev_handle_t i2c0_tca_input;
+
+// Expanders that may be fitted on the bus, in channel order
+// - dir_mask: 1 for input pins, 0 for output pins
+// - restore_mask: outputs set back to their saved level at boot (1) 
+//   or forced off (0)
+// Devices that do not answer the probe at boot are skipped
+typedef struct tca_device_cfg_t
+{
+    uint16_t address;
+    uint16_t dir_mask;
+    uint16_t restore_mask;
+} tca_device_cfg_t;
+
+static const tca_device_cfg_t tca_device_cfg[] =
+{
+    {TCA_ADDR_1, 0x0000, 0xFFFF}, // Relay outputs
+    {TCA_ADDR_2, 0xFFFF, 0x0000}, // Digital inputs
+};
+
+#define TCA_DEVICE_CFG_COUNT (int)(sizeof(tca_device_cfg) / sizeof(tca_device_cfg[0]))
+
+// Devices found at boot
+typedef struct tca_device_t
+{
+    i2c_master_dev_handle_t handle;
+    uint16_t address;
+    uint16_t dir_mask;
+    uint16_t restore_mask;
+    int8_t   out_word; // Output bank word driven by this device, -1 if none
+    int8_t   in_word;  // Input bank word read from this device, -1 if none
+    bool     down;     // Not answering, see i2c_recover()
+    int64_t  down_us;  // esp_timer time it was marked down
+    int64_t  retry_us; // Next recovery attempt
+    uint32_t retry_ms; // Recovery interval, doubled on every failure
+} tca_device_t;
+
+// Device transactions run with retries by i2c_xfer()
+typedef enum
+{
+    I2C_XFER_CONFIG, // Direction mask
+    I2C_XFER_WRITE,  // Output port
+    I2C_XFER_READ,   // Input port
+    I2C_XFER_READ_CONFIG, // Direction register, scrubber
+    I2C_XFER_READ_OUTPUT  // Output register, scrubber
+} i2c_xfer_t;
+
+static tca_device_t tca_device[TCA_MAX_DEVICES];
+static uint8_t      tca_device_count = 0;
+static uint8_t      tca_down_mask = 0; // Devices down, bit per tca_device entry
+static uint8_t      tca_out_words = 0;
+static uint8_t      tca_in_words  = 0;
+static tca_bank_t   tca_out_boot;  // Output levels written by TCA_DEV_INIT
 
 extern QueueHandle_t i2C_access_queue;
-extern QueueHandle_t http_tca_out_get_queue; // Get input status
-extern QueueHandle_t http_tca_inp_get_queue; // Get input status
-extern QueueHandle_t mqtt_tca_exchange_queue;
+
+// Published TCA state. tca_state_seq is odd while the I2C task is updating it
+static atomic_uint  tca_state_seq = 0;
+static tca_state_t  tca_state;
+static portMUX_TYPE tca_state_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t tca_state_subscriber[I2C_STATE_SUBSCRIBERS] = {NULL};
+
+// Authoritative device status, owned by the I2C task
+typedef struct i2c_task_ctx_t
+{
+    tca_bank_t tca_output_status;
+    tca_bank_t tca_input_status;
+    tca_bank_t tca_output_written; // Output registers as last written, checked by the scrubber
+} i2c_task_ctx_t;
+
+// Background scrubber (I2C task only)
+typedef struct i2c_scrub_t
+{
+    int64_t out_due_us; // Next direction and output check, 0 if disabled
+    int64_t in_due_us;  // Next input poll, 0 if disabled
+    bool    running;    // A pass gave way to a command, resumes at next
+    bool    out_pass;   // Checks of the current pass
+    bool    in_pass;
+    uint8_t next;       // Device the pass goes on with
+} i2c_scrub_t;
+
+// Commands folded between two I2C commits
+typedef struct i2c_batch_t
+{
+    tca_bank_t out_target; // Output words after all folded commands
+    uint8_t  out_dirty;   // Output words touched by a folded command (bit per word)
+    uint8_t  out_force;   // Output words written even if they match the device
+    bool     out_publish; // Publish the resulting output on MQTT
+    bool     inp_dirty;   // Input read requested (refresh or interruption)
+    int64_t  inp_edge_us; // Capture time of the interruption edge, 0 on refresh
+    bool     rules_due;   // Rules evaluated even on unchanged inputs (new table, boot)
+    uint8_t  seq_taken;   // Sequence slots stepped in this batch (bit per slot)
+    uint8_t  trace_count; // Output commands traced until actuation
+    struct
+    {
+        int64_t ingress_us;
+        int64_t dequeue_us;
+    } trace[I2C_BATCH_MAX];
+    uint8_t  reply_count; // Requests answered once the batch is committed
+    struct
+    {
+        int8_t   slot;
+        uint32_t tag;
+    } reply[I2C_BATCH_MAX];
+    uint8_t  ack_count;   // MQTT acknowledgements posted once the batch is committed
+    uint32_t ack[I2C_BATCH_MAX];
+} i2c_batch_t;
+
+// Reply slots for user_i2c_request(). A slot is free when tag is 0, 
+// the I2C task only fills a slot whose tag still matches the request, 
+// so a timed out request never receives (or leaves behind) a late reply
+typedef struct i2c_reply_slot_t
+{
+    TaskHandle_t task;
+    uint32_t     tag;
+    bool         done;
+    tca_state_t  state;
+} i2c_reply_slot_t;
+
+static i2c_reply_slot_t i2c_reply_pool[I2C_REPLY_SLOTS];
+static uint32_t         i2c_reply_next_tag = 1;
+static portMUX_TYPE     i2c_reply_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static i2c_task_ctx_t i2c_task_ctx;
+static i2c_scrub_t    i2c_scrub;
+static i2c_stats_t    i2c_stats;
+static portMUX_TYPE   i2c_stats_mux = portMUX_INITIALIZER_UNLOCKED; // 64 bits and multi writer fields
+
+// I2C task notification bits
+#define I2C_NOTIFY_CMD  BIT0 // A command was queued on i2C_access_queue
+#define I2C_NOTIFY_INTR BIT1 // TCA interruption edge latched by the ISR
+#define I2C_NOTIFY_TIMER BIT2 // Output timer or sequence step due
+
+static TaskHandle_t i2c_task_handle = NULL;
+
+// Interruption edges latched by the ISR, consumed by the I2C task
+static portMUX_TYPE tca_intr_mux = portMUX_INITIALIZER_UNLOCKED;
+static int64_t      tca_intr_first_us = 0; // First edge not yet serviced
+static uint32_t     tca_intr_edges    = 0; // Edges not yet serviced
+
+// Output timers, owned by the I2C task: binary min-heap on due_us. 
+// Each channel belongs to one timer at most (tca_timer_mask), so the 
+// heap never holds more than one entry per channel
+typedef struct tca_timer_t
+{
+    int64_t  due_us;
+    uint16_t mask;  // Outputs written at expiry
+    uint16_t value; // Their level at expiry
+    uint8_t  word;
+} tca_timer_t;
+
+static tca_timer_t        tca_timer_heap[I2C_TIMERS_MAX];
+static uint16_t           tca_timer_count = 0;
+static uint16_t           tca_timer_mask[TCA_MAX_DEVICES]; // Channels with a pending timer
+static esp_timer_handle_t tca_timer_handle = NULL;
+static int64_t            tca_timer_armed_us = 0;          // Due time of the armed esp_timer, 0 if none
 
 // --------------------------------------------------------------------------------------------
 //
 static esp_err_t i2c_attach_device(uint16_t, i2c_master_bus_handle_t, i2c_master_dev_handle_t*);
 static void      i2c_handle_task(void* pVParameters);
+static void      tca_state_publish(const tca_bank_t* in, const tca_bank_t* out, int64_t inp_edge_us);
+static uint16_t  tca_out_apply(uint16_t out_stat, i2c_action_type_t action, uint16_t mask, uint16_t stat);
+static void      i2c_batch_out_word(i2c_batch_t* batch, const i2c_access_ctrl_handle_t* cmd, uint8_t word, 
+                                    uint16_t mask, uint16_t stat, int64_t dequeue_us);
+static void      i2c_batch_add(i2c_batch_t* batch, const i2c_access_ctrl_handle_t* cmd);
+static void      i2c_batch_commit(i2c_batch_t* batch);
+static bool      i2c_intr_take(int64_t* first_us);
+static void      i2c_reply_complete(int8_t slot, uint32_t tag);
+static void      i2c_queue_account(BaseType_t sent);
+static void      i2c_bus_time_add(int64_t start_us, int64_t end_us);
+static void      i2c_timer_callback(void* arg);
+static void      i2c_timer_add(int64_t due_us, uint8_t word, uint16_t mask, uint16_t value);
+static void      i2c_timer_cancel(uint8_t word, uint16_t mask);
+static void      i2c_timer_expire(i2c_batch_t* batch, int64_t now_us);
+static void      i2c_timer_arm(int64_t now_us);
+static void      i2c_seq_expire(i2c_batch_t* batch, int64_t now_us);
+static esp_err_t i2c_xfer(tca_device_t* dev, i2c_xfer_t xfer, uint16_t* bits);
+static void      i2c_recover(i2c_batch_t* batch, int64_t now_us);
+static void      i2c_scrub_run(i2c_batch_t* batch, int64_t now_us);
 
 // --------------------------------------------------------------------------------------------
 // 
@@ -56,33 +232,79 @@ esp_err_t user_i2c0_init()
     err = i2c_new_master_bus(&i2cMasterCfg,&i2c0BusHandler);
     ESP_RETURN_ON_ERROR(err,TAG,"%s",esp_err_to_name(err));
 
-    // Attach TCA outputs
-    err = i2c_attach_device(TCA_ADDR_1,i2c0BusHandler,&i2c0_tca_output);
-    ESP_RETURN_ON_ERROR(err,TAG,"%s",esp_err_to_name(err));
-
-    // Attach TCA inputs
-    err = i2c_attach_device(TCA_ADDR_2,i2c0BusHandler,
-                                     &i2c0_tca_input);
-    ESP_RETURN_ON_ERROR(err,TAG,"%s",esp_err_to_name(err));
-    
-    // Teste i2c devices connection
-    if(err == ESP_OK)
+    // Probe the device table and attach the expanders that answer
+    for(int i = 0; (i < TCA_DEVICE_CFG_COUNT) && (tca_device_count < TCA_MAX_DEVICES); i++)
     {
-        err = i2c_master_probe(i2c0BusHandler,TCA_ADDR_1,10);
-        err = i2c_master_probe(i2c0BusHandler,TCA_ADDR_2,10);
+        tca_device_t* dev = &tca_device[tca_device_count];
+
+        if(i2c_master_probe(i2c0BusHandler,tca_device_cfg[i].address,10) != ESP_OK)
+        {
+            ESP_LOGW(TAG,"No device at address 0x%x, skipped.",tca_device_cfg[i].address);
+            continue;
+        }
+
+        err = i2c_attach_device(tca_device_cfg[i].address,i2c0BusHandler,&dev->handle);
+        ESP_RETURN_ON_ERROR(err,TAG,"%s",esp_err_to_name(err));
+
+        dev->address  = tca_device_cfg[i].address;
+        dev->dir_mask = tca_device_cfg[i].dir_mask;
+        dev->restore_mask = tca_device_cfg[i].restore_mask;
+        dev->out_word = (dev->dir_mask != 0xFFFF) ? (int8_t)tca_out_words++ : -1;
+        dev->in_word  = (dev->dir_mask != 0x0000) ? (int8_t)tca_in_words++  : -1;
+        tca_device_count++;
+
+        ESP_LOGI(TAG,"Device at address 0x%x was detected, direction 0x%04x.",dev->address,dev->dir_mask);
     }
 
+    if(tca_device_count == 0)
+        err = ESP_ERR_NOT_FOUND;
+
     if(err == ESP_OK)
     {
-        ESP_LOGI(TAG,"Devices at address 0x%x and 0x%x were detected.",TCA_ADDR_1,TCA_ADDR_2);
-       
+        tca_bank_t saved;
+
+        // Boot output levels: the saved state on the channels with the 
+        // restore policy, off otherwise (or when nothing was saved)
+        if(persist_out_load(&saved,tca_out_words) == ESP_OK)
+        {
+            for(int i = 0; i < tca_device_count; i++)
+                if(tca_device[i].out_word >= 0)
+                    tca_out_boot.word[tca_device[i].out_word] = 
+                        saved.word[tca_device[i].out_word] & tca_device[i].restore_mask & ~tca_device[i].dir_mask;
+            ESP_LOGI(TAG,"Saved outputs loaded.");
+        }
+
+        // Local rules, evaluated from the first input read
+        if(rules_load() == ESP_OK)
+            i2c_stats.rules_active = rules_count();
+
+        // Initial snapshot, published before the I2C task exists
+        tca_state.out_words = tca_out_words;
+        tca_state.in_words  = tca_in_words;
+        for(int i = 0; i < tca_device_count; i++)
+            if(tca_device[i].in_word >= 0)
+                tca_state.in.word[tca_device[i].in_word] = tca_device[i].dir_mask;
+
         // Create a queue to access the I2C bus
-        i2C_access_queue = xQueueCreate(5,sizeof(i2c_access_ctrl_handle_t));
+        i2C_access_queue = xQueueCreate(I2C_ACCESS_QUEUE_LEN,sizeof(i2c_access_ctrl_handle_t));
+
+        // Output timers wake the I2C task on the earliest expiry
+        const esp_timer_create_args_t timer_args = 
+        {
+            .callback = i2c_timer_callback,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "I2CTimer"
+        };
+        err = esp_timer_create(&timer_args,&tca_timer_handle);
+        ESP_RETURN_ON_ERROR(err,TAG,"%s",esp_err_to_name(err));
 
         // Create an task to control I2C access, pinned to core 1
         xTaskCreatePinnedToCore(i2c_handle_task,"I2CCtrl",
             configMINIMAL_STACK_SIZE+2048,
-            NULL,5,NULL,1);
+            NULL,5,&i2c_task_handle,1);
+
+        // Output state saving, a failure only loses the restore
+        persist_start();
     }
     else
     {
@@ -112,91 +334,1222 @@ static esp_err_t i2c_attach_device(uint16_t device_address, i2c_master_bus_handl
 }
 
 
+// -------------------------------------------------------------------
+// Enqueue time of a command, also its ingress when the caller did not stamp it
+static inline void i2c_trace_stamp(i2c_access_ctrl_handle_t* msg)
+{
+    msg->enqueue_us = esp_timer_get_time();
+    if(msg->ingress_us == 0)
+        msg->ingress_us = msg->enqueue_us;
+}
+
+// -------------------------------------------------------------------
+// Queue a command to the I2C task and wake it up
+BaseType_t user_i2c_send(const i2c_access_ctrl_handle_t* cmd, TickType_t wait)
+{
+    i2c_access_ctrl_handle_t msg = *cmd;
+    msg.reply_slot = I2C_NO_REPLY;
+    i2c_trace_stamp(&msg);
+
+    BaseType_t x_queue_answer = xQueueSend(i2C_access_queue,&msg,wait);
+    i2c_queue_account(x_queue_answer);
+    if(x_queue_answer == pdTRUE)
+        xTaskNotify(i2c_task_handle,I2C_NOTIFY_CMD,eSetBits);
+    return x_queue_answer;
+}
+
+// -------------------------------------------------------------------
+// Queue a command ahead of the pending ones and wake the I2C task up
+BaseType_t user_i2c_send_to_front(const i2c_access_ctrl_handle_t* cmd, TickType_t wait)
+{
+    i2c_access_ctrl_handle_t msg = *cmd;
+    msg.reply_slot = I2C_NO_REPLY;
+    i2c_trace_stamp(&msg);
+
+    BaseType_t x_queue_answer = xQueueSendToFront(i2C_access_queue,&msg,wait);
+    i2c_queue_account(x_queue_answer);
+    if(x_queue_answer == pdTRUE)
+        xTaskNotify(i2c_task_handle,I2C_NOTIFY_CMD,eSetBits);
+    return x_queue_answer;
+}
+
+// -------------------------------------------------------------------
+// Queue a command and wait until the I2C task has applied it
+// - reply: device state right after the command was committed
+// Any number of tasks may wait concurrently, up to I2C_REPLY_SLOTS
+esp_err_t user_i2c_request(const i2c_access_ctrl_handle_t* cmd, tca_state_t* reply, TickType_t timeout)
+{
+    i2c_access_ctrl_handle_t msg = *cmd;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed;
+    BaseType_t sent;
+    bool done = false;
+    int slot;
+
+    // Reserve a reply slot
+    portENTER_CRITICAL(&i2c_reply_mux);
+    for(slot = 0; slot < I2C_REPLY_SLOTS; slot++)
+        if(i2c_reply_pool[slot].tag == 0)
+            break;
+    if(slot < I2C_REPLY_SLOTS)
+    {
+        i2c_reply_pool[slot].tag  = i2c_reply_next_tag++;
+        i2c_reply_pool[slot].task = xTaskGetCurrentTaskHandle();
+        i2c_reply_pool[slot].done = false;
+        if(i2c_reply_next_tag == 0)
+            i2c_reply_next_tag = 1;
+        msg.reply_slot = slot;
+        msg.reply_tag  = i2c_reply_pool[slot].tag;
+    }
+    portEXIT_CRITICAL(&i2c_reply_mux);
+
+    if(slot == I2C_REPLY_SLOTS)
+        return ESP_ERR_NO_MEM;
+
+    i2c_trace_stamp(&msg);
+    sent = xQueueSend(i2C_access_queue,&msg,timeout);
+    i2c_queue_account(sent);
+    if(sent == pdTRUE)
+    {
+        xTaskNotify(i2c_task_handle,I2C_NOTIFY_CMD,eSetBits);
+
+        // Notifications are only a wake up, the slot tells whether it is ours
+        do
+        {
+            elapsed = xTaskGetTickCount() - start;
+            if(elapsed >= timeout)
+                break;
+            ulTaskNotifyTakeIndexed(I2C_REPLY_NOTIFY_INDEX,pdTRUE,timeout - elapsed);
+
+            portENTER_CRITICAL(&i2c_reply_mux);
+            done = i2c_reply_pool[slot].done;
+            portEXIT_CRITICAL(&i2c_reply_mux);
+        } while(!done);
+    }
+
+    // Release the slot, a late reply will not match the tag anymore
+    portENTER_CRITICAL(&i2c_reply_mux);
+    done = i2c_reply_pool[slot].done;
+    if(done)
+        *reply = i2c_reply_pool[slot].state;
+    i2c_reply_pool[slot].tag  = 0;
+    i2c_reply_pool[slot].task = NULL;
+    portEXIT_CRITICAL(&i2c_reply_mux);
+
+    return done ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+// -------------------------------------------------------------------
+// Answer a request with the state just published (I2C task only)
+static void i2c_reply_complete(int8_t slot, uint32_t tag)
+{
+    TaskHandle_t task = NULL;
+
+    if((slot < 0) || (slot >= I2C_REPLY_SLOTS))
+        return;
+
+    portENTER_CRITICAL(&i2c_reply_mux);
+    if(i2c_reply_pool[slot].tag == tag)
+    {
+        i2c_reply_pool[slot].state = tca_state;
+        i2c_reply_pool[slot].done  = true;
+        task = i2c_reply_pool[slot].task;
+    }
+    portEXIT_CRITICAL(&i2c_reply_mux);
+
+    if(task != NULL)
+        xTaskNotifyGiveIndexed(task,I2C_REPLY_NOTIFY_INDEX);
+}
+
+// -------------------------------------------------------------------
+// TCA interruption edge, called from the GPIO ISR
+// Only latches the edge time and notifies the I2C task, edges are 
+// never lost even if the command queue is full
+void IRAM_ATTR user_i2c_intr_from_isr(void)
+{
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL_ISR(&tca_intr_mux);
+    if(tca_intr_edges == 0)
+        tca_intr_first_us = now;
+    tca_intr_edges++;
+    portEXIT_CRITICAL_ISR(&tca_intr_mux);
+
+    if(i2c_task_handle != NULL)
+        xTaskNotifyFromISR(i2c_task_handle,I2C_NOTIFY_INTR,eSetBits,&xHigherPriorityTaskWoken);
+
+    //check if the interrupt raised the task priority
+    if(xHigherPriorityTaskWoken)
+        portYIELD_FROM_ISR(); //force context switch
+}
+
+// -------------------------------------------------------------------
+// Take the edges latched by the ISR (I2C task only)
+static bool i2c_intr_take(int64_t* first_us)
+{
+    uint32_t edges;
+
+    portENTER_CRITICAL(&tca_intr_mux);
+    edges = tca_intr_edges;
+    *first_us = tca_intr_first_us;
+    tca_intr_edges = 0;
+    portEXIT_CRITICAL(&tca_intr_mux);
+
+    i2c_stats.intr_edges += edges;
+    return (edges != 0);
+}
+
+// -------------------------------------------------------------------
+// Publish a new TCA state snapshot (I2C task only)
+// The critical section only keeps the writer from being preempted 
+// while the sequence is odd, readers never take the lock
+static void tca_state_publish(const tca_bank_t* in, const tca_bank_t* out, int64_t inp_edge_us)
+{
+    unsigned seq;
+
+    portENTER_CRITICAL(&tca_state_mux);
+    seq = atomic_load_explicit(&tca_state_seq,memory_order_relaxed);
+    atomic_store_explicit(&tca_state_seq,seq+1,memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    tca_state.in           = *in;
+    tca_state.out          = *out;
+    tca_state.in_words     = tca_in_words;
+    tca_state.out_words    = tca_out_words;
+    tca_state.seq          = (seq+2) >> 1;
+    tca_state.timestamp_us = esp_timer_get_time();
+    tca_state.stale        = (tca_down_mask != 0);
+    if(inp_edge_us != 0)
+        tca_state.inp_edge_us = inp_edge_us;
+
+    atomic_store_explicit(&tca_state_seq,seq+2,memory_order_release);
+    portEXIT_CRITICAL(&tca_state_mux);
+
+    // Wake the tasks waiting for state changes
+    for(int i = 0; i < I2C_STATE_SUBSCRIBERS; i++)
+        if(tca_state_subscriber[i] != NULL)
+            xTaskNotifyGive(tca_state_subscriber[i]);
+}
+
+// -------------------------------------------------------------------
+// Register a task to be notified (xTaskNotifyGive) on every 
+// published state update
+esp_err_t user_i2c_state_subscribe(TaskHandle_t task)
+{
+    esp_err_t err = ESP_ERR_NO_MEM;
+
+    portENTER_CRITICAL(&tca_state_mux);
+    for(int i = 0; i < I2C_STATE_SUBSCRIBERS; i++)
+    {
+        if(tca_state_subscriber[i] == NULL)
+        {
+            tca_state_subscriber[i] = task;
+            err = ESP_OK;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&tca_state_mux);
+
+    return err;
+}
+
+// -------------------------------------------------------------------
+// Read the last published TCA state snapshot (any task)
+void user_i2c_state_get(tca_state_t* state)
+{
+    unsigned seq_begin, seq_end;
+
+    do
+    {
+        seq_begin = atomic_load_explicit(&tca_state_seq,memory_order_acquire);
+        *state = *(volatile tca_state_t*)&tca_state;
+        atomic_thread_fence(memory_order_acquire);
+        seq_end = atomic_load_explicit(&tca_state_seq,memory_order_relaxed);
+    } while((seq_begin & 1) || (seq_begin != seq_end));
+}
+
+
+// -------------------------------------------------------------------
+// Compute the new output word for an output command, applied 
+// against the authoritative output status held by the I2C task
+static uint16_t tca_out_apply(uint16_t out_stat, i2c_action_type_t action, uint16_t mask, uint16_t stat)
+{
+    switch(action)
+    {
+        case MQTT_TCA_OUT_SET:
+        case HTTP_TCA_OUT_SET:
+            return stat;
+        case TCA_OUT_BITS_SET:
+            return out_stat | mask;
+        case TCA_OUT_BITS_CLEAR:
+            return out_stat & ~mask;
+        case TCA_OUT_BITS_TOGGLE:
+            return out_stat ^ mask;
+        case TCA_OUT_BITS_WRITE:
+            return (out_stat & ~mask) | (stat & mask);
+        default:
+            return out_stat;
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Write the coalesced batch on the devices: at most one output write
+// per touched device and one read per input device, whatever the 
+// number of commands folded in it. Inputs are read first, so the 
+// outputs driven by the local rules go in the same write. The rules 
+// run on input changes only: a plain refresh (GET /status?sync=1) 
+// does not force the rule outputs back over the later commands
+static void i2c_batch_commit(i2c_batch_t* batch)
+{
+    mqtt_access_ctrl_handle_t mqtt_pub_handle = {0};
+    tca_device_t* dev;
+    tca_bank_t inputs;
+    tca_bank_t pending;
+    uint16_t* out_status;
+    uint16_t  out_target;
+    uint16_t  bits;
+    uint8_t   rule_dirty = 0;
+    int64_t   i2c_start_us;
+    int64_t   i2c_end_us;
+    int64_t   ingress_us = 0;
+    bool      written = false;
+
+    if(batch->inp_dirty)
+    {
+        int64_t read_start_us = esp_timer_get_time();
+        inputs = i2c_task_ctx.tca_input_status;
+        for(int i = 0; i < tca_device_count; i++)
+        {
+            dev = &tca_device[i];
+            if((dev->in_word < 0) || dev->down)
+                continue;
+            // Acess I2C device and get input status, the last good one stays on error
+            if(i2c_xfer(dev,I2C_XFER_READ,&bits) == ESP_OK)
+                i2c_task_ctx.tca_input_status.word[dev->in_word] = bits & dev->dir_mask;
+        }
+        i2c_bus_time_add(read_start_us,esp_timer_get_time());
+
+        if((rules_count() != 0) && 
+           (batch->rules_due || (memcmp(&inputs,&i2c_task_ctx.tca_input_status,sizeof(inputs)) != 0)))
+        {
+            rule_dirty = rules_eval(&i2c_task_ctx.tca_input_status,&batch->out_target,tca_out_words);
+            i2c_stats.rule_evals++;
+            if(rule_dirty != 0)
+                i2c_stats.rule_writes++;
+        }
+    }
+
+    // Interlocked outputs stay off, whatever the commands of the batch
+    rule_dirty |= rules_interlock(&batch->out_target,tca_out_words);
+    if(rule_dirty != 0)
+    {
+        batch->out_dirty  |= rule_dirty;
+        batch->out_publish = true;
+    }
+
+    i2c_start_us = esp_timer_get_time();
+
+    for(int i = 0; (i < tca_device_count) && (batch->out_dirty != 0); i++)
+    {
+        dev = &tca_device[i];
+        if((dev->out_word < 0) || !(batch->out_dirty & BIT(dev->out_word)) || dev->down)
+            continue;
+
+        // Skip the bus when the folded commands cancel each other
+        out_status = &i2c_task_ctx.tca_output_status.word[dev->out_word];
+        out_target = batch->out_target.word[dev->out_word] & ~dev->dir_mask;
+        if((batch->out_force & BIT(dev->out_word)) || (out_target != *out_status))
+        {
+            // Acess I2C device, set and get output status. A device going 
+            // down keeps its target, written again by the recovery
+            if(i2c_xfer(dev,I2C_XFER_WRITE,&out_target) == ESP_OK)
+            {
+                i2c_task_ctx.tca_output_written.word[dev->out_word] = out_target;
+                if(i2c_xfer(dev,I2C_XFER_READ,&bits) == ESP_OK)
+                    *out_status = bits & ~dev->dir_mask;
+            }
+            written = true;
+        }
+    }
+
+    // Output commands of the batch are actuated now
+    i2c_end_us = esp_timer_get_time();
+    if(written)
+    {
+        trace_record(TRACE_I2C,i2c_start_us,i2c_end_us);
+        i2c_bus_time_add(i2c_start_us,i2c_end_us);
+    }
+    for(int i = 0; i < batch->trace_count; i++)
+    {
+        trace_record(TRACE_BATCH,batch->trace[i].dequeue_us,i2c_start_us);
+        trace_record(TRACE_ACTUATE,batch->trace[i].ingress_us,i2c_end_us);
+        if((ingress_us == 0) || (batch->trace[i].ingress_us < ingress_us))
+            ingress_us = batch->trace[i].ingress_us;
+    }
+
+    if(batch->out_dirty || batch->inp_dirty)
+        tca_state_publish(&i2c_task_ctx.tca_input_status,&i2c_task_ctx.tca_output_status,
+                          batch->inp_dirty ? batch->inp_edge_us : 0);
+
+    // Publish MQTT status on topic, once per batch. The mailboxes 
+    // never block: a state not taken yet by the publication task is 
+    // replaced, the I2C task does not wait on the broker
+    if(batch->inp_dirty)
+    {
+        mqtt_pub_handle.mqtt_action = MQTT_TCA_INP_PUB;
+        mqtt_pub_handle.tca_in_payload = i2c_task_ctx.tca_input_status;
+        mqtt_pub_handle.words = tca_in_words;
+        mqtt_pub_handle.timestamp_us = batch->inp_edge_us;
+        mqtt_pub_handle.ingress_us = 0;
+        mqtt_pub_handle.enqueue_us = 0;
+        user_mqtt_state_post(&mqtt_pub_handle);
+    }
+    if(batch->out_dirty && batch->out_publish)
+    {
+        mqtt_pub_handle.mqtt_action = MQTT_TCA_OUT_PUB;
+        mqtt_pub_handle.tca_out_payload = i2c_task_ctx.tca_output_status;
+        mqtt_pub_handle.words = tca_out_words;
+        mqtt_pub_handle.timestamp_us = 0;
+        mqtt_pub_handle.ingress_us = ingress_us; // Oldest command behind this state
+        mqtt_pub_handle.enqueue_us = esp_timer_get_time();
+        user_mqtt_state_post(&mqtt_pub_handle);
+        trace_record(TRACE_PUB_ENQUEUE,i2c_end_us,esp_timer_get_time());
+    }
+
+    // Every request folded in the batch is answered with the same result
+    for(int i = 0; i < batch->reply_count; i++)
+        i2c_reply_complete(batch->reply[i].slot,batch->reply[i].tag);
+    for(int i = 0; i < batch->ack_count; i++)
+        user_mqtt_ack_post(batch->ack[i],&i2c_task_ctx.tca_output_status,tca_out_words,i2c_end_us);
+
+    // Down devices keep the levels asked for, the others start 
+    // again from what the devices read back
+    pending = batch->out_target;
+    batch->out_target = i2c_task_ctx.tca_output_status;
+    for(int i = 0; (i < tca_device_count) && (tca_down_mask != 0); i++)
+        if(tca_device[i].down && (tca_device[i].out_word >= 0))
+            batch->out_target.word[tca_device[i].out_word] = pending.word[tca_device[i].out_word];
+    batch->out_dirty   = 0;
+    batch->out_force   = 0;
+    batch->out_publish = false;
+    batch->inp_dirty   = false;
+    batch->inp_edge_us = 0;
+    batch->rules_due   = false;
+    batch->seq_taken   = 0;
+    batch->trace_count = 0;
+    batch->reply_count = 0;
+    batch->ack_count   = 0;
+}
+
+
+// -------------------------------------------------------------------
+// Fold the part of an output command acting on one output word
+static void i2c_batch_out_word(i2c_batch_t* batch, const i2c_access_ctrl_handle_t* cmd, uint8_t word, 
+                               uint16_t mask, uint16_t stat, int64_t dequeue_us)
+{
+    uint16_t out_mask;
+    uint16_t out_level;
+
+    if(word >= tca_out_words)
+    {
+        ESP_LOGW(TAG,"Output word %u out of range.",word);
+        return;
+    }
+    out_mask  = ((cmd->i2c_action == MQTT_TCA_OUT_SET) || (cmd->i2c_action == HTTP_TCA_OUT_SET)) ? 
+                0xFFFF : mask;
+    out_level = batch->out_target.word[word];
+    batch->out_target.word[word] = tca_out_apply(out_level,cmd->i2c_action,mask,stat);
+
+    // A new command on a channel replaces its timer
+    i2c_timer_cancel(word,out_mask);
+    if((cmd->tca_timer != TCA_TIMER_NONE) && (out_mask != 0))
+        i2c_timer_add(dequeue_us + (int64_t)cmd->duration_ms*1000,word,out_mask,
+                      (cmd->tca_timer == TCA_TIMER_REVERT) ? (out_level & out_mask) : 0x0000);
+
+    batch->out_dirty  |= BIT(word);
+    batch->out_publish = true;
+}
+
+// -------------------------------------------------------------------
+// Fold one command into the current batch
+static void i2c_batch_add(i2c_batch_t* batch, const i2c_access_ctrl_handle_t* cmd)
+{
+    uint8_t word = cmd->tca_word;
+    int64_t dequeue_us = esp_timer_get_time();
+    int64_t cfg_start_us;
+
+    i2c_stats.cmd_received++;
+    trace_record(TRACE_INGRESS,cmd->ingress_us,cmd->enqueue_us);
+    trace_record(TRACE_QUEUE,cmd->enqueue_us,dequeue_us);
+
+    switch(cmd->i2c_action)
+    {
+        // Boot configuration, flush first. Each device gets its output 
+        // levels while the pins are still inputs (power on 0xFFFF on 
+        // the output port), then its direction mask, then is read back: 
+        // no relay is driven before its level is set, and the status 
+        // comes from a read of the configured device. A device failing 
+        // keeps the boot levels as target, written by the recovery
+        case TCA_DEV_INIT:
+            i2c_batch_commit(batch);
+            for(uint8_t k = 0; k < tca_out_words; k++)
+                i2c_timer_cancel(k,0xFFFF);
+            cfg_start_us = esp_timer_get_time();
+            for(int i = 0; i < tca_device_count; i++)
+            {
+                tca_device_t* dev = &tca_device[i];
+                uint16_t bits;
+
+                if(dev->out_word >= 0)
+                {
+                    batch->out_target.word[dev->out_word] = tca_out_boot.word[dev->out_word];
+                    bits = tca_out_boot.word[dev->out_word] & ~dev->dir_mask;
+                    if(dev->down || (i2c_xfer(dev,I2C_XFER_WRITE,&bits) != ESP_OK))
+                        continue;
+                    i2c_task_ctx.tca_output_written.word[dev->out_word] = bits;
+                }
+                if(dev->down || (i2c_xfer(dev,I2C_XFER_CONFIG,NULL) != ESP_OK) || 
+                   (i2c_xfer(dev,I2C_XFER_READ,&bits) != ESP_OK))
+                {
+                    ESP_LOGE(TAG,"Device 0x%x configuration failure.",dev->address);
+                    continue;
+                }
+                if(dev->out_word >= 0)
+                    i2c_task_ctx.tca_output_status.word[dev->out_word] = bits & ~dev->dir_mask;
+                if(dev->in_word >= 0)
+                    i2c_task_ctx.tca_input_status.word[dev->in_word] = bits & dev->dir_mask;
+            }
+            i2c_bus_time_add(cfg_start_us,esp_timer_get_time());
+
+            portENTER_CRITICAL(&i2c_stats_mux);
+            i2c_stats.restore_us = esp_timer_get_time();
+            portEXIT_CRITICAL(&i2c_stats_mux);
+            ESP_LOGI(TAG,"Outputs restored %"PRIi64" us after boot.",i2c_stats.restore_us);
+
+            // Published by the commit, inputs read again for the rules
+            batch->out_dirty   = (uint8_t)(BIT(tca_out_words) - 1);
+            batch->out_publish = true;
+            batch->inp_dirty   = true;
+            batch->rules_due   = true;
+            break;
+        
+        case TCA_REFRESH_INP:
+            batch->inp_dirty = true;
+            break;
+        
+        case MQTT_TCA_OUT_SET:
+        case HTTP_TCA_OUT_SET:
+        case TCA_OUT_BITS_SET:
+        case TCA_OUT_BITS_CLEAR:
+        case TCA_OUT_BITS_TOGGLE:
+        case TCA_OUT_BITS_WRITE:
+        case TCA_OUT_TIMER:
+            // Bank commands skip the words they leave untouched
+            if(cmd->tca_words != 0)
+            {
+                for(uint8_t k = 0; (k < cmd->tca_words) && (k < TCA_MAX_DEVICES); k++)
+                    if((cmd->tca_bank_mask.word[k] != 0) || (cmd->i2c_action == MQTT_TCA_OUT_SET) || 
+                       (cmd->i2c_action == HTTP_TCA_OUT_SET))
+                        i2c_batch_out_word(batch,cmd,k,cmd->tca_bank_mask.word[k],cmd->tca_bank_stat.word[k],dequeue_us);
+            }
+            else
+                i2c_batch_out_word(batch,cmd,word,cmd->tca_out_mask,cmd->tca_out_stat,dequeue_us);
+
+            if(batch->trace_count < I2C_BATCH_MAX)
+            {
+                batch->trace[batch->trace_count].ingress_us = cmd->ingress_us;
+                batch->trace[batch->trace_count].dequeue_us = dequeue_us;
+                batch->trace_count++;
+            }
+            break;
+
+        // Sequence steps run on the slot loaded by seq_run(), 
+        // tca_out_stat carries the run id
+        case TCA_SEQ_START:
+            seq_begin(word,cmd->tca_out_stat,dequeue_us);
+            i2c_seq_expire(batch,dequeue_us);
+            break;
+
+        case TCA_SEQ_CANCEL:
+            seq_end(word,cmd->tca_out_stat);
+            break;
+
+        // New rules table, evaluated on fresh inputs in this batch
+        case TCA_RULES_LOAD:
+            rules_install();
+            i2c_stats.rules_active = rules_count();
+            batch->inp_dirty = true;
+            batch->rules_due = true;
+            break;
+
+        default:
+            break;
+    };
+
+    // Answered when the batch holding this command is committed
+    if((cmd->reply_slot != I2C_NO_REPLY) && (batch->reply_count < I2C_BATCH_MAX))
+    {
+        batch->reply[batch->reply_count].slot = cmd->reply_slot;
+        batch->reply[batch->reply_count].tag  = cmd->reply_tag;
+        batch->reply_count++;
+    }
+    if((cmd->ack_tag != 0) && (batch->ack_count < I2C_BATCH_MAX))
+        batch->ack[batch->ack_count++] = cmd->ack_tag;
+}
+
+
+// -------------------------------------------------------------------
+// Format a bank as hex, most significant word first. The first word 
+// is not zero padded, so a single word bank reads as before ("%x")
+// Returns the string length, 0 if buf is too small
+int tca_bank_to_hex(const tca_bank_t* bank, uint8_t words, char* buf, size_t size)
+{
+    int len = 0;
+    int n;
+
+    if(words == 0 || words > TCA_MAX_DEVICES)
+        return 0;
+
+    for(int k = words - 1; k >= 0; k--)
+    {
+        n = snprintf(buf + len,size - len,(k == words - 1) ? "%x" : "%04x",bank->word[k]);
+        if((n < 0) || ((size_t)(len + n) >= size))
+            return 0;
+        len += n;
+    }
+
+    return len;
+}
+
+// -------------------------------------------------------------------
+// Parse a hex bank, right aligned: the last 4 digits are word 0 
+// An optional "0x" prefix is accepted, as strtol did before
+// Returns the number of words parsed, 0 on an invalid string
+uint8_t tca_bank_from_hex(const char* hex, size_t len, tca_bank_t* bank)
+{
+    uint8_t words = 0;
+    uint8_t digit;
+    char c;
+
+    memset(bank,0,sizeof(*bank));
+    if((len > 2) && (hex[0] == '0') && ((hex[1] == 'x') || (hex[1] == 'X')))
+    {
+        hex += 2;
+        len -= 2;
+    }
+    if(len == 0 || len > 4*TCA_MAX_DEVICES)
+        return 0;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        c = hex[len - 1 - i];
+        if(c >= '0' && c <= '9')      digit = c - '0';
+        else if(c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else return 0;
+
+        bank->word[i / 4] |= (uint16_t)digit << (4 * (i % 4));
+        words = (uint8_t)(i / 4 + 1);
+    }
+
+    return words;
+}
+
+
+// -------------------------------------------------------------------
+// Queue high water mark and refused commands, called by every sender
+static void i2c_queue_account(BaseType_t sent)
+{
+    UBaseType_t depth = (sent == pdTRUE) ? uxQueueMessagesWaiting(i2C_access_queue) : 0;
+
+    portENTER_CRITICAL(&i2c_stats_mux);
+    if(sent != pdTRUE)
+        i2c_stats.cmd_dropped++;
+    else if(depth > i2c_stats.queue_high_water)
+        i2c_stats.queue_high_water = depth;
+    portEXIT_CRITICAL(&i2c_stats_mux);
+}
+
+// -------------------------------------------------------------------
+static void i2c_bus_time_add(int64_t start_us, int64_t end_us)
+{
+    portENTER_CRITICAL(&i2c_stats_mux);
+    i2c_stats.bus_time_us += (uint64_t)(end_us - start_us);
+    portEXIT_CRITICAL(&i2c_stats_mux);
+}
+
+// -------------------------------------------------------------------
+// Read the I2C task counters, with the current queue depth and 
+// the I2C task stack high water mark
+void user_i2c_stats_get(i2c_stats_t* stats)
+{
+    portENTER_CRITICAL(&i2c_stats_mux);
+    *stats = i2c_stats;
+    portEXIT_CRITICAL(&i2c_stats_mux);
+
+    stats->queue_depth = (i2C_access_queue != NULL) ? uxQueueMessagesWaiting(i2C_access_queue) : 0;
+    stats->stack_free  = (i2c_task_handle != NULL) ? uxTaskGetStackHighWaterMark(i2c_task_handle) : 0;
+}
+
+
 // -------------------------------------------------------------------
 // I2C Handle Task
+// Services latched interruption edges, then drains every pending 
+// command and folds them in a single batch. Edges arriving within 
+// TCA_INTR_DEBOUNCE_US of the last input read are merged into one 
+// trailing read at the end of the debounce window
 static void i2c_handle_task(void* pVParameters)
 {
     i2c_access_ctrl_handle_t i2c_access_handle;
-    mqtt_access_ctrl_handle_t mqtt_pub_handle;
-    
-    uint16_t tca_output_status = 0x0000;
-    uint16_t tca_input_status  = 0xFFFF;
+    static i2c_batch_t batch; // ~1 KB, kept off the task stack
+    int drained = 0;
+
+    uint32_t   notify_bits = 0;
+    TickType_t notify_wait = portMAX_DELAY;
+    int64_t    edge_us     = 0;        // First edge waiting for the debounce window
+    int64_t    last_read_us = INT64_MIN / 2; // Last input read on interruption
+    int64_t    now_us;
+    int64_t    first_us;
+
+    i2c_task_ctx.tca_output_status = tca_state.out;
+    i2c_task_ctx.tca_input_status  = tca_state.in;
+    batch.out_target = i2c_task_ctx.tca_output_status;
+
+    now_us = esp_timer_get_time();
+    i2c_scrub.out_due_us = (I2C_SCRUB_OUTPUT_MS > 0) ? now_us + (int64_t)I2C_SCRUB_OUTPUT_MS * 1000 : 0;
+    i2c_scrub.in_due_us  = (I2C_SCRUB_INPUT_MS > 0)  ? now_us + (int64_t)I2C_SCRUB_INPUT_MS * 1000  : 0;
 
     while(true)
     {
-        xQueueReceive(i2C_access_queue,&i2c_access_handle,portMAX_DELAY);
+        notify_bits = 0;
+        xTaskNotifyWait(0,UINT32_MAX,&notify_bits,notify_wait);
 
-        switch(i2c_access_handle.i2c_action)
+        // Interruption edges
+        if(i2c_intr_take(&first_us) && (edge_us == 0))
+            edge_us = first_us;
+
+        now_us = esp_timer_get_time();
+        notify_wait = portMAX_DELAY;
+        if(edge_us != 0)
         {
-            case TCA_CFG_INPUT:
-                tca_config_mode(i2c0_tca_input , 0xFFFF);
-                break;
-                
-            case TCA_CFG_OUTPUT:
-                tca_config_mode(i2c0_tca_output, 0x0000);
-                break;
-            
-            case TCA_REFRESH_INP:
-            case TCA_INTR_CHANGE:
-                tca_input_status = tca_get(i2c0_tca_input); // Acess I2C device and get input status
+            if((now_us - last_read_us) >= TCA_INTR_DEBOUNCE_US)
+            {
+                batch.inp_dirty   = true;
+                batch.inp_edge_us = edge_us;
+                last_read_us = now_us;
+                edge_us = 0;
+            }
+            else // Still inside the debounce window, read at its end
+                notify_wait = pdMS_TO_TICKS((TCA_INTR_DEBOUNCE_US - (now_us - last_read_us)) / 1000) + 1;
+        }
 
-                // Publish MQTT status on MQTT topic 
-                if(mqtt_tca_exchange_queue != NULL)
-                {
-                    printf("Publishing input on topic\n");
-                    mqtt_pub_handle.mqtt_action = MQTT_TCA_INP_PUB;
-                    mqtt_pub_handle.tca_in_payload = tca_input_status;
-                    xQueueSend(mqtt_tca_exchange_queue,&mqtt_pub_handle,pdMS_TO_TICKS(100));
-                }
-                break;
+        // Output timers and sequence steps due now (or within the merge 
+        // window), folded before the commands: a newer command wins on 
+        // its channels
+        i2c_timer_expire(&batch,now_us);
+        i2c_seq_expire(&batch,now_us);
 
-            case HTTP_TCA_INP_GET:
-                xQueueSend(http_tca_inp_get_queue,&tca_input_status,pdMS_TO_TICKS(100));
-                printf("Input status: %x\n",tca_input_status);
-                break;
+        // Pending commands
+        drained = 0;
+        while((drained < I2C_BATCH_MAX) && 
+              (xQueueReceive(i2C_access_queue,&i2c_access_handle,0) == pdTRUE))
+        {
+            i2c_batch_add(&batch,&i2c_access_handle);
+            drained++;
+        }
 
-            case TCA_OUT_INIT:
-                tca_set(i2c0_tca_output,0x0000); // Acess I2C device and set input status
-                tca_output_status = 0x0000;      // Acess I2C device and get input status
-                break;
-            
-            case MQTT_TCA_OUT_SET:
-            case HTTP_TCA_OUT_SET:
-                tca_set(i2c0_tca_output,i2c_access_handle.tca_out_stat); // Acess I2C device and set input status
-                tca_output_status = tca_get(i2c0_tca_output);            // Acess I2C device and get input status
-
-                // Publish MQTT status on topic 
-                if(mqtt_tca_exchange_queue != NULL)
-                {
-                    printf("Publishing output on topic\n");
-                    mqtt_pub_handle.mqtt_action = MQTT_TCA_OUT_PUB;
-                    mqtt_pub_handle.tca_out_payload = tca_output_status;
-                    xQueueSend(mqtt_tca_exchange_queue,&mqtt_pub_handle,pdMS_TO_TICKS(100));
-                }
-                break;
+        // Commands left behind by the batch limit, come back right away
+        if(uxQueueMessagesWaiting(i2C_access_queue) != 0)
+            notify_wait = 0;
 
-            case HTTP_TCA_OUT_GET:
-                xQueueSend(http_tca_out_get_queue,&tca_output_status,pdMS_TO_TICKS(100));
-                printf("Output status: %x\n",tca_output_status);
-                break;
-            
-            case MQTT_TCA_INP_GET:
-                mqtt_pub_handle.mqtt_action = MQTT_TCA_INP_PUB;
-                mqtt_pub_handle.tca_in_payload = tca_input_status;
-                xQueueSend(mqtt_tca_exchange_queue,&mqtt_pub_handle,pdMS_TO_TICKS(50));
-                break;
-            case MQTT_TCA_OUT_GET:
-                mqtt_pub_handle.mqtt_action = MQTT_TCA_OUT_PUB;
-                mqtt_pub_handle.tca_out_payload = tca_output_status;
-                xQueueSend(mqtt_tca_exchange_queue,&mqtt_pub_handle,pdMS_TO_TICKS(50));
-                break;
-            default:
-        };
+        // Devices down whose retry is due, brought back before the commit
+        if(tca_down_mask != 0)
+            i2c_recover(&batch,now_us);
+
+        // Scrubber, only on an idle task: nothing folded, no edge waiting
+        if(!batch.inp_dirty && !batch.out_dirty && !batch.reply_count && !batch.ack_count && 
+           (edge_us == 0) && (uxQueueMessagesWaiting(i2C_access_queue) == 0))
+            i2c_scrub_run(&batch,now_us);
+
+        if(batch.inp_dirty || batch.out_dirty || batch.reply_count || batch.ack_count)
+        {
+            i2c_batch_commit(&batch);
+            i2c_stats.batches++;
+        }
+
+        i2c_timer_arm(esp_timer_get_time());
+    }
+}
+
+
+// -------------------------------------------------------------------
+// esp_timer task: the earliest output timer is due
+static void i2c_timer_callback(void* arg)
+{
+    xTaskNotify(i2c_task_handle,I2C_NOTIFY_TIMER,eSetBits);
+}
+
+// -------------------------------------------------------------------
+// Min-heap on due_us
+static void i2c_timer_swap(uint16_t a, uint16_t b)
+{
+    tca_timer_t tmp = tca_timer_heap[a];
+    tca_timer_heap[a] = tca_timer_heap[b];
+    tca_timer_heap[b] = tmp;
+}
+
+static void i2c_timer_sift_up(uint16_t i)
+{
+    while((i > 0) && (tca_timer_heap[(i - 1) / 2].due_us > tca_timer_heap[i].due_us))
+    {
+        i2c_timer_swap(i,(i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void i2c_timer_sift_down(uint16_t i)
+{
+    uint16_t child;
+
+    while((child = 2*i + 1) < tca_timer_count)
+    {
+        if((child + 1 < tca_timer_count) && (tca_timer_heap[child + 1].due_us < tca_timer_heap[child].due_us))
+            child++;
+        if(tca_timer_heap[i].due_us <= tca_timer_heap[child].due_us)
+            break;
+        i2c_timer_swap(i,child);
+        i = child;
+    }
+}
+
+static void i2c_timer_remove(uint16_t i)
+{
+    tca_timer_count--;
+    if(i == tca_timer_count)
+        return;
+    tca_timer_heap[i] = tca_timer_heap[tca_timer_count];
+    i2c_timer_sift_down(i);
+    i2c_timer_sift_up(i);
+}
+
+// -------------------------------------------------------------------
+// Arm a timer on the outputs of mask, which have no timer 
+// (i2c_timer_cancel() first). Cannot overflow: every entry owns 
+// at least one channel
+static void i2c_timer_add(int64_t due_us, uint8_t word, uint16_t mask, uint16_t value)
+{
+    tca_timer_t* timer = &tca_timer_heap[tca_timer_count];
+
+    timer->due_us = due_us;
+    timer->word   = word;
+    timer->mask   = mask;
+    timer->value  = value;
+    tca_timer_mask[word] |= mask;
+    i2c_timer_sift_up(tca_timer_count++);
+    i2c_stats.timers_active = tca_timer_count;
+}
+
+// -------------------------------------------------------------------
+// Drop the outputs of mask from their timers, the timers left 
+// without outputs are removed and the heap is rebuilt
+static void i2c_timer_cancel(uint8_t word, uint16_t mask)
+{
+    uint16_t kept = 0;
+
+    mask &= tca_timer_mask[word];
+    if(mask == 0)
+        return;
+
+    tca_timer_mask[word] &= ~mask;
+    for(uint16_t i = 0; i < tca_timer_count; i++)
+    {
+        tca_timer_t* timer = &tca_timer_heap[i];
+        if(timer->word == word)
+        {
+            timer->mask  &= ~mask;
+            timer->value &= ~mask;
+        }
+        if(timer->mask != 0)
+            tca_timer_heap[kept++] = *timer;
+    }
+
+    if(kept != tca_timer_count)
+    {
+        tca_timer_count = kept;
+        for(uint16_t i = kept / 2; i-- > 0; )
+            i2c_timer_sift_down(i);
+    }
+    i2c_stats.timers_active = tca_timer_count;
+}
+
+// -------------------------------------------------------------------
+// Fold the timers due within I2C_TIMER_MERGE_US in the batch, 
+// so close expiries cost a single write per output word
+static void i2c_timer_expire(i2c_batch_t* batch, int64_t now_us)
+{
+    tca_timer_t* timer;
+    uint32_t expired = 0;
+
+    while((tca_timer_count > 0) && (tca_timer_heap[0].due_us <= now_us + I2C_TIMER_MERGE_US))
+    {
+        timer = &tca_timer_heap[0];
+        batch->out_target.word[timer->word] = (batch->out_target.word[timer->word] & ~timer->mask) | timer->value;
+        batch->out_dirty  |= BIT(timer->word);
+        batch->out_publish = true;
+        tca_timer_mask[timer->word] &= ~timer->mask;
+        i2c_timer_remove(0);
+        expired++;
+    }
+
+    if(expired != 0)
+    {
+        i2c_stats.timer_expiries += expired;
+        i2c_stats.timer_commits++;
+        i2c_stats.timers_active = tca_timer_count;
+    }
+}
+
+// -------------------------------------------------------------------
+// Sequence steps due within I2C_TIMER_MERGE_US, each one is a 
+// masked write of every output word it touches: a step on several 
+// words or devices still goes in a single commit. At most one step 
+// per sequence and commit, so two steps closer than the merge window 
+// (a short pulse) are still two writes. A step replaces the output 
+// timers of its channels
+static void i2c_seq_expire(i2c_batch_t* batch, int64_t now_us)
+{
+    seq_step_t step;
+    uint8_t    words;
+    uint16_t   mask;
+
+    while(seq_step_take(now_us + I2C_TIMER_MERGE_US,&batch->seq_taken,&step,&words))
+    {
+        for(uint8_t k = 0; (k < words) && (k < tca_out_words); k++)
+        {
+            mask = step.mask.word[k];
+            if(mask == 0)
+                continue;
+            batch->out_target.word[k] = (batch->out_target.word[k] & ~mask) | (step.value.word[k] & mask);
+            batch->out_dirty  |= BIT(k);
+            batch->out_publish = true;
+            i2c_timer_cancel(k,mask);
+        }
+        i2c_stats.seq_steps++;
     }
 }
 
+// -------------------------------------------------------------------
+// Keep the esp_timer on the earliest pending timer, sequence step 
+// or device recovery
+static void i2c_timer_arm(int64_t now_us)
+{
+    int64_t due_us = (tca_timer_count > 0) ? tca_timer_heap[0].due_us : 0;
+    int64_t seq_us = seq_next_due_us();
 
+    if((seq_us != 0) && ((due_us == 0) || (seq_us < due_us)))
+        due_us = seq_us;
+    for(int i = 0; (i < tca_device_count) && (tca_down_mask != 0); i++)
+        if(tca_device[i].down && ((due_us == 0) || (tca_device[i].retry_us < due_us)))
+            due_us = tca_device[i].retry_us;
+    if(i2c_scrub.running)
+        due_us = now_us;
+    if((i2c_scrub.out_due_us != 0) && ((due_us == 0) || (i2c_scrub.out_due_us < due_us)))
+        due_us = i2c_scrub.out_due_us;
+    if((i2c_scrub.in_due_us != 0) && ((due_us == 0) || (i2c_scrub.in_due_us < due_us)))
+        due_us = i2c_scrub.in_due_us;
 
+    // Still armed on the right expiry (a fired timer is never kept)
+    if((due_us == tca_timer_armed_us) && (now_us < tca_timer_armed_us))
+        return;
 
+    if(tca_timer_armed_us != 0)
+        esp_timer_stop(tca_timer_handle);
+    tca_timer_armed_us = 0;
 
+    if(due_us != 0)
+    {
+        esp_timer_start_once(tca_timer_handle,(due_us > now_us) ? (uint64_t)(due_us - now_us) : 1);
+        tca_timer_armed_us = due_us;
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Bus error handling (I2C task only)
+
+// Short wait between two tries of a transaction, the bus is owned 
+// by this task and the driver itself blocks for the transfer
+static void i2c_backoff(uint32_t delay_us)
+{
+    int64_t end_us = esp_timer_get_time() + delay_us;
+
+    while(esp_timer_get_time() < end_us)
+        ;
+}
+
+// -------------------------------------------------------------------
+// One device transaction, counted
+static esp_err_t i2c_xfer_once(tca_device_t* dev, i2c_xfer_t xfer, uint16_t* bits)
+{
+    esp_err_t err;
+
+    switch(xfer)
+    {
+        case I2C_XFER_CONFIG:
+            err = tca_config_mode(dev->handle,dev->dir_mask);
+            break;
+        case I2C_XFER_WRITE:
+            err = tca_set(dev->handle,*bits);
+            break;
+        case I2C_XFER_READ_CONFIG:
+            err = tca_read_reg(dev->handle,TCA9555_CONFIG_PORT0,bits);
+            break;
+        case I2C_XFER_READ_OUTPUT:
+            err = tca_read_reg(dev->handle,TCA9555_OUT_PORT0,bits);
+            break;
+        default:
+            err = tca_get(dev->handle,bits);
+            break;
+    }
+
+    i2c_stats.i2c_transactions++;
+    if(err != ESP_OK)
+        i2c_stats.i2c_errors++;
+    return err;
+}
+
+// -------------------------------------------------------------------
+// Device transaction with retries. A device still failing is marked 
+// down: it is left out of the commits, its words keep their last 
+// good value and the published state is flagged stale until 
+// i2c_recover() brings it back
+static esp_err_t i2c_xfer(tca_device_t* dev, i2c_xfer_t xfer, uint16_t* bits)
+{
+    uint32_t  backoff_us = I2C_RETRY_BACKOFF_US;
+    esp_err_t err;
+    int64_t   now_us;
+
+    for(int attempt = 0; ; attempt++)
+    {
+        err = i2c_xfer_once(dev,xfer,bits);
+        if((err == ESP_OK) || (attempt == I2C_RETRIES))
+            break;
+        i2c_stats.i2c_retries++;
+        i2c_backoff(backoff_us);
+        backoff_us *= 2;
+    }
+    if(err == ESP_OK)
+        return ESP_OK;
+
+    now_us = esp_timer_get_time();
+    dev->down     = true;
+    dev->down_us  = now_us;
+    dev->retry_ms = I2C_RECOVERY_MIN_MS;
+    dev->retry_us = now_us + I2C_RECOVERY_MIN_MS * 1000;
+    tca_down_mask |= (uint8_t)BIT(dev - tca_device);
+    i2c_stats.devices_down++;
+    i2c_stats.device_failures++;
+    ESP_LOGE(TAG,"Device 0x%x not answering (%s), last state kept.",dev->address,esp_err_to_name(err));
+
+    return err;
+}
+
+// -------------------------------------------------------------------
+// Bring back the devices down whose retry is due. The bus is reset 
+// once per pass, the driver clocks SCL until a slave stuck in a 
+// transfer releases SDA. Then each device is probed, gets the output 
+// word asked for (the one it had, or a newer command folded 
+// meanwhile), its direction mask, and is read back: outputs and 
+// inputs are published again, no longer stale
+static void i2c_recover(i2c_batch_t* batch, int64_t now_us)
+{
+    tca_device_t* dev;
+    esp_err_t err;
+    uint16_t  bits;
+    int64_t   start_us = esp_timer_get_time();
+    int64_t   down_us;
+    bool      reset = false;
 
+    for(int i = 0; i < tca_device_count; i++)
+    {
+        dev = &tca_device[i];
+        if(!dev->down || (now_us < dev->retry_us))
+            continue;
+
+        if(!reset)
+        {
+            err = i2c_master_bus_reset(i2c0BusHandler);
+            if(err != ESP_OK)
+                ESP_LOGW(TAG,"Bus reset failure: %s",esp_err_to_name(err));
+            i2c_stats.bus_resets++;
+            reset = true;
+        }
+
+        // Output port before the direction, like the boot sequence: after 
+        // a reset the port is back at 0xFFFF and would drive every relay
+        err = i2c_master_probe(i2c0BusHandler,dev->address,10);
+        i2c_stats.i2c_transactions++;
+        if((err == ESP_OK) && (dev->out_word >= 0))
+        {
+            bits = batch->out_target.word[dev->out_word] & ~dev->dir_mask;
+            err = i2c_xfer_once(dev,I2C_XFER_WRITE,&bits);
+            if(err == ESP_OK)
+                i2c_task_ctx.tca_output_written.word[dev->out_word] = bits;
+        }
+        if(err == ESP_OK)
+            err = i2c_xfer_once(dev,I2C_XFER_CONFIG,NULL);
+        if(err == ESP_OK)
+            err = i2c_xfer_once(dev,I2C_XFER_READ,&bits);
+
+        if(err != ESP_OK)
+        {
+            dev->retry_ms = (dev->retry_ms * 2 > I2C_RECOVERY_MAX_MS) ? I2C_RECOVERY_MAX_MS : dev->retry_ms * 2;
+            dev->retry_us = now_us + (int64_t)dev->retry_ms * 1000;
+            i2c_stats.recovery_failures++;
+            continue;
+        }
+
+        // Back on the bus, state published by the next commit
+        if(dev->out_word >= 0)
+        {
+            i2c_task_ctx.tca_output_status.word[dev->out_word] = bits & ~dev->dir_mask;
+            batch->out_dirty  |= BIT(dev->out_word);
+            batch->out_publish = true;
+        }
+        if(dev->in_word >= 0)
+            batch->inp_dirty = true;
+
+        dev->down = false;
+        tca_down_mask &= (uint8_t)~BIT(i);
+        down_us = esp_timer_get_time() - dev->down_us;
+
+        portENTER_CRITICAL(&i2c_stats_mux);
+        i2c_stats.devices_down--;
+        i2c_stats.recoveries++;
+        i2c_stats.recovery_last_us = down_us;
+        if(down_us > i2c_stats.recovery_max_us)
+            i2c_stats.recovery_max_us = down_us;
+        portEXIT_CRITICAL(&i2c_stats_mux);
+
+        ESP_LOGW(TAG,"Device 0x%x recovered after %"PRIi64" us.",dev->address,down_us);
+    }
+
+    if(reset)
+        i2c_bus_time_add(start_us,esp_timer_get_time());
+}
+
+
+// -------------------------------------------------------------------
+// Background scrubber (I2C task only)
+
+// Direction and output registers of an output device. A wrong 
+// direction means the device was reset: the output port (back at 
+// 0xFFFF) gets the last level written before the direction is 
+// restored, so no relay is driven in between. A wrong output level 
+// alone is written again by the next commit, from the last level written
+static void i2c_scrub_outputs(i2c_batch_t* batch, tca_device_t* dev)
+{
+    uint16_t written = i2c_task_ctx.tca_output_written.word[dev->out_word];
+    uint16_t bits;
+
+    if(i2c_xfer(dev,I2C_XFER_READ_CONFIG,&bits) != ESP_OK)
+        return;
+    if(bits != dev->dir_mask)
+    {
+        ESP_LOGW(TAG,"Device 0x%x direction 0x%04x instead of 0x%04x, rewritten.",dev->address,bits,dev->dir_mask);
+        i2c_stats.scrub_config++;
+        bits = written;
+        if((i2c_xfer(dev,I2C_XFER_WRITE,&bits) != ESP_OK) || 
+           (i2c_xfer(dev,I2C_XFER_CONFIG,NULL) != ESP_OK))
+            return;
+    }
+
+    if(i2c_xfer(dev,I2C_XFER_READ_OUTPUT,&bits) != ESP_OK)
+        return;
+    if(((bits ^ written) & ~dev->dir_mask) != 0)
+    {
+        ESP_LOGW(TAG,"Device 0x%x outputs 0x%04x instead of 0x%04x, rewritten.",
+                 dev->address,bits & ~dev->dir_mask,written);
+        i2c_stats.scrub_output++;
+        batch->out_target.word[dev->out_word] = written;
+        batch->out_dirty |= BIT(dev->out_word);
+        batch->out_force |= BIT(dev->out_word);
+    }
+}
+
+// -------------------------------------------------------------------
+// Input poll of an input device. A change not announced by an edge 
+// goes through the usual input read: rules and publication
+static void i2c_scrub_inputs(i2c_batch_t* batch, tca_device_t* dev)
+{
+    uint16_t bits;
+    bool     edge;
+
+    if(i2c_xfer(dev,I2C_XFER_READ,&bits) != ESP_OK)
+        return;
+
+    // An edge latched meanwhile is on its way, not a missed one
+    portENTER_CRITICAL(&tca_intr_mux);
+    edge = (tca_intr_edges != 0);
+    portEXIT_CRITICAL(&tca_intr_mux);
+
+    if(!edge && (((bits ^ i2c_task_ctx.tca_input_status.word[dev->in_word]) & dev->dir_mask) != 0))
+    {
+        ESP_LOGW(TAG,"Device 0x%x input change without interruption.",dev->address);
+        i2c_stats.scrub_input++;
+        batch->inp_dirty = true;
+    }
+}
+
+// -------------------------------------------------------------------
+// Scrubber pass: every device in one burst, the checks due when the 
+// pass started. A queued command stops the pass between two devices, 
+// it goes on from there once the command is committed
+static void i2c_scrub_run(i2c_batch_t* batch, int64_t now_us)
+{
+    tca_device_t* dev;
+    int64_t start_us;
+
+    if(!i2c_scrub.running)
+    {
+        i2c_scrub.out_pass = (i2c_scrub.out_due_us != 0) && (now_us >= i2c_scrub.out_due_us);
+        i2c_scrub.in_pass  = (i2c_scrub.in_due_us != 0) && (now_us >= i2c_scrub.in_due_us);
+        if(!i2c_scrub.out_pass && !i2c_scrub.in_pass)
+            return;
+        i2c_scrub.running = true;
+        i2c_scrub.next    = 0;
+    }
+
+    start_us = esp_timer_get_time();
+    for(; i2c_scrub.next < tca_device_count; i2c_scrub.next++)
+    {
+        if(uxQueueMessagesWaiting(i2C_access_queue) != 0)
+        {
+            i2c_stats.scrub_yields++;
+            break;
+        }
+
+        dev = &tca_device[i2c_scrub.next];
+        if(dev->down)
+            continue;
+        if(i2c_scrub.out_pass && (dev->out_word >= 0))
+            i2c_scrub_outputs(batch,dev);
+        if(i2c_scrub.in_pass && (dev->in_word >= 0))
+            i2c_scrub_inputs(batch,dev);
+    }
+    i2c_bus_time_add(start_us,esp_timer_get_time());
+
+    if(i2c_scrub.next < tca_device_count)
+        return;
+
+    // Next pass counted from the end of this one
+    now_us = esp_timer_get_time();
+    if(i2c_scrub.out_pass)
+        i2c_scrub.out_due_us = now_us + (int64_t)I2C_SCRUB_OUTPUT_MS * 1000;
+    if(i2c_scrub.in_pass)
+        i2c_scrub.in_due_us = now_us + (int64_t)I2C_SCRUB_INPUT_MS * 1000;
+    i2c_scrub.running = false;
+    i2c_stats.scrub_passes++;
+}
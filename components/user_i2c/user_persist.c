@@ -0,0 +1,210 @@
+/*
+ * Output state persistence
+ * The NVS writer runs in its own low priority task, woken by the 
+ * TCA state updates: the I2C task never waits on a flash write
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "nvs.h"
+
+#include "user_i2c.h"
+#include "user_persist.h"
+
+static const char* TAG = "PERSIST";
+
+// NVS record, ignored when the number of output words changed
+typedef struct persist_out_t
+{
+    uint8_t    words;
+    tca_bank_t bank;
+} persist_out_t;
+
+static nvs_handle_t    persist_nvs;
+static persist_out_t   persist_saved;   // Last record written (or loaded)
+static persist_stats_t persist_stats;
+static portMUX_TYPE    persist_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void persist_task(void* PvParameters);
+static bool persist_out_write(const tca_state_t* state);
+
+
+// -------------------------------------------------------------------
+// Read the saved record, ESP_ERR_NVS_NOT_FOUND when there is none 
+// or it was saved for a different number of output words
+static esp_err_t persist_out_get(persist_out_t* saved, uint8_t words)
+{
+    nvs_handle_t nvs;
+    size_t       size = sizeof(*saved);
+    esp_err_t    err;
+
+    err = nvs_open(PERSIST_NVS_NAMESPACE,NVS_READONLY,&nvs);
+    if(err != ESP_OK)
+        return err;
+
+    err = nvs_get_blob(nvs,PERSIST_NVS_KEY_OUT,saved,&size);
+    nvs_close(nvs);
+
+    if((err == ESP_OK) && ((size != sizeof(*saved)) || (saved->words != words)))
+        err = ESP_ERR_NVS_NOT_FOUND;
+
+    return err;
+}
+
+// -------------------------------------------------------------------
+// Boot: read the saved output bank, the writer task starts from it
+esp_err_t persist_out_load(tca_bank_t* bank, uint8_t words)
+{
+    persist_out_t saved = {0};
+    esp_err_t     err = persist_out_get(&saved,words);
+
+    if(err == ESP_OK)
+    {
+        *bank = saved.bank;
+        persist_saved = saved;
+    }
+
+    return err;
+}
+
+// -------------------------------------------------------------------
+// Any task: read the saved output bank, writer task untouched
+esp_err_t persist_out_read(tca_bank_t* bank, uint8_t words)
+{
+    persist_out_t saved = {0};
+    esp_err_t     err = persist_out_get(&saved,words);
+
+    if(err == ESP_OK)
+        *bank = saved.bank;
+
+    return err;
+}
+
+// -------------------------------------------------------------------
+// Write an output bank record (provisioning, simulation), before 
+// user_i2c0_init(): the writer task only knows the record loaded at 
+// boot or written by itself
+esp_err_t persist_out_save(const tca_bank_t* bank, uint8_t words)
+{
+    persist_out_t record = {0};
+    nvs_handle_t  nvs;
+    esp_err_t     err;
+
+    if(words > TCA_MAX_DEVICES)
+        return ESP_ERR_INVALID_ARG;
+
+    record.words = words;
+    memcpy(record.bank.word,bank->word,words*sizeof(record.bank.word[0]));
+
+    err = nvs_open(PERSIST_NVS_NAMESPACE,NVS_READWRITE,&nvs);
+    if(err != ESP_OK)
+        return err;
+    err = nvs_set_blob(nvs,PERSIST_NVS_KEY_OUT,&record,sizeof(record));
+    if(err == ESP_OK)
+        err = nvs_commit(nvs);
+    nvs_close(nvs);
+
+    return err;
+}
+
+// -------------------------------------------------------------------
+// Start the NVS writer
+esp_err_t persist_start(void)
+{
+    TaskHandle_t task = NULL;
+    esp_err_t err;
+
+    err = nvs_open(PERSIST_NVS_NAMESPACE,NVS_READWRITE,&persist_nvs);
+    if(err != ESP_OK)
+    {
+        ESP_LOGE(TAG,"NVS open failure, outputs are not saved: %s",esp_err_to_name(err));
+        return err;
+    }
+
+    if(xTaskCreate(persist_task,"NVSWriter",configMINIMAL_STACK_SIZE+2048,NULL,1,&task) != pdPASS)
+        return ESP_ERR_NO_MEM;
+
+    err = user_i2c_state_subscribe(task);
+    if(err != ESP_OK)
+        ESP_LOGE(TAG,"No state subscriber slot left, outputs are not saved");
+
+    return err;
+}
+
+// -------------------------------------------------------------------
+void persist_stats_get(persist_stats_t* stats)
+{
+    portENTER_CRITICAL(&persist_stats_mux);
+    *stats = persist_stats;
+    portEXIT_CRITICAL(&persist_stats_mux);
+}
+
+// -------------------------------------------------------------------
+// Write the output bank when it differs from the saved one, 
+// returns true if NVS was written
+static bool persist_out_write(const tca_state_t* state)
+{
+    persist_out_t record = {0};
+    esp_err_t err;
+
+    record.words = state->out_words;
+    memcpy(record.bank.word,state->out.word,state->out_words*sizeof(record.bank.word[0]));
+    if(memcmp(&record,&persist_saved,sizeof(record)) == 0)
+        return false;
+
+    err = nvs_set_blob(persist_nvs,PERSIST_NVS_KEY_OUT,&record,sizeof(record));
+    if(err == ESP_OK)
+        err = nvs_commit(persist_nvs);
+
+    portENTER_CRITICAL(&persist_stats_mux);
+    if(err == ESP_OK)
+        persist_stats.writes++;
+    else
+        persist_stats.write_errors++;
+    portEXIT_CRITICAL(&persist_stats_mux);
+
+    if(err == ESP_OK)
+        persist_saved = record;
+    else
+        ESP_LOGE(TAG,"Output state write failure: %s",esp_err_to_name(err));
+
+    return true; // A failed write also waits for the next interval
+}
+
+// -------------------------------------------------------------------
+// NVS writer task
+// Each state update wakes the task, updates arriving during the 
+// interval wait are folded in the next write of the latest state
+static void persist_task(void* PvParameters)
+{
+    tca_state_t state;
+    int64_t     last_write_us = 0;
+    int64_t     wait_us;
+    uint32_t    changes;
+
+    while(true)
+    {
+        changes = ulTaskNotifyTake(pdTRUE,portMAX_DELAY);
+
+        portENTER_CRITICAL(&persist_stats_mux);
+        persist_stats.changes += changes;
+        portEXIT_CRITICAL(&persist_stats_mux);
+
+        wait_us = last_write_us + (int64_t)PERSIST_WRITE_INTERVAL_MS*1000 - esp_timer_get_time();
+        if((last_write_us != 0) && (wait_us > 0))
+            vTaskDelay(pdMS_TO_TICKS(wait_us/1000) + 1);
+
+        user_i2c_state_get(&state);
+        if(persist_out_write(&state))
+            last_write_us = esp_timer_get_time();
+    }
+}
@@ -0,0 +1,365 @@
+/*
+ * Local input to output rules
+ * The text is compiled once (boot or upload) into per rule input 
+ * masks: evaluating a rule is a few word operations per input word, 
+ * the whole table stays far below the time of one I2C transaction
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_err.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "nvs.h"
+
+#include "user_i2c.h"
+#include "user_rules.h"
+#include "user_persist.h"
+
+static const char* TAG = "RULES";
+
+typedef enum
+{
+    RULE_FOLLOW,
+    RULE_SET,
+    RULE_RESET,
+    RULE_INTERLOCK,
+    RULE_OPS
+} rule_op_t;
+
+// Condition: inputs of sel, those of inv inverted, all of them 
+// true (AND) or any of them (OR)
+typedef struct rule_t
+{
+    tca_bank_t sel;
+    tca_bank_t inv;
+    uint16_t   out_bit;
+    uint8_t    out_word;
+    uint8_t    words;    // Input words of sel
+    bool       all;
+} rule_t;
+
+// Rules sorted by operation, rules of op are first[op] .. first[op+1]-1. 
+// Evaluation order: follow, set, reset, interlock
+typedef struct rules_table_t
+{
+    uint8_t first[RULE_OPS + 1];
+    rule_t  rule[RULES_MAX];
+} rules_table_t;
+
+// Double buffer: rules_store() compiles in the table not in use and 
+// the I2C task switches on TCA_RULES_LOAD. A single table is staged 
+// at a time
+static rules_table_t rules_table[2];
+static uint8_t       rules_active = 0;
+static atomic_bool   rules_staged = false;
+static tca_bank_t    rules_lock;     // Outputs held off by the interlocks, I2C task
+
+static bool rules_compile(const char* text, size_t len, rules_table_t* table);
+
+
+// -------------------------------------------------------------------
+// Saved rules, compiled in the active table
+esp_err_t rules_load(void)
+{
+    static char  text[RULES_TEXT_LEN];
+    nvs_handle_t nvs;
+    size_t       size = sizeof(text);
+    esp_err_t    err;
+
+    err = nvs_open(PERSIST_NVS_NAMESPACE,NVS_READONLY,&nvs);
+    if(err != ESP_OK)
+        return err;
+
+    err = nvs_get_blob(nvs,RULES_NVS_KEY,text,&size);
+    nvs_close(nvs);
+    if(err != ESP_OK)
+        return err;
+
+    if(!rules_compile(text,size,&rules_table[rules_active]))
+    {
+        ESP_LOGE(TAG,"Saved rules do not compile, ignored.");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ESP_LOGI(TAG,"%u rules loaded.",rules_table[rules_active].first[RULE_OPS]);
+    return ESP_OK;
+}
+
+// -------------------------------------------------------------------
+// Compile, save, and hand the table over to the I2C task. 
+// ESP_ERR_INVALID_STATE while the previous table is not installed
+esp_err_t rules_store(const char* text, size_t len)
+{
+    i2c_access_ctrl_handle_t cmd = {0};
+    rules_table_t* table;
+    nvs_handle_t   nvs;
+    bool           idle = false;
+    esp_err_t      err;
+
+    if(len > RULES_TEXT_LEN)
+        return ESP_ERR_INVALID_SIZE;
+    if(!atomic_compare_exchange_strong(&rules_staged,&idle,true))
+        return ESP_ERR_INVALID_STATE;
+
+    // The I2C task only switches tables when one is staged
+    table = &rules_table[rules_active ^ 1];
+    if(!rules_compile(text,len,table))
+    {
+        atomic_store(&rules_staged,false);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    err = nvs_open(PERSIST_NVS_NAMESPACE,NVS_READWRITE,&nvs);
+    if(err == ESP_OK)
+    {
+        err = (len != 0) ? nvs_set_blob(nvs,RULES_NVS_KEY,text,len) : nvs_erase_key(nvs,RULES_NVS_KEY);
+        if(err == ESP_ERR_NVS_NOT_FOUND)
+            err = ESP_OK; // Nothing to erase
+        if(err == ESP_OK)
+            err = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    if(err != ESP_OK)
+        ESP_LOGE(TAG,"Rules not saved, lost on reset: %s",esp_err_to_name(err));
+
+    cmd.i2c_action = TCA_RULES_LOAD;
+    if(user_i2c_send(&cmd,pdMS_TO_TICKS(50)) != pdTRUE)
+    {
+        atomic_store(&rules_staged,false);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    // Applied even when the save failed, reported above
+    ESP_LOGI(TAG,"%u rules compiled.",table->first[RULE_OPS]);
+    return ESP_OK;
+}
+
+
+// -------------------------------------------------------------------
+// I2C task: switch to the staged table
+void rules_install(void)
+{
+    if(!atomic_load(&rules_staged))
+        return;
+
+    rules_active ^= 1;
+    memset(&rules_lock,0,sizeof(rules_lock));
+    atomic_store(&rules_staged,false);
+}
+
+// -------------------------------------------------------------------
+uint8_t rules_count(void)
+{
+    return rules_table[rules_active].first[RULE_OPS];
+}
+
+// -------------------------------------------------------------------
+static inline bool rule_cond(const rule_t* rule, const tca_bank_t* in)
+{
+    uint16_t x;
+
+    for(uint8_t k = 0; k < rule->words; k++)
+    {
+        x = (in->word[k] ^ rule->inv.word[k]) & rule->sel.word[k];
+        if(rule->all && (x != rule->sel.word[k]))
+            return false;
+        if(!rule->all && (x != 0))
+            return true;
+    }
+
+    return rule->all;
+}
+
+// -------------------------------------------------------------------
+// I2C task, after an input read: apply every rule on out
+uint8_t rules_eval(const tca_bank_t* in, tca_bank_t* out, uint8_t out_words)
+{
+    const rules_table_t* table = &rules_table[rules_active];
+    const rule_t* rule;
+    tca_bank_t    before = *out;
+    uint8_t       changed = 0;
+
+    memset(&rules_lock,0,sizeof(rules_lock));
+    for(uint8_t op = 0; op < RULE_OPS; op++)
+    {
+        for(uint8_t i = table->first[op]; i < table->first[op + 1]; i++)
+        {
+            rule = &table->rule[i];
+            if(rule->out_word >= out_words)
+                continue;
+
+            if(rule_cond(rule,in))
+            {
+                if((op == RULE_FOLLOW) || (op == RULE_SET))
+                    out->word[rule->out_word] |= rule->out_bit;
+                else if(op == RULE_RESET)
+                    out->word[rule->out_word] &= ~rule->out_bit;
+                else
+                    rules_lock.word[rule->out_word] |= rule->out_bit;
+            }
+            else if(op == RULE_FOLLOW)
+                out->word[rule->out_word] &= ~rule->out_bit;
+        }
+    }
+
+    for(uint8_t k = 0; k < out_words; k++)
+    {
+        out->word[k] &= ~rules_lock.word[k];
+        if(out->word[k] != before.word[k])
+            changed |= BIT(k);
+    }
+
+    return changed;
+}
+
+// -------------------------------------------------------------------
+// I2C task, on every commit: keep the interlocked outputs off
+uint8_t rules_interlock(tca_bank_t* out, uint8_t out_words)
+{
+    uint8_t changed = 0;
+
+    for(uint8_t k = 0; k < out_words; k++)
+    {
+        if(out->word[k] & rules_lock.word[k])
+        {
+            out->word[k] &= ~rules_lock.word[k];
+            changed |= BIT(k);
+        }
+    }
+
+    return changed;
+}
+
+
+// -------------------------------------------------------------------
+// Decimal channel index below TCA_MAX_CHANNELS, moves *p past it
+static bool rules_channel_parse(const char** p, const char* end, uint16_t* channel)
+{
+    uint32_t value = 0;
+    const char* s = *p;
+
+    if((s == end) || (*s < '0') || (*s > '9'))
+        return false;
+
+    while((s < end) && (*s >= '0') && (*s <= '9'))
+    {
+        value = value * 10 + (uint32_t)(*s++ - '0');
+        if(value >= TCA_MAX_CHANNELS)
+            return false;
+    }
+
+    *p = s;
+    *channel = (uint16_t)value;
+    return true;
+}
+
+// -------------------------------------------------------------------
+// One rule "oN<op>C" between rule and end (spaces removed by the caller)
+static bool rules_parse_one(const char* s, const char* end, rule_op_t* op, rule_t* rule)
+{
+    uint16_t channel;
+    char     join = 0;
+    bool     not;
+
+    memset(rule,0,sizeof(*rule));
+
+    if((s == end) || (*s++ != 'o') || !rules_channel_parse(&s,end,&channel) || (s == end))
+        return false;
+    rule->out_word = (uint8_t)(channel / 16);
+    rule->out_bit  = (uint16_t)BIT(channel % 16);
+
+    switch(*s++)
+    {
+        case '=': *op = RULE_FOLLOW;    break;
+        case '+': *op = RULE_SET;       break;
+        case '-': *op = RULE_RESET;     break;
+        case '#': *op = RULE_INTERLOCK; break;
+        default:  return false;
+    }
+
+    while(true)
+    {
+        not = (s < end) && (*s == '!');
+        if(not)
+            s++;
+        if((s == end) || (*s++ != 'i') || !rules_channel_parse(&s,end,&channel))
+            return false;
+
+        rule->sel.word[channel / 16] |= (uint16_t)BIT(channel % 16);
+        if(not)
+            rule->inv.word[channel / 16] |= (uint16_t)BIT(channel % 16);
+        if(channel / 16 + 1 > rule->words)
+            rule->words = (uint8_t)(channel / 16 + 1);
+
+        if(s == end)
+            break;
+        if(((*s != '&') && (*s != '|')) || ((join != 0) && (*s != join)))
+            return false;
+        join = *s++;
+    }
+
+    // NOT is applied before the join, an inverted input reads 1 when low
+    rule->all = (join != '|');
+    return true;
+}
+
+// -------------------------------------------------------------------
+// Text form to a table sorted by operation, false on any malformed 
+// rule or more than RULES_MAX rules
+static bool rules_compile(const char* text, size_t len, rules_table_t* table)
+{
+    // Boot and the MQTT (HTTP) task, never at the same time
+    static char      buf[RULES_TEXT_LEN];
+    static rule_op_t op[RULES_MAX];
+    static rule_t    parsed[RULES_MAX];
+    const char* tok;
+    const char* end;
+    const char* sep;
+    size_t      n = 0;
+    uint8_t     count = 0;
+    uint8_t     i = 0;
+
+    if(len > sizeof(buf))
+        return false;
+
+    for(size_t j = 0; j < len; j++)
+        if((text[j] != ' ') && (text[j] != '\t') && (text[j] != '\n') && (text[j] != '\r'))
+            buf[n++] = text[j];
+
+    tok = buf;
+    end = buf + n;
+    while(tok < end)
+    {
+        sep = memchr(tok,';',(size_t)(end - tok));
+        if(sep == NULL)
+            sep = end;
+
+        if(sep != tok)
+        {
+            if((count == RULES_MAX) || !rules_parse_one(tok,sep,&op[count],&parsed[count]))
+                return false;
+            count++;
+        }
+        tok = sep + 1;
+    }
+
+    // Bucket by operation, keeping the text order inside an operation
+    for(uint8_t o = 0; o < RULE_OPS; o++)
+    {
+        table->first[o] = i;
+        for(uint8_t r = 0; r < count; r++)
+            if(op[r] == o)
+                table->rule[i++] = parsed[r];
+    }
+    table->first[RULE_OPS] = i;
+
+    return true;
+}
@@ -0,0 +1,408 @@
+/*
+ * Output sequences
+ * Upload and start run in the caller task (NVS access), the steps 
+ * are written by the I2C task, folded in its batches like the 
+ * output timers, on the esp_timer clock
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_err.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "nvs.h"
+
+#include "user_i2c.h"
+#include "user_seq.h"
+#include "user_persist.h"
+#include "user_mqtt.h"
+
+static const char* TAG = "SEQ";
+
+// NVS record, only the steps in use are stored
+typedef struct seq_record_t
+{
+    uint8_t    words; // Output words written by the steps
+    uint8_t    count;
+    seq_step_t step[SEQ_MAX_STEPS];
+} seq_record_t;
+
+#define SEQ_RECORD_SIZE(count) (offsetof(seq_record_t,step) + (count)*sizeof(seq_step_t))
+
+// Run slots. A slot goes FREE -> STARTING in seq_run() (any task), 
+// STARTING -> RUNNING -> FREE in the I2C task; the record is only 
+// written while the slot is STARTING, before the start command is queued
+typedef enum
+{
+    SEQ_FREE,
+    SEQ_STARTING, // Loaded, start command on the I2C queue
+    SEQ_RUNNING
+} seq_slot_state_t;
+
+typedef struct seq_slot_t
+{
+    seq_slot_state_t state;
+    uint16_t     run_id; // Matches the start and cancel commands to this run
+    char         name[SEQ_NAME_LEN + 1];
+    uint8_t      next;   // Next step to write
+    int64_t      due_us; // Due time of the next step
+    seq_record_t record;
+} seq_slot_t;
+
+static seq_slot_t   seq_slot[SEQ_RUNNING_MAX];
+static uint16_t     seq_run_next_id = 1;
+static portMUX_TYPE seq_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static bool seq_name_valid(const char* name, size_t len);
+static bool seq_compile(const char* text, size_t len, seq_record_t* record);
+static void seq_status_post(uint8_t slot, const char* state);
+
+
+// -------------------------------------------------------------------
+// Compile a sequence and save it under name, an empty text erases it
+esp_err_t seq_store(const char* name, size_t name_len, const char* text, size_t len)
+{
+    static seq_record_t record; // Callers are serialized by the MQTT (HTTP) task
+    char        key[sizeof(SEQ_NVS_PREFIX) + SEQ_NAME_LEN];
+    nvs_handle_t nvs;
+    esp_err_t   err;
+
+    if(!seq_name_valid(name,name_len))
+        return ESP_ERR_INVALID_ARG;
+    if((len != 0) && !seq_compile(text,len,&record))
+        return ESP_ERR_INVALID_ARG;
+
+    snprintf(key,sizeof(key),SEQ_NVS_PREFIX "%.*s",(int)name_len,name);
+    err = nvs_open(PERSIST_NVS_NAMESPACE,NVS_READWRITE,&nvs);
+    if(err != ESP_OK)
+        return err;
+
+    if(len != 0)
+        err = nvs_set_blob(nvs,key,&record,SEQ_RECORD_SIZE(record.count));
+    else
+        err = nvs_erase_key(nvs,key);
+    if(err == ESP_OK)
+        err = nvs_commit(nvs);
+    nvs_close(nvs);
+
+    if(err == ESP_OK)
+        ESP_LOGI(TAG,"Sequence %s %s, %u steps",key + sizeof(SEQ_NVS_PREFIX) - 1,
+                 (len != 0) ? "saved" : "erased",(len != 0) ? record.count : 0);
+    return err;
+}
+
+// -------------------------------------------------------------------
+// Load a saved sequence in a free slot and queue its start. 
+// ESP_ERR_INVALID_STATE when it is already running, ESP_ERR_NO_MEM 
+// when SEQ_RUNNING_MAX sequences run
+esp_err_t seq_run(const char* name, size_t name_len)
+{
+    i2c_access_ctrl_handle_t cmd = {0};
+    char         key[sizeof(SEQ_NVS_PREFIX) + SEQ_NAME_LEN];
+    seq_slot_t*  slot = NULL;
+    nvs_handle_t nvs;
+    size_t       size = sizeof(slot->record);
+    uint8_t      index = 0;
+    esp_err_t    err = ESP_OK;
+
+    if(!seq_name_valid(name,name_len))
+        return ESP_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&seq_mux);
+    for(uint8_t i = 0; i < SEQ_RUNNING_MAX; i++)
+    {
+        if(seq_slot[i].state == SEQ_FREE)
+        {
+            if(slot == NULL)
+            {
+                slot  = &seq_slot[i];
+                index = i;
+            }
+        }
+        else if((strlen(seq_slot[i].name) == name_len) && (memcmp(seq_slot[i].name,name,name_len) == 0))
+            err = ESP_ERR_INVALID_STATE;
+    }
+    if((err == ESP_OK) && (slot == NULL))
+        err = ESP_ERR_NO_MEM;
+    if(err == ESP_OK)
+    {
+        slot->state  = SEQ_STARTING;
+        slot->run_id = seq_run_next_id++;
+        memcpy(slot->name,name,name_len);
+        slot->name[name_len] = '\0';
+    }
+    portEXIT_CRITICAL(&seq_mux);
+
+    if(err != ESP_OK)
+        return err;
+
+    snprintf(key,sizeof(key),SEQ_NVS_PREFIX "%s",slot->name);
+    err = nvs_open(PERSIST_NVS_NAMESPACE,NVS_READONLY,&nvs);
+    if(err == ESP_OK)
+    {
+        err = nvs_get_blob(nvs,key,&slot->record,&size);
+        nvs_close(nvs);
+    }
+    if((err == ESP_OK) && ((size < SEQ_RECORD_SIZE(1)) || (slot->record.count > SEQ_MAX_STEPS) || 
+                           (size != SEQ_RECORD_SIZE(slot->record.count))))
+        err = ESP_ERR_INVALID_SIZE;
+
+    if(err == ESP_OK)
+    {
+        cmd.i2c_action   = TCA_SEQ_START;
+        cmd.tca_word     = index;
+        cmd.tca_out_stat = slot->run_id;
+        if(user_i2c_send(&cmd,pdMS_TO_TICKS(50)) != pdTRUE)
+            err = ESP_ERR_TIMEOUT;
+    }
+
+    if(err != ESP_OK)
+    {
+        portENTER_CRITICAL(&seq_mux);
+        slot->state = SEQ_FREE;
+        portEXIT_CRITICAL(&seq_mux);
+    }
+
+    return err;
+}
+
+// -------------------------------------------------------------------
+// Queue the cancel of a running sequence, of all of them when 
+// name_len is 0. The outputs keep the levels written so far
+esp_err_t seq_cancel(const char* name, size_t name_len)
+{
+    i2c_access_ctrl_handle_t cmd = {0};
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    cmd.i2c_action = TCA_SEQ_CANCEL;
+    cmd.tca_word   = SEQ_SLOT_ALL;
+    if(name_len == 0)
+        err = ESP_OK;
+
+    portENTER_CRITICAL(&seq_mux);
+    for(uint8_t i = 0; (i < SEQ_RUNNING_MAX) && (name_len != 0); i++)
+    {
+        if((seq_slot[i].state != SEQ_FREE) && (strlen(seq_slot[i].name) == name_len) && 
+           (memcmp(seq_slot[i].name,name,name_len) == 0))
+        {
+            cmd.tca_word     = i;
+            cmd.tca_out_stat = seq_slot[i].run_id;
+            err = ESP_OK;
+        }
+    }
+    portEXIT_CRITICAL(&seq_mux);
+
+    if((err == ESP_OK) && (user_i2c_send(&cmd,pdMS_TO_TICKS(50)) != pdTRUE))
+        err = ESP_ERR_TIMEOUT;
+
+    return err;
+}
+
+
+// -------------------------------------------------------------------
+// I2C task: start command of a loaded slot, the first step is due 
+// its delay after now_us (the command dequeue time)
+void seq_begin(uint8_t slot, uint16_t run_id, int64_t now_us)
+{
+    seq_slot_t* s = &seq_slot[slot];
+
+    if((slot >= SEQ_RUNNING_MAX) || (s->state != SEQ_STARTING) || (s->run_id != run_id))
+        return;
+
+    s->next   = 0;
+    s->due_us = now_us + (int64_t)s->record.step[0].delay_ms * 1000;
+    portENTER_CRITICAL(&seq_mux);
+    s->state = SEQ_RUNNING;
+    portEXIT_CRITICAL(&seq_mux);
+
+    seq_status_post(slot,"running");
+}
+
+// -------------------------------------------------------------------
+// I2C task: cancel command, slot SEQ_SLOT_ALL stops every sequence
+void seq_end(uint8_t slot, uint16_t run_id)
+{
+    for(uint8_t i = 0; i < SEQ_RUNNING_MAX; i++)
+    {
+        if((seq_slot[i].state != SEQ_RUNNING) || 
+           ((slot != SEQ_SLOT_ALL) && ((i != slot) || (seq_slot[i].run_id != run_id))))
+            continue;
+
+        seq_status_post(i,"cancelled");
+        portENTER_CRITICAL(&seq_mux);
+        seq_slot[i].state = SEQ_FREE;
+        portEXIT_CRITICAL(&seq_mux);
+    }
+}
+
+// -------------------------------------------------------------------
+// I2C task: earliest step due by limit_us, copied in step. Returns 
+// false when none is due. A sequence is over after its last step
+// - taken: slots already stepped in this commit (bit per slot), 
+//   skipped and updated: a sequence moves one step per commit, its 
+//   next step waits for the next one even when it is already due
+bool seq_step_take(int64_t limit_us, uint8_t* taken, seq_step_t* step, uint8_t* words)
+{
+    seq_slot_t* s = NULL;
+    uint8_t     index = 0;
+
+    for(uint8_t i = 0; i < SEQ_RUNNING_MAX; i++)
+    {
+        if((seq_slot[i].state == SEQ_RUNNING) && !(*taken & BIT(i)) && (seq_slot[i].due_us <= limit_us) && 
+           ((s == NULL) || (seq_slot[i].due_us < s->due_us)))
+        {
+            s     = &seq_slot[i];
+            index = i;
+        }
+    }
+    if(s == NULL)
+        return false;
+
+    *step   = s->record.step[s->next++];
+    *words  = s->record.words;
+    *taken |= (uint8_t)BIT(index);
+
+    if(s->next < s->record.count)
+    {
+        // From the previous due time, not from now: no drift
+        s->due_us += (int64_t)s->record.step[s->next].delay_ms * 1000;
+        seq_status_post(index,"running");
+    }
+    else
+    {
+        seq_status_post(index,"done");
+        portENTER_CRITICAL(&seq_mux);
+        s->state = SEQ_FREE;
+        portEXIT_CRITICAL(&seq_mux);
+    }
+
+    return true;
+}
+
+// -------------------------------------------------------------------
+// I2C task: due time of the next step, 0 if no sequence runs
+int64_t seq_next_due_us(void)
+{
+    int64_t due_us = 0;
+
+    for(uint8_t i = 0; i < SEQ_RUNNING_MAX; i++)
+    {
+        if((seq_slot[i].state == SEQ_RUNNING) && ((due_us == 0) || (seq_slot[i].due_us < due_us)))
+            due_us = seq_slot[i].due_us;
+    }
+
+    return due_us;
+}
+
+
+// -------------------------------------------------------------------
+static bool seq_name_valid(const char* name, size_t len)
+{
+    if((len == 0) || (len > SEQ_NAME_LEN))
+        return false;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        char c = name[i];
+        if(!(((c >= '0') && (c <= '9')) || ((c >= 'a') && (c <= 'z')) || 
+             ((c >= 'A') && (c <= 'Z')) || (c == '_') || (c == '-')))
+            return false;
+    }
+
+    return true;
+}
+
+// -------------------------------------------------------------------
+// Text form to steps, false on a malformed or too long sequence. 
+// Waits add up on the next write, a trailing wait is kept as a 
+// step with an empty mask
+static bool seq_compile(const char* text, size_t len, seq_record_t* record)
+{
+    const char* tok = text;
+    const char* end = text + len;
+    const char* sep;
+    const char* comma;
+    size_t      tok_len;
+    uint32_t    delay_ms = 0;
+    uint32_t    wait_ms;
+    uint8_t     words;
+    seq_step_t* step;
+
+    memset(record,0,sizeof(*record));
+
+    while(tok < end)
+    {
+        sep     = memchr(tok,';',(size_t)(end - tok));
+        tok_len = (sep != NULL) ? (size_t)(sep - tok) : (size_t)(end - tok);
+
+        if(tok_len == 0)
+            ; // Empty step, "a;;b" or a trailing ';'
+        else if(tok[0] == 'w')
+        {
+            // Plain decimal, up to 9 digits
+            if((tok_len < 2) || (tok_len > 10))
+                return false;
+            wait_ms = 0;
+            for(size_t i = 1; i < tok_len; i++)
+            {
+                if((tok[i] < '0') || (tok[i] > '9'))
+                    return false;
+                wait_ms = wait_ms * 10 + (uint32_t)(tok[i] - '0');
+            }
+            if(delay_ms > UINT32_MAX - wait_ms)
+                return false;
+            delay_ms += wait_ms;
+        }
+        else
+        {
+            if(record->count == SEQ_MAX_STEPS)
+                return false;
+            step  = &record->step[record->count];
+            comma = memchr(tok,',',tok_len);
+            if(comma == NULL)
+                return false;
+            words = tca_bank_from_hex(tok,(size_t)(comma - tok),&step->mask);
+            if((words == 0) || (tca_bank_from_hex(comma + 1,tok_len - (size_t)(comma - tok) - 1,&step->value) == 0))
+                return false;
+            if(words > record->words)
+                record->words = words;
+            step->delay_ms = delay_ms;
+            delay_ms = 0;
+            record->count++;
+        }
+
+        tok += tok_len + 1;
+    }
+
+    if(delay_ms != 0)
+    {
+        if(record->count == SEQ_MAX_STEPS)
+            return false;
+        record->step[record->count++].delay_ms = delay_ms;
+    }
+
+    return record->count != 0;
+}
+
+// -------------------------------------------------------------------
+// Progress on relay/seq/status, through the publication mailbox 
+// of the slot: the I2C task never waits on MQTT
+static void seq_status_post(uint8_t slot, const char* state)
+{
+    mqtt_seq_status_t status;
+
+    memcpy(status.name,seq_slot[slot].name,sizeof(status.name));
+    status.state = state;
+    status.step  = seq_slot[slot].next;
+    status.steps = seq_slot[slot].record.count;
+    user_mqtt_seq_post(slot,&status);
+
+    ESP_LOGD(TAG,"Sequence %s %s %u/%u",status.name,state,status.step,status.steps);
+}
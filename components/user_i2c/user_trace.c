@@ -0,0 +1,129 @@
+/*
+ * Command latency histograms
+ * Stamps are esp_timer microseconds taken along the command path, 
+ * each stage is recorded with a few instructions under a spinlock
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "user_trace.h"
+
+typedef struct trace_hist_t
+{
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t bucket[TRACE_BUCKETS];
+} trace_hist_t;
+
+static trace_hist_t trace_hist[TRACE_STAGES];
+static portMUX_TYPE trace_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char* const trace_stage_names[TRACE_STAGES] =
+{
+    "ingress", "queue", "batch", "i2c", "pub_enqueue", "publish", "actuate", "e2e_pub"
+};
+
+
+// -------------------------------------------------------------------
+// Bucket of a value: exact below 4, then 4 sub-buckets per power of two
+static inline uint32_t trace_bucket(uint32_t us)
+{
+    uint32_t msb;
+
+    if(us < 4)
+        return us;
+
+    msb = 31 - __builtin_clz(us);
+    return 4 + (msb - 2) * 4 + ((us >> (msb - 2)) & 0x03);
+}
+
+// -------------------------------------------------------------------
+// Largest value falling in a bucket
+static uint32_t trace_bucket_upper(uint32_t bucket)
+{
+    uint32_t msb, sub;
+
+    if(bucket < 4)
+        return bucket;
+
+    msb = (bucket - 4) / 4 + 2;
+    sub = (bucket - 4) % 4;
+    return ((4 + sub) << (msb - 2)) + ((1u << (msb - 2)) - 1);
+}
+
+// -------------------------------------------------------------------
+// Value below which pct percent of the samples fall
+static uint32_t trace_percentile(const trace_hist_t* hist, uint32_t pct)
+{
+    uint64_t target = ((uint64_t)hist->count * pct + 99) / 100;
+    uint64_t seen = 0;
+    uint32_t upper;
+
+    for(uint32_t i = 0; i < TRACE_BUCKETS; i++)
+    {
+        seen += hist->bucket[i];
+        if(seen >= target && seen != 0)
+        {
+            upper = trace_bucket_upper(i);
+            return (upper < hist->max_us) ? upper : hist->max_us;
+        }
+    }
+    return hist->max_us;
+}
+
+
+// -------------------------------------------------------------------
+// Record the time spent in a stage, ignored when a stamp is missing
+void trace_record(trace_stage_t stage, int64_t start_us, int64_t end_us)
+{
+    int64_t  delta = end_us - start_us;
+    uint32_t us;
+
+    if((stage >= TRACE_STAGES) || (start_us == 0) || (end_us == 0) || (delta < 0))
+        return;
+    us = (delta > UINT32_MAX) ? UINT32_MAX : (uint32_t)delta;
+
+    portENTER_CRITICAL(&trace_mux);
+    trace_hist[stage].bucket[trace_bucket(us)]++;
+    trace_hist[stage].count++;
+    if(us > trace_hist[stage].max_us)
+        trace_hist[stage].max_us = us;
+    portEXIT_CRITICAL(&trace_mux);
+}
+
+// -------------------------------------------------------------------
+void trace_summary_get(trace_stage_t stage, trace_summary_t* summary)
+{
+    memset(summary,0,sizeof(*summary));
+
+    if(stage >= TRACE_STAGES)
+        return;
+
+    // Two walks over TRACE_BUCKETS counters, short enough for the lock
+    portENTER_CRITICAL(&trace_mux);
+    summary->count  = trace_hist[stage].count;
+    summary->max_us = trace_hist[stage].max_us;
+    if(summary->count != 0)
+    {
+        summary->p50_us = trace_percentile(&trace_hist[stage],50);
+        summary->p99_us = trace_percentile(&trace_hist[stage],99);
+    }
+    portEXIT_CRITICAL(&trace_mux);
+}
+
+// -------------------------------------------------------------------
+const char* trace_stage_name(trace_stage_t stage)
+{
+    return (stage < TRACE_STAGES) ? trace_stage_names[stage] : "unknown";
+}
+
+// -------------------------------------------------------------------
+void trace_reset(void)
+{
+    portENTER_CRITICAL(&trace_mux);
+    memset(trace_hist,0,sizeof(trace_hist));
+    portEXIT_CRITICAL(&trace_mux);
+}
@@ -5,43 +5,209 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "sdkconfig.h"
 #include "esp_err.h"
+#include "user_i2c.h"
+#include "user_seq.h"
 
 #define ESP_BROKER_URL "mqtt://192.168.2.101"
 #define ESP_BROKER_PORT 1883
 
+#define MQTT_PUB_QUEUE_LEN 5 // Gets and diagnostics waiting on mqtt_tca_exchange_queue
+
+// Client outbox bound: messages enqueued and not yet acknowledged by the 
+// broker. A state the outbox cannot take stays pending and is retried
+#define MQTT_OUTBOX_LIMIT_BYTES 8192
+#define MQTT_PUB_RETRY_MS       100
+
+// Minimum interval between two publications of a state topic (0: none), 
+// per channel topics and relay/input/event follow their bank topic
+#define MQTT_INPUT_PUB_MIN_INTERVAL_MS  100
+#define MQTT_OUTPUT_PUB_MIN_INTERVAL_MS 0   // Command answers are not held back
+
+// Reassembly buffer of the payloads split across several data events, 
+// larger messages are rejected
+#define MQTT_RX_PAYLOAD_LEN 512
+#define MQTT_RX_TOPIC_LEN   64
+
 #define RELAY_INPUT_GET   "relay/input/get"
+// relay/input/pub and relay/output/pub are retained and only sent when 
+// the state changes (or on a get), at most once per minimum interval: 
+// the last state of a burst is sent when the interval expires
 #define RELAY_INPUT_PUB   "relay/input/pub"
+#define RELAY_INPUT_EVENT "relay/input/event" // "inputs,edge_us" on interruption driven changes
 
-#define RELAY_OUTPUT_SET  "relay/output/set"
+#define RELAY_OUTPUT_SET  "relay/output/set" // Hex bank, right aligned: the last 4 digits are channels 0-15
 #define RELAY_OUTPUT_GET  "relay/output/get"
 #define RELAY_OUTPUT_PUB  "relay/output/pub"
 
+// Idempotent output commands: the payload of any relay/output command 
+// topic may start with "@client,seq;", e.g. "@plc1,42;ff". Per client, 
+// a sequence number already applied (or older than the window) is not 
+// applied again. Each command is acknowledged on relay/output/ack once 
+// its I2C commit is done, a replay right away with the current state:
+// {"client":"plc1","seq":42,"out":"hex","ts":us,"dup":false}
+// A client restarting its sequence numbers uses a new client id
+#define RELAY_OUTPUT_ACK   "relay/output/ack"
+#define MQTT_CLIENT_ID_LEN 16 // [A-Za-z0-9_-]
+#define MQTT_DEDUP_CLIENTS 8  // Clients tracked, the least recently seen one is replaced
+#define MQTT_DEDUP_WINDOW  32 // Sequence numbers below the highest one still accepted once
+#define MQTT_ACK_SLOTS     16 // Commands waiting for their acknowledgement
+
+// Bit level output commands, payload is a hex mask
+// relay/output/write payload is "mask,value" both in hex
+#define RELAY_OUTPUT_BITS_SET    "relay/output/bits/set"
+#define RELAY_OUTPUT_BITS_CLEAR  "relay/output/bits/clear"
+#define RELAY_OUTPUT_BITS_TOGGLE "relay/output/bits/toggle"
+#define RELAY_OUTPUT_WRITE       "relay/output/write"
+
+// Per channel topics, n counts from 0 across the output (input) bank
+// - relay/output/<n>/set:   "1"/"on", "0"/"off" or "toggle"
+// - relay/output/<n>/state: "1" or "0", retained, sent when the channel changes
+// - relay/input/<n>/state:  "1" or "0", retained, sent when the channel changes
+// Timed actions, run by the I2C task (duration in ms):
+// - relay/output/<n>/pulse:     "T", on now and off after T
+// - relay/output/<n>/delay_off: "T", off after T
+// - relay/output/<n>/revert:    "state,T", state as for set, back to the 
+//                               previous level after T
+// A later command on the channel replaces its pending timer
+// relay/output/<n>/set is subscribed channel by channel: a "+" filter 
+// would also match relay/output/bits/set, delivered twice by brokers 
+// that send one copy per matching subscription
+#define RELAY_OUTPUT_CHANNEL_SET       "relay/output/%u/set"
+#define RELAY_OUTPUT_CHANNEL_PULSE     "relay/output/+/pulse"
+#define RELAY_OUTPUT_CHANNEL_DELAY_OFF "relay/output/+/delay_off"
+#define RELAY_OUTPUT_CHANNEL_REVERT    "relay/output/+/revert"
+#define RELAY_OUTPUT_CHANNEL_PREFIX    "relay/output/"
+#define RELAY_INPUT_CHANNEL_PREFIX     "relay/input/"
+#define RELAY_CHANNEL_STATE_SUFFIX     "/state"
+
 
 
 #define RELAY_STATUS "relay/status"
 
+// Combined state, optional: inputs and outputs of the same TCA state 
+// snapshot, with its sequence number (tca_state_t.seq, gaps are states 
+// replaced before publication) and its esp_timer time. Retained, one 
+// message per change. Off by default, existing deployments keep the 
+// bank and channel topics only. Format, per deployment:
+// - MQTT_STATE_FORMAT_BINARY: little endian, fixed layout
+//   u8 version (1), u8 input words, u8 output words, u8 flags, u32 seq, 
+//   i64 timestamp_us, then the input words and the output words (u16)
+//   flags bit 0: stale, an expander is down and its words hold the 
+//   last good state
+// - MQTT_STATE_FORMAT_JSON:   {"seq":N,"ts":us,"in":"hex","out":"hex"}, 
+//   with "stale":true while an expander is down
+// MQTT_STATE_SPLIT_TOPICS 0 leaves the combined topic alone: the bank 
+// and per channel state topics are then only sent to answer a get. 
+// It follows the format: enabling the combined topic replaces the 
+// split topics unless MQTT_STATE_SPLIT_TOPICS 1 is also set
+#define RELAY_STATE "relay/state"
+
+#define MQTT_STATE_FORMAT_OFF    0
+#define MQTT_STATE_FORMAT_BINARY 1
+#define MQTT_STATE_FORMAT_JSON   2
+
+#ifndef MQTT_STATE_FORMAT
+#define MQTT_STATE_FORMAT        MQTT_STATE_FORMAT_OFF
+#endif
+#ifndef MQTT_STATE_SPLIT_TOPICS
+#define MQTT_STATE_SPLIT_TOPICS  (MQTT_STATE_FORMAT == MQTT_STATE_FORMAT_OFF)
+#endif
+#if (MQTT_STATE_FORMAT == MQTT_STATE_FORMAT_OFF) && !MQTT_STATE_SPLIT_TOPICS
+#error "MQTT_STATE_SPLIT_TOPICS 0 needs the combined state topic (MQTT_STATE_FORMAT)"
+#endif
+#define MQTT_STATE_BINARY_VERSION 1
+#define MQTT_STATE_FLAG_STALE     0x01
+
+// Output sequences (user_seq.h), run by the I2C task
+// - relay/seq/set:    "name:steps" saves the sequence in NVS, "name:" erases it
+// - relay/seq/run:    "name"
+// - relay/seq/cancel: "name", every running sequence if empty
+// - relay/seq/status: {"name":"n","state":"running|done|cancelled","step":k,"steps":m}, 
+//                     k steps written so far
+#define RELAY_SEQ_SET    "relay/seq/set"
+#define RELAY_SEQ_RUN    "relay/seq/run"
+#define RELAY_SEQ_CANCEL "relay/seq/cancel"
+#define RELAY_SEQ_STATUS "relay/seq/status"
+
+// Local input to output rules (user_rules.h), payload is the rules 
+// text, saved in NVS and applied at once. Empty removes every rule
+#define RELAY_RULES_SET  "relay/rules/set"
+
+// Diagnostics: any message on relay/diag/get publishes the command 
+// latency histograms, {"stage":{"n":N,"p50":us,"p99":us,"max":us},...}
+#define RELAY_DIAG_GET     "relay/diag/get"
+#define RELAY_DIAG_LATENCY "relay/diag/latency"
+
 
 typedef enum 
 {
     MQTT_TCA_INP_PUB,
-    MQTT_TCA_OUT_PUB
+    MQTT_TCA_OUT_PUB,
+    MQTT_DIAG_PUB
 } mqtt_action_type_h;
 
 
 typedef struct mqtt_access_ctrl_t
 {
-    uint16_t tca_in_payload;
-    uint16_t tca_out_payload;
+    tca_bank_t tca_in_payload;
+    tca_bank_t tca_out_payload;
+    uint8_t  words;        // Words in use in the payload bank
+    int64_t  timestamp_us; // Input edge capture time (esp_timer), 0 if not edge driven
+    int64_t  ingress_us;   // Oldest command behind an output publication, 0 if none
+    int64_t  enqueue_us;   // Publication queued (latency tracing)
+    bool     force;        // Get: published even if the state did not change
     mqtt_action_type_h mqtt_action;
 } mqtt_access_ctrl_handle_t;
 
 
+// -----------------------------------------------------
+// Sequence progress, one latest value mailbox per run slot
+typedef struct mqtt_seq_status_t
+{
+    char        name[SEQ_NAME_LEN + 1];
+    const char* state; // Static string
+    uint8_t     step;
+    uint8_t     steps;
+} mqtt_seq_status_t;
+
+
+// -----------------------------------------------------
+// MQTT client counters
+typedef struct mqtt_stats_t
+{
+    uint32_t published;        // Messages handed to the client
+    uint32_t publish_errors;   // Messages refused by the client (outbox full or offline)
+    uint32_t received;         // MQTT_EVENT_DATA events
+    uint32_t rejected;         // Messages too large for the reassembly buffer or incomplete
+    uint32_t dropped;          // Publications refused by a full mqtt_tca_exchange_queue
+    uint32_t overwritten;      // States replaced in their mailbox before being taken
+    uint32_t duplicates;       // Commands not applied again (client sequence number already seen)
+    uint32_t ack_dropped;      // Commands applied without acknowledgement (no slot left)
+    uint32_t queue_depth;      // Publications waiting on mqtt_tca_exchange_queue
+    uint32_t queue_high_water; // Most publications ever waiting on mqtt_tca_exchange_queue
+    uint32_t stack_free;       // MQTTPubTask stack high water mark (bytes never used)
+} mqtt_stats_t;
+
+
 esp_err_t user_mqtt_start(void);
 void user_mqtt_subscribe(char* topic, int qos);
 void user_mqtt_unsubscribe(char* topic);
-void user_mqtt_publish(char* topic, char* payload, int qos, bool retain);
 bool user_mqtt_con_status(void);
+bool user_mqtt_wait_connected(TickType_t wait);
 void user_mqtt_stop(void);
+BaseType_t user_mqtt_queue_send(const mqtt_access_ctrl_handle_t* msg, TickType_t wait);
+void user_mqtt_stats_get(mqtt_stats_t* stats);
+void user_mqtt_state_post(const mqtt_access_ctrl_handle_t* msg);
+bool user_mqtt_state_take(mqtt_action_type_h action, mqtt_access_ctrl_handle_t* msg);
+void user_mqtt_pub_listener_set(TaskHandle_t task);
+void user_mqtt_seq_post(uint8_t slot, const mqtt_seq_status_t* status);
+void user_mqtt_ack_post(uint32_t tag, const tca_bank_t* out, uint8_t words, int64_t actuated_us);
+
+#if CONFIG_IDF_TARGET_LINUX
+void user_mqtt_inject(const char* topic, const char* payload, int payload_len);
+void user_mqtt_inject_fragmented(const char* topic, const char* payload, int payload_len, int fragment_len);
+#endif
 
 #endif
\ No newline at end of file
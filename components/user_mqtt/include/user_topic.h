@@ -0,0 +1,41 @@
+#ifndef USER_TOPIC_H
+#define USER_TOPIC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// -----------------------------------------------------
+// Incoming topic routing. Topics are matched segment by 
+// segment on a constant trie, straight on the event buffer 
+// (not '\0' terminated), a numeric segment is parsed in 
+// place as the channel index
+typedef enum
+{
+    MQTT_ROUTE_NONE,
+    MQTT_ROUTE_OUTPUT_SET,     // relay/output/set
+    MQTT_ROUTE_OUTPUT_GET,     // relay/output/get
+    MQTT_ROUTE_INPUT_GET,      // relay/input/get
+    MQTT_ROUTE_BITS_SET,       // relay/output/bits/set
+    MQTT_ROUTE_BITS_CLEAR,     // relay/output/bits/clear
+    MQTT_ROUTE_BITS_TOGGLE,    // relay/output/bits/toggle
+    MQTT_ROUTE_OUTPUT_WRITE,   // relay/output/write
+    MQTT_ROUTE_DIAG_GET,       // relay/diag/get
+    MQTT_ROUTE_CHANNEL_SET,    // relay/output/<n>/set
+    MQTT_ROUTE_CHANNEL_PULSE,  // relay/output/<n>/pulse
+    MQTT_ROUTE_CHANNEL_DELAY_OFF, // relay/output/<n>/delay_off
+    MQTT_ROUTE_CHANNEL_REVERT, // relay/output/<n>/revert
+    MQTT_ROUTE_SEQ_SET,        // relay/seq/set
+    MQTT_ROUTE_SEQ_RUN,        // relay/seq/run
+    MQTT_ROUTE_SEQ_CANCEL,     // relay/seq/cancel
+    MQTT_ROUTE_RULES_SET       // relay/rules/set
+} mqtt_route_t;
+
+
+// -----------------------------------------------------
+// channel is set for the routes with a <n> segment
+mqtt_route_t mqtt_topic_route(const char* topic, int len, uint16_t* channel);
+
+// prefix<n>suffix, returns the length or 0 if buf is too small
+int mqtt_channel_topic(char* buf, size_t size, const char* prefix, uint16_t channel, const char* suffix);
+
+#endif
@@ -1,17 +1,25 @@
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_check.h"
+#include "esp_timer.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
+#include "freertos/task.h"
 
 #include "mqtt_client.h"
 
 #include "user_i2c.h"
 #include "user_mqtt.h"
+#include "user_trace.h"
+#include "user_topic.h"
+#include "user_seq.h"
+#include "user_rules.h"
 
 
 // -----------------------------------------
@@ -27,18 +35,194 @@ extern QueueHandle_t mqtt_tca_exchange_queue;
 
 static EventGroupHandle_t       s_mqtt_event_group = NULL;
 static esp_mqtt_client_handle_t mqtt_client  = NULL;
+static TaskHandle_t             mqtt_pub_task_handle = NULL;
+
+static mqtt_stats_t mqtt_stats;
+
+// Reassembly of a payload split across MQTT_EVENT_DATA events, 
+// only used from the MQTT event task
+typedef struct mqtt_rx_t
+{
+    char    topic[MQTT_RX_TOPIC_LEN];
+    char    payload[MQTT_RX_PAYLOAD_LEN];
+    int     topic_len;
+    int     len;        // Payload bytes received so far
+    int     total;      // Payload length announced by the first fragment
+    bool    active;     // A fragmented message is in progress
+    bool    discard;    // Rejected: fragments are skipped until its end
+    int64_t ingress_us; // First fragment arrival
+} mqtt_rx_t;
+
+static mqtt_rx_t mqtt_rx;
+
+// Retained state topics, only used by the publication task. A new 
+// value equal to the published one is dropped, a value arriving 
+// within min_interval_ms of the last publication waits as pending 
+// and is replaced by any newer one, so a burst ends on its last state
+typedef struct mqtt_state_pub_t
+{
+    const char* topic;           // Bank topic, hex payload
+    const char* channel_prefix;  // Per channel <prefix><n>/state topics
+    uint32_t    min_interval_ms;
+    tca_bank_t  published;       // Last bank sent
+    uint8_t     published_words; // 0 before the first publication
+    tca_bank_t  pending;
+    uint8_t     pending_words;
+    bool        has_pending;
+    bool        force;           // A get is pending: sent even if unchanged
+    int64_t     edge_us;         // Edge behind the pending input change, 0 if none
+    int64_t     ingress_us;      // Oldest command folded in the pending state
+    int64_t     enqueue_us;
+    int64_t     last_us;         // Last publication of the bank topic
+    int64_t     due_us;          // Earliest time the pending state may be sent
+    tca_bank_t  channels;        // Per channel states sent
+    uint8_t     channel_words;   // 0 before the first publication
+} mqtt_state_pub_t;
+
+enum { MQTT_STATE_INPUT, MQTT_STATE_OUTPUT, MQTT_STATE_TOPICS };
+
+static mqtt_state_pub_t mqtt_state_pub[MQTT_STATE_TOPICS] =
+{
+    [MQTT_STATE_INPUT]  = { .topic = RELAY_INPUT_PUB,  .channel_prefix = RELAY_INPUT_CHANNEL_PREFIX,
+                            .min_interval_ms = MQTT_INPUT_PUB_MIN_INTERVAL_MS },
+    [MQTT_STATE_OUTPUT] = { .topic = RELAY_OUTPUT_PUB, .channel_prefix = RELAY_OUTPUT_CHANNEL_PREFIX,
+                            .min_interval_ms = MQTT_OUTPUT_PUB_MIN_INTERVAL_MS },
+};
+static portMUX_TYPE mqtt_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Latest value mailboxes, one per state topic, between the I2C 
+// task (and any state producer) and the publication task
+typedef struct mqtt_mailbox_t
+{
+    mqtt_access_ctrl_handle_t msg;
+    bool full;
+} mqtt_mailbox_t;
+
+static mqtt_mailbox_t mqtt_mailbox[MQTT_STATE_TOPICS];
+static portMUX_TYPE   mqtt_mailbox_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t   mqtt_pub_listener = NULL;
+
+// Sequence progress: mailbox per run slot (same lock), taken by 
+// the publication task in its pending copy, kept until the outbox 
+// takes it
+typedef struct mqtt_seq_mailbox_t
+{
+    mqtt_seq_status_t status;
+    bool full;
+} mqtt_seq_mailbox_t;
+
+typedef struct mqtt_seq_pub_t
+{
+    mqtt_seq_status_t status;
+    bool    has_pending;
+    int64_t due_us;
+} mqtt_seq_pub_t;
+
+static mqtt_seq_mailbox_t mqtt_seq_mailbox[SEQ_RUNNING_MAX];
+static mqtt_seq_pub_t     mqtt_seq_pub[SEQ_RUNNING_MAX];
+
+// Combined state topic, only used by the publication task. The 
+// snapshot is read from the I2C task seqlock when the task wakes, 
+// nothing is copied on the I2C side
+typedef struct mqtt_snapshot_pub_t
+{
+    uint32_t seq;       // Last snapshot sent
+    bool     published; // seq is valid
+    int64_t  due_us;    // Retry time after a refused publication, 0 if none
+} mqtt_snapshot_pub_t;
+
+static mqtt_snapshot_pub_t mqtt_snapshot_pub;
+
+// Client id and sequence number of an idempotent command
+typedef struct mqtt_envelope_t
+{
+    char     client[MQTT_CLIENT_ID_LEN + 1];
+    uint32_t seq;
+} mqtt_envelope_t;
+
+// Per client dedup window, only used from the MQTT event task. 
+// Bit i of window is sequence number top - i, a free entry has 
+// an empty client
+typedef struct mqtt_dedup_t
+{
+    char     client[MQTT_CLIENT_ID_LEN + 1];
+    uint32_t top;
+    uint32_t window;
+    int64_t  last_us;
+} mqtt_dedup_t;
+
+static mqtt_dedup_t mqtt_dedup[MQTT_DEDUP_CLIENTS];
+
+// Acknowledgement slots: opened by the event task, completed by the 
+// I2C task after the commit, published and freed by the publication 
+// task. State changes under mqtt_mailbox_mux
+typedef enum
+{
+    MQTT_ACK_FREE,
+    MQTT_ACK_WAITING, // Command queued to the I2C task
+    MQTT_ACK_DONE     // Applied, acknowledgement to publish
+} mqtt_ack_state_t;
+
+typedef struct mqtt_ack_t
+{
+    mqtt_ack_state_t state;
+    uint32_t         tag;  // Generation << 8 | slot index, never 0
+    mqtt_envelope_t  env;
+    tca_bank_t       out;
+    uint8_t          words;
+    int64_t          actuated_us;
+} mqtt_ack_t;
+
+static mqtt_ack_t mqtt_ack[MQTT_ACK_SLOTS];
+static uint32_t   mqtt_ack_gen = 0;
+static int64_t    mqtt_ack_due_us = 0; // Retry time after a refused acknowledgement, 0 if none
+
+// Publication task notification bits
+#define MQTT_NOTIFY_STATE BIT0 // A state was posted in a mailbox
+#define MQTT_NOTIFY_QUEUE BIT1 // A message was queued on mqtt_tca_exchange_queue
+#define MQTT_NOTIFY_ONLINE BIT2 // Broker connection up, pending states can go
 
 
 // ---------------------------------------------------------
 // File scope variables
 static const char* TAG = "MQTT";
 
+#define MQTT_DIAG_BUFFER_LEN 768 // Latency summary of every trace stage
+
 
 // ------------------------------------------------------
 // static (local) functions
 static void log_error_if_nonzero(const char*, int);
 static void mqtt_event_handler(void*, esp_event_base_t,int32_t, void*);
 static void mqtt_pub_task(void* PvParameters);
+static bool mqtt_out_bank_send(i2c_action_type_t action, const tca_bank_t* mask, 
+                               const tca_bank_t* value, uint8_t words, int64_t ingress_us, uint32_t ack_tag);
+static int  mqtt_diag_latency_json(char* buf, size_t size);
+static bool mqtt_channel_action(const char* payload, int len, i2c_action_type_t* action);
+static bool mqtt_duration_parse(const char* payload, int len, uint32_t* duration_ms);
+static bool mqtt_channel_timed_send(uint16_t channel, i2c_action_type_t action, tca_timer_type_t timer,
+                                    uint32_t duration_ms, int64_t ingress_us, uint32_t ack_tag);
+static bool mqtt_route_is_output(mqtt_route_t route);
+static bool mqtt_envelope_parse(const char** payload, int* len, mqtt_envelope_t* env);
+static bool mqtt_dedup_seen(const mqtt_envelope_t* env);
+static void mqtt_dedup_record(const mqtt_envelope_t* env);
+static uint32_t mqtt_ack_open(const mqtt_envelope_t* env);
+static void mqtt_ack_release(uint32_t tag);
+static void mqtt_ack_duplicate(const mqtt_envelope_t* env);
+static void mqtt_ack_flush(int64_t now_us);
+static void mqtt_data_dispatch(const char* topic, int topic_len, const char* payload, 
+                               int payload_len, int64_t ingress_us);
+static void mqtt_data_fragment(const esp_mqtt_event_t* event, int64_t ingress_us);
+static bool mqtt_channel_states_publish(const char* prefix, const tca_bank_t* bank, uint8_t words,
+                                        tca_bank_t* last, uint8_t* last_words);
+static int  mqtt_enqueue(const char* topic, const char* payload, int qos, bool retain);
+static void mqtt_state_update(int index, const mqtt_access_ctrl_handle_t* msg, const tca_bank_t* bank);
+static void mqtt_state_flush(int64_t now_us);
+static TickType_t mqtt_state_wait(int64_t now_us);
+static void mqtt_online(void);
+static void mqtt_seq_flush(int64_t now_us);
+static void mqtt_snapshot_flush(int64_t now_us);
+static int  mqtt_enqueue_len(const char* topic, const char* payload, int len, int qos, bool retain);
 
 
 // ------------------------------------------------------
@@ -57,14 +241,10 @@ static void mqtt_event_handler(void* event_handler_arg,
             esp_event_base_t event_base,
             int32_t event_id, void* event_data)
 {
-    ESP_LOGI(TAG, "Message from Event loop base = %s, event_id = %"PRIi32"",
-    event_base, event_id);
+    int64_t ingress_us = esp_timer_get_time(); // Command latency tracing
 
-    // I2C device access control
-    i2c_access_ctrl_handle_t i2c_access_handle;
-    
-    // Queue answers monitoring 
-    BaseType_t x_queue_answer =  pdTRUE;
+    ESP_LOGD(TAG, "Message from Event loop base = %s, event_id = %"PRIi32"",
+    event_base, event_id);
 
     // Get data from event generated by MQTT event loop
     esp_mqtt_event_handle_t event = event_data;
@@ -93,8 +273,9 @@ static void mqtt_event_handler(void* event_handler_arg,
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
 
         // Set event group bit, changing MQTT status to "Online"
-        xEventGroupClearBits(s_mqtt_event_group,MQTT_DISCONNECTED_BIT);
+        xEventGroupClearBits(s_mqtt_event_group,MQTT_DISCONNECTED_BIT|MQTT_ERROR_BIT);
         xEventGroupSetBits(s_mqtt_event_group,MQTT_CONNECTED_BIT);
+        mqtt_online();
         break;
 
     case MQTT_EVENT_DISCONNECTED: // disconnected event
@@ -133,60 +314,14 @@ static void mqtt_event_handler(void* event_handler_arg,
     * - qos:                  QoS level of the message
     * - dup:                  dup flag of the message
     */
-        ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        // printf("topic: %.*s\n", event->topic_len, event->topic);
-        // printf("message: %.*s\n", event->data_len, event->data);
-        printf("QoS: %d\n", event->qos);
-
-        // Memory allocation for topic
-        char* topic = NULL;
-        topic = malloc(event->topic_len+1);
-        memset(topic,0,event->topic_len+1);
-        memcpy(topic,event->topic,event->topic_len);
-
-        // Memmory allocation for payload
-        char* payload = NULL;
-        payload = malloc(event->data_len+1);
-        memset(payload,0,event->data_len+1);
-        memcpy(payload,event->data,event->data_len);
-
-        printf("Topic: %s\n",topic);
-        printf("Payload: %s\n", payload);
-
-        // Check the received topic
-        if(strcmp(RELAY_OUTPUT_SET,topic) == 0)
-        {
-            i2c_access_handle.i2c_action   = MQTT_TCA_OUT_SET;
-            i2c_access_handle.tca_out_stat = (uint16_t)strtol(payload,NULL,16);
-            x_queue_answer = xQueueSend(i2C_access_queue,&i2c_access_handle,pdMS_TO_TICKS(50));
+        ESP_LOGD(TAG, "MQTT_EVENT_DATA");
+        mqtt_stats.received++; // Only the MQTT event task writes it
 
-            if(x_queue_answer != pdTRUE)
-                ESP_LOGW(TAG,"MQTT set output queue answer timeout");
-            
-        }
-        else if(strcmp(RELAY_INPUT_GET,topic) == 0)
-        {
-            i2c_access_handle.i2c_action   = MQTT_TCA_INP_GET;
-            x_queue_answer =xQueueSend(i2C_access_queue,&i2c_access_handle,pdMS_TO_TICKS(50));
-
-            if(x_queue_answer != pdTRUE)
-                ESP_LOGW(TAG,"MQTT get input queue answer timeout");
-
-        }
-        else if(strcmp(RELAY_OUTPUT_GET,topic) == 0)
-        {
-            i2c_access_handle.i2c_action   = MQTT_TCA_OUT_GET;
-            x_queue_answer = xQueueSend(i2C_access_queue,&i2c_access_handle,pdMS_TO_TICKS(50));
-
-            if(x_queue_answer != pdTRUE)
-                ESP_LOGW(TAG,"MQTT geti output queue answer timeout");
-        }
-        
-        // Free usage memmory
-        free(topic);
-		free(payload);
-        topic = NULL;
-        payload = NULL;
+        // Whole message in this event: parsed in place
+        if((event->current_data_offset == 0) && (event->data_len == event->total_data_len))
+            mqtt_data_dispatch(event->topic,event->topic_len,event->data,event->data_len,ingress_us);
+        else
+            mqtt_data_fragment(event,ingress_us);
         break;
     case MQTT_EVENT_BEFORE_CONNECT: // The event occurs before connecting
         ESP_LOGI(TAG, "MQTT_EVENT_BEFORE_CONNECT");
@@ -204,8 +339,308 @@ static void mqtt_event_handler(void* event_handler_arg,
     return;
 }
 
+// ------------------------------------------------------
+// Route and apply one complete message. topic and payload are 
+// parsed where they are, either the client event buffer or the 
+// reassembly buffer, neither is '\0' terminated
+static void mqtt_data_dispatch(const char* topic, int topic_len, const char* payload, 
+                               int payload_len, int64_t ingress_us)
+{
+    i2c_action_type_t action;
+    mqtt_access_ctrl_handle_t mqtt_pub_handle = {0};
+    tca_state_t tca_state;
+    tca_bank_t  bank_mask;
+    tca_bank_t  bank_value;
+    uint8_t     words = 0;
+    uint16_t    channel = 0;
+    uint32_t    duration_ms = 0;
+    esp_err_t   err;
+    mqtt_route_t route;
+    const char* value;
+    mqtt_envelope_t env;
+    bool        enveloped = false;
+    bool        sent = false;
+    uint32_t    ack_tag = 0;
+
+    ESP_LOGD(TAG,"Topic: %.*s Payload: %.*s",topic_len,topic,payload_len,payload);
+
+    route = mqtt_topic_route(topic,topic_len,&channel);
+
+    // Idempotent output command: "@client,seq;" before the payload
+    if(mqtt_route_is_output(route) && (payload_len > 0) && (payload[0] == '@'))
+    {
+        if(!mqtt_envelope_parse(&payload,&payload_len,&env))
+        {
+            ESP_LOGW(TAG,"MQTT command malformed client envelope: %.*s",payload_len,payload);
+            return;
+        }
+        if(mqtt_dedup_seen(&env))
+        {
+            mqtt_ack_duplicate(&env);
+            return;
+        }
+        enveloped = true;
+        ack_tag   = mqtt_ack_open(&env); // 0: applied without acknowledgement
+    }
+
+    switch(route)
+    {
+    case MQTT_ROUTE_OUTPUT_SET:
+        // Only the words present in the payload are written
+        words = tca_bank_from_hex(payload,payload_len,&bank_value);
+        if(words != 0)
+            sent = mqtt_out_bank_send(MQTT_TCA_OUT_SET,NULL,&bank_value,words,ingress_us,ack_tag);
+        else
+            ESP_LOGW(TAG,"MQTT set output malformed payload: %.*s",payload_len,payload);
+        break;
+
+    case MQTT_ROUTE_BITS_SET:
+    case MQTT_ROUTE_BITS_CLEAR:
+    case MQTT_ROUTE_BITS_TOGGLE:
+        if(route == MQTT_ROUTE_BITS_SET)
+            action = TCA_OUT_BITS_SET;
+        else if(route == MQTT_ROUTE_BITS_CLEAR)
+            action = TCA_OUT_BITS_CLEAR;
+        else
+            action = TCA_OUT_BITS_TOGGLE;
+
+        words = tca_bank_from_hex(payload,payload_len,&bank_mask);
+        if(words != 0)
+            sent = mqtt_out_bank_send(action,&bank_mask,NULL,words,ingress_us,ack_tag);
+        else
+            ESP_LOGW(TAG,"MQTT output bits malformed payload: %.*s",payload_len,payload);
+        break;
+
+    case MQTT_ROUTE_OUTPUT_WRITE:
+        // Payload: "mask,value"
+        value = memchr(payload,',',payload_len);
+        if(value != NULL)
+        {
+            words = tca_bank_from_hex(payload,value - payload,&bank_mask);
+            if(tca_bank_from_hex(value+1,payload_len - (value - payload) - 1,&bank_value) == 0)
+                words = 0;
+        }
+
+        if(words != 0)
+            sent = mqtt_out_bank_send(TCA_OUT_BITS_WRITE,&bank_mask,&bank_value,words,ingress_us,ack_tag);
+        else
+            ESP_LOGW(TAG,"MQTT output write malformed payload: %.*s",payload_len,payload);
+        break;
+
+    case MQTT_ROUTE_CHANNEL_SET:
+        // One output channel, channel n is bit n%16 of word n/16
+        if(mqtt_channel_action(payload,payload_len,&action))
+        {
+            memset(&bank_mask,0,sizeof(bank_mask));
+            bank_mask.word[channel / 16] = (uint16_t)BIT(channel % 16);
+            sent = mqtt_out_bank_send(action,&bank_mask,NULL,(uint8_t)(channel / 16 + 1),ingress_us,ack_tag);
+        }
+        else
+            ESP_LOGW(TAG,"MQTT output %u malformed payload: %.*s",channel,payload_len,payload);
+        break;
+
+    case MQTT_ROUTE_CHANNEL_PULSE:
+    case MQTT_ROUTE_CHANNEL_DELAY_OFF:
+        // Payload: duration in ms
+        if(mqtt_duration_parse(payload,payload_len,&duration_ms))
+            sent = mqtt_channel_timed_send(channel,(route == MQTT_ROUTE_CHANNEL_PULSE) ? TCA_OUT_BITS_SET : TCA_OUT_TIMER,
+                                           TCA_TIMER_OFF,duration_ms,ingress_us,ack_tag);
+        else
+            ESP_LOGW(TAG,"MQTT output %u malformed duration: %.*s",channel,payload_len,payload);
+        break;
+
+    case MQTT_ROUTE_CHANNEL_REVERT:
+        // Payload: "state,duration"
+        value = memchr(payload,',',payload_len);
+        if((value != NULL) && mqtt_channel_action(payload,value - payload,&action) &&
+           mqtt_duration_parse(value+1,payload_len - (value - payload) - 1,&duration_ms))
+            sent = mqtt_channel_timed_send(channel,action,TCA_TIMER_REVERT,duration_ms,ingress_us,ack_tag);
+        else
+            ESP_LOGW(TAG,"MQTT output %u malformed payload: %.*s",channel,payload_len,payload);
+        break;
+
+    case MQTT_ROUTE_INPUT_GET:
+        // Answer from the published snapshot, no I2C task round trip
+        user_i2c_state_get(&tca_state);
+        mqtt_pub_handle.mqtt_action    = MQTT_TCA_INP_PUB;
+        mqtt_pub_handle.tca_in_payload = tca_state.in;
+        mqtt_pub_handle.words          = tca_state.in_words;
+        mqtt_pub_handle.force          = true;
+        user_mqtt_state_post(&mqtt_pub_handle);
+        break;
+
+    case MQTT_ROUTE_OUTPUT_GET:
+        user_i2c_state_get(&tca_state);
+        mqtt_pub_handle.mqtt_action     = MQTT_TCA_OUT_PUB;
+        mqtt_pub_handle.tca_out_payload = tca_state.out;
+        mqtt_pub_handle.words           = tca_state.out_words;
+        mqtt_pub_handle.force           = true;
+        user_mqtt_state_post(&mqtt_pub_handle);
+        break;
+
+    case MQTT_ROUTE_DIAG_GET:
+        // Formatted and published by the publication task
+        mqtt_pub_handle.mqtt_action = MQTT_DIAG_PUB;
+        if(user_mqtt_queue_send(&mqtt_pub_handle,pdMS_TO_TICKS(50)) != pdTRUE)
+            ESP_LOGW(TAG,"MQTT diagnostics queue answer timeout");
+        break;
+
+    case MQTT_ROUTE_SEQ_SET:
+        // Payload: "name:steps", compiled and saved in NVS here
+        value = memchr(payload,':',payload_len);
+        err   = (value != NULL) ? seq_store(payload,value - payload,value+1,payload_len - (value - payload) - 1) : 
+                                  ESP_ERR_INVALID_ARG;
+        if(err != ESP_OK)
+            ESP_LOGW(TAG,"MQTT sequence not saved (%s): %.*s",esp_err_to_name(err),payload_len,payload);
+        break;
+
+    case MQTT_ROUTE_SEQ_RUN:
+        err = seq_run(payload,payload_len);
+        if(err != ESP_OK)
+            ESP_LOGW(TAG,"MQTT sequence %.*s not started: %s",payload_len,payload,esp_err_to_name(err));
+        break;
+
+    case MQTT_ROUTE_SEQ_CANCEL:
+        err = seq_cancel(payload,payload_len);
+        if(err != ESP_OK)
+            ESP_LOGW(TAG,"MQTT sequence %.*s not cancelled: %s",payload_len,payload,esp_err_to_name(err));
+        break;
+
+    case MQTT_ROUTE_RULES_SET:
+        err = rules_store(payload,payload_len);
+        if(err != ESP_OK)
+            ESP_LOGW(TAG,"MQTT rules not applied (%s): %.*s",esp_err_to_name(err),payload_len,payload);
+        break;
+
+    default:
+        ESP_LOGW(TAG,"MQTT topic not handled: %.*s",topic_len,topic);
+        break;
+    }
+
+    // Every output route queues a single I2C command, so a command is 
+    // either queued whole and recorded, or not applied at all and not 
+    // recorded: the client can send it again with the same sequence number
+    if(enveloped)
+    {
+        if(sent)
+            mqtt_dedup_record(&env);
+        else
+            mqtt_ack_release(ack_tag);
+    }
+}
+
+
+// ------------------------------------------------------
+// Payload split across several MQTT_EVENT_DATA events: only the 
+// first one carries the topic, the fragments are copied into the 
+// reassembly buffer and the message is dispatched once complete. 
+// Messages that do not fit are dropped without touching the heap
+static void mqtt_data_fragment(const esp_mqtt_event_t* event, int64_t ingress_us)
+{
+    mqtt_rx_t* rx = &mqtt_rx;
+
+    if(event->current_data_offset == 0)
+    {
+        if(rx->active && !rx->discard)
+            mqtt_stats.rejected++; // Previous message never completed
+        rx->active  = true;
+        rx->discard = (event->total_data_len > MQTT_RX_PAYLOAD_LEN) || 
+                      (event->topic_len > MQTT_RX_TOPIC_LEN);
+        rx->total   = event->total_data_len;
+        rx->len     = 0;
+        rx->ingress_us = ingress_us;
+        if(rx->discard)
+        {
+            mqtt_stats.rejected++;
+            ESP_LOGW(TAG,"MQTT message of %d bytes on %.*s rejected",event->total_data_len,
+                     event->topic_len,event->topic);
+        }
+        else
+        {
+            memcpy(rx->topic,event->topic,event->topic_len);
+            rx->topic_len = event->topic_len;
+        }
+    }
+    else if(!rx->active || (event->total_data_len != rx->total))
+    {
+        // Fragment of a message whose start was not seen, counted once
+        if(event->current_data_offset + event->data_len >= event->total_data_len)
+            mqtt_stats.rejected++;
+        return;
+    }
+
+    if(!rx->discard)
+    {
+        if((event->current_data_offset != rx->len) || (rx->len + event->data_len > rx->total))
+        {
+            // Out of sequence fragment
+            mqtt_stats.rejected++;
+            rx->discard = true;
+        }
+        else
+        {
+            memcpy(rx->payload + rx->len,event->data,event->data_len);
+            rx->len += event->data_len;
+        }
+    }
+
+    if(event->current_data_offset + event->data_len >= rx->total)
+    {
+        if(!rx->discard)
+            mqtt_data_dispatch(rx->topic,rx->topic_len,rx->payload,rx->len,rx->ingress_us);
+        rx->active  = false;
+        rx->discard = false;
+    }
+}
+
+// ------------------------------------------------------
+// Broker connection (or reconnection) established: status, 
+// subscriptions, and wake the publication task for the states 
+// that waited offline
+static void mqtt_online(void)
+{
+    TaskHandle_t listener;
+    tca_state_t  tca_state;
+    char         topic[sizeof(RELAY_OUTPUT_CHANNEL_PREFIX) + sizeof("/set") + 4];
+
+    mqtt_enqueue(RELAY_STATUS,"online",1,true); // send status to subcripters
+
+    // Topics subscription, again on every reconnection
+    user_mqtt_subscribe(RELAY_OUTPUT_SET,1);
+    user_mqtt_subscribe(RELAY_OUTPUT_GET,1);
+    user_mqtt_subscribe(RELAY_INPUT_GET,1);
+    user_mqtt_subscribe(RELAY_OUTPUT_BITS_SET,1);
+    user_mqtt_subscribe(RELAY_OUTPUT_BITS_CLEAR,1);
+    user_mqtt_subscribe(RELAY_OUTPUT_BITS_TOGGLE,1);
+    user_mqtt_subscribe(RELAY_OUTPUT_WRITE,1);
+    user_mqtt_subscribe(RELAY_DIAG_GET,1);
+    user_i2c_state_get(&tca_state);
+    for(unsigned n = 0; n < 16u * tca_state.out_words; n++)
+    {
+        snprintf(topic,sizeof(topic),RELAY_OUTPUT_CHANNEL_SET,n);
+        user_mqtt_subscribe(topic,1);
+    }
+    user_mqtt_subscribe(RELAY_OUTPUT_CHANNEL_PULSE,1);
+    user_mqtt_subscribe(RELAY_OUTPUT_CHANNEL_DELAY_OFF,1);
+    user_mqtt_subscribe(RELAY_OUTPUT_CHANNEL_REVERT,1);
+    user_mqtt_subscribe(RELAY_SEQ_SET,1);
+    user_mqtt_subscribe(RELAY_SEQ_RUN,1);
+    user_mqtt_subscribe(RELAY_SEQ_CANCEL,1);
+    user_mqtt_subscribe(RELAY_RULES_SET,1);
+
+    ESP_LOGI(TAG,"Connected to Broker: %s",ESP_BROKER_URL);
+
+    portENTER_CRITICAL(&mqtt_mailbox_mux);
+    listener = mqtt_pub_listener;
+    portEXIT_CRITICAL(&mqtt_mailbox_mux);
+    if(listener != NULL)
+        xTaskNotify(listener,MQTT_NOTIFY_ONLINE,eSetBits);
+}
+
 // ------------------------------------------------------
 // Configure and start MQTT protocol
+// Does not wait for the broker: the client connects (and 
+// reconnects) in background, see user_mqtt_wait_connected()
 esp_err_t user_mqtt_start(void)
 {
     esp_err_t err = ESP_OK;
@@ -218,6 +653,7 @@ esp_err_t user_mqtt_start(void)
         .session.keepalive = 30, // keep alive for 30 seconds
         .broker.address.uri = ESP_BROKER_URL, // Broker URL
         .broker.address.port = ESP_BROKER_PORT, // Broker Port
+        .outbox.limit = MQTT_OUTBOX_LIMIT_BYTES, // Bound the messages waiting for the broker
         .session.last_will =  // Setup last will when node is disconnected
         {
             .topic = RELAY_STATUS,
@@ -226,8 +662,22 @@ esp_err_t user_mqtt_start(void)
             .qos = 1
         }
     };
+
+    // Publication path first, states posted before the connection 
+    // wait in the mailboxes
+    mqtt_tca_exchange_queue = xQueueCreate(MQTT_PUB_QUEUE_LEN,sizeof(mqtt_access_ctrl_handle_t));
+
+    // Create an MQTT task for topics publication
+    xTaskCreate(mqtt_pub_task,"MQTTPubTask",configMINIMAL_STACK_SIZE+2048,NULL,3,&mqtt_pub_task_handle);
+
+    // Every TCA state update wakes it for the combined state topic
+    if((MQTT_STATE_FORMAT != MQTT_STATE_FORMAT_OFF) && (user_i2c_state_subscribe(mqtt_pub_task_handle) != ESP_OK))
+        ESP_LOGE(TAG,"No state subscriber slot left, %s is not published",RELAY_STATE);
+
     // Create a new MQTT client handle
     mqtt_client = esp_mqtt_client_init(&esp_mqtt_client_config);
+    if(mqtt_client == NULL)
+        return ESP_FAIL;
 
     // Register a callback function for MQTT events
     err = esp_mqtt_client_register_event(mqtt_client,ESP_EVENT_ANY_ID,
@@ -239,41 +689,21 @@ esp_err_t user_mqtt_start(void)
     err = esp_mqtt_client_start(mqtt_client);
     if(err != ESP_OK)
         return err;
-    
-    // Wait until MQTT conection is stabilished or return failure
-    EventBits_t bits = xEventGroupWaitBits(s_mqtt_event_group, 
-    MQTT_CONNECTED_BIT|MQTT_DISCONNECTED_BIT|MQTT_ERROR_BIT,pdFALSE,
-    pdFALSE,portMAX_DELAY);
-
-    if(bits&MQTT_CONNECTED_BIT)
-    {
-        mqtt_tca_exchange_queue = xQueueCreate(5,sizeof(mqtt_access_ctrl_handle_t));
 
-        // Create an MQTT task for topics publication
-        xTaskCreate(mqtt_pub_task,"MQTTPubTask",configMINIMAL_STACK_SIZE+2048,NULL,3,NULL);
-        
-        user_mqtt_publish(RELAY_STATUS,"online",1,true); // send status to subcripters
+    ESP_LOGI(TAG,"Connecting to Broker: %s",ESP_BROKER_URL);
+    return err;
+}
 
-        // Topics subscription
-        user_mqtt_subscribe(RELAY_OUTPUT_SET,1);
-        user_mqtt_subscribe(RELAY_OUTPUT_GET,1);
-        user_mqtt_subscribe(RELAY_INPUT_GET,1);
+// ------------------------------------------------------
+// Wait up to wait ticks for the broker connection
+bool user_mqtt_wait_connected(TickType_t wait)
+{
+    if(s_mqtt_event_group == NULL)
+        return false;
 
-        ESP_LOGI(TAG,"Connected to Broker: %s",ESP_BROKER_URL);
-        err = ESP_OK;
-    }
-    else if(bits&MQTT_DISCONNECTED_BIT)
-    {
-        ESP_LOGI(TAG,"Disconnected from Broker: %s",ESP_BROKER_URL);
-        err = ESP_FAIL;
-    }
-    else if(bits&MQTT_ERROR_BIT)
-    {
-        ESP_LOGI(TAG,"Conection failure: %s",ESP_BROKER_URL);
-        err = ESP_FAIL;
-    }
-       
-    return err;
+    EventBits_t bits = xEventGroupWaitBits(s_mqtt_event_group,MQTT_CONNECTED_BIT,
+                                           pdFALSE,pdTRUE,wait);
+    return (bits & MQTT_CONNECTED_BIT) != 0;
 }
 
 // ------------------------------------------------------
@@ -298,19 +728,95 @@ void user_mqtt_unsubscribe(char* topic)
 
 
 // ------------------------------------------------------
-// Publish a topic 
-void user_mqtt_publish(char* topic, char* payload, int qos, bool retain)
+// Queue a get or diagnostics request to the publication task, with 
+// the queue high water mark and drop accounting. Nothing is queued 
+// before the broker connection is up. States go through the 
+// mailboxes (user_mqtt_state_post)
+BaseType_t user_mqtt_queue_send(const mqtt_access_ctrl_handle_t* msg, TickType_t wait)
 {
-    int msg_id = esp_mqtt_client_publish(mqtt_client,topic,payload,strlen(payload),
-                 qos,(int)retain);
-    ESP_LOGI(TAG,"Topic published successful, msg_id=%d",msg_id);
+    BaseType_t  sent;
+    UBaseType_t depth = 0;
+
+    if(mqtt_tca_exchange_queue == NULL)
+        return pdFALSE;
+
+    sent = xQueueSend(mqtt_tca_exchange_queue,msg,wait);
+    if(sent == pdTRUE)
+        depth = uxQueueMessagesWaiting(mqtt_tca_exchange_queue);
+
+    portENTER_CRITICAL(&mqtt_stats_mux);
+    if(sent != pdTRUE)
+        mqtt_stats.dropped++;
+    else if(depth > mqtt_stats.queue_high_water)
+        mqtt_stats.queue_high_water = depth;
+    portEXIT_CRITICAL(&mqtt_stats_mux);
+
+    if((sent == pdTRUE) && (mqtt_pub_listener != NULL))
+        xTaskNotify(mqtt_pub_listener,MQTT_NOTIFY_QUEUE,eSetBits);
+
+    return sent;
 }
 
 
+// ------------------------------------------------------
+// Read the MQTT counters, with the current queue depth and 
+// the publication task stack high water mark
+void user_mqtt_stats_get(mqtt_stats_t* stats)
+{
+    portENTER_CRITICAL(&mqtt_stats_mux);
+    *stats = mqtt_stats;
+    portEXIT_CRITICAL(&mqtt_stats_mux);
+
+    stats->queue_depth = (mqtt_tca_exchange_queue != NULL) ? uxQueueMessagesWaiting(mqtt_tca_exchange_queue) : 0;
+    stats->stack_free  = (mqtt_pub_task_handle != NULL) ? uxTaskGetStackHighWaterMark(mqtt_pub_task_handle) : 0;
+}
+
+
+#if CONFIG_IDF_TARGET_LINUX
+// ------------------------------------------------------
+// Host simulation: hand a message to the event handler as 
+// if it had been received from the broker
+void user_mqtt_inject(const char* topic, const char* payload, int payload_len)
+{
+    user_mqtt_inject_fragmented(topic,payload,payload_len,payload_len);
+}
+
+// ------------------------------------------------------
+// Same, with the payload split in fragment_len events as the 
+// client does for messages larger than its buffer
+void user_mqtt_inject_fragmented(const char* topic, const char* payload, int payload_len, int fragment_len)
+{
+    esp_mqtt_event_t event = 
+    {
+        .event_id  = MQTT_EVENT_DATA,
+        .client    = mqtt_client,
+        .total_data_len = payload_len,
+        .qos       = 1
+    };
+    int offset = 0;
+
+    do
+    {
+        // Only the first fragment carries the topic
+        event.topic     = (offset == 0) ? (char*)topic : NULL;
+        event.topic_len = (offset == 0) ? (int)strlen(topic) : 0;
+        event.data      = (char*)payload + offset;
+        event.data_len  = (payload_len - offset < fragment_len) ? payload_len - offset : fragment_len;
+        event.current_data_offset = offset;
+
+        mqtt_event_handler(NULL,MQTT_EVENTS,MQTT_EVENT_DATA,&event);
+        offset += event.data_len;
+    } while(offset < payload_len);
+}
+#endif
+
 // ------------------------------------------------------
 // Check for MQTT connection status
 bool user_mqtt_con_status(void)
 {
+    if(s_mqtt_event_group == NULL) // Not started (no IP yet)
+        return false;
+
     EventBits_t bits = xEventGroupGetBits(s_mqtt_event_group);
     if(bits&MQTT_CONNECTED_BIT)
         return true;
@@ -328,33 +834,850 @@ void user_mqtt_stop(void)
 }
 
 
+// ------------------------------------------------------
+// Queue a bank command as a single I2C command, applied whole in 
+// one batch: the words are never split between two writes
+// - mask:  bits affected per word, NULL for a full word write
+// - value: word values, NULL for the bit set/clear/toggle commands
+// - ack_tag: acknowledgement slot, posted once the command is applied
+// Returns false if the command could not be queued, nothing applied
+static bool mqtt_out_bank_send(i2c_action_type_t action, const tca_bank_t* mask, 
+                               const tca_bank_t* value, uint8_t words, int64_t ingress_us, uint32_t ack_tag)
+{
+    i2c_access_ctrl_handle_t i2c_access_handle = {0};
+
+    i2c_access_handle.i2c_action = action;
+    i2c_access_handle.tca_words  = words;
+    i2c_access_handle.ingress_us = ingress_us;
+    i2c_access_handle.ack_tag    = ack_tag;
+    for(uint8_t k = 0; k < words; k++)
+    {
+        i2c_access_handle.tca_bank_mask.word[k] = (mask  != NULL) ? mask->word[k]  : 0xFFFF;
+        i2c_access_handle.tca_bank_stat.word[k] = (value != NULL) ? value->word[k] : 0x0000;
+    }
+
+    if(user_i2c_send(&i2c_access_handle,pdMS_TO_TICKS(50)) != pdTRUE)
+    {
+        ESP_LOGW(TAG,"MQTT output bank queue answer timeout");
+        return false;
+    }
+
+    return true;
+}
+
+
+// ------------------------------------------------------
+// Latency histograms summary, returns the length or 0 if it did not fit
+static int mqtt_diag_latency_json(char* buf, size_t size)
+{
+    trace_summary_t summary;
+    int len = 0;
+    int n;
+
+    for(int stage = 0; stage < TRACE_STAGES; stage++)
+    {
+        trace_summary_get((trace_stage_t)stage,&summary);
+        n = snprintf(buf + len,size - len,
+                     "%s\"%s\":{\"n\":%"PRIu32",\"p50\":%"PRIu32",\"p99\":%"PRIu32",\"max\":%"PRIu32"}",
+                     (stage == 0) ? "{" : ",",trace_stage_name((trace_stage_t)stage),
+                     summary.count,summary.p50_us,summary.p99_us,summary.max_us);
+        if((n < 0) || ((size_t)(len + n) >= size))
+            return 0;
+        len += n;
+    }
+
+    if((size_t)(len + 2) > size)
+        return 0;
+    buf[len++] = '}';
+    buf[len]   = '\0';
+    return len;
+}
+
+
+// ------------------------------------------------------
+// Per channel set payload: "1"/"on", "0"/"off" or "toggle"
+#define MQTT_PAYLOAD_IS(p, len, lit) (((len) == sizeof(lit) - 1) && (strncasecmp((p),(lit),(len)) == 0))
+
+static bool mqtt_channel_action(const char* payload, int len, i2c_action_type_t* action)
+{
+    if(MQTT_PAYLOAD_IS(payload,len,"1") || MQTT_PAYLOAD_IS(payload,len,"on"))
+        *action = TCA_OUT_BITS_SET;
+    else if(MQTT_PAYLOAD_IS(payload,len,"0") || MQTT_PAYLOAD_IS(payload,len,"off"))
+        *action = TCA_OUT_BITS_CLEAR;
+    else if(MQTT_PAYLOAD_IS(payload,len,"toggle"))
+        *action = TCA_OUT_BITS_TOGGLE;
+    else
+        return false;
+
+    return true;
+}
+
+// ------------------------------------------------------
+// Timer duration in ms, plain decimal (up to 9 digits)
+static bool mqtt_duration_parse(const char* payload, int len, uint32_t* duration_ms)
+{
+    uint32_t value = 0;
+
+    if((len == 0) || (len > 9))
+        return false;
+
+    for(int i = 0; i < len; i++)
+    {
+        if((payload[i] < '0') || (payload[i] > '9'))
+            return false;
+        value = value * 10 + (uint32_t)(payload[i] - '0');
+    }
+
+    *duration_ms = value;
+    return true;
+}
+
+// ------------------------------------------------------
+// Timed command on one output channel, the timer runs in the I2C task
+static bool mqtt_channel_timed_send(uint16_t channel, i2c_action_type_t action, tca_timer_type_t timer,
+                                    uint32_t duration_ms, int64_t ingress_us, uint32_t ack_tag)
+{
+    i2c_access_ctrl_handle_t i2c_access_handle = {0};
+
+    i2c_access_handle.i2c_action   = action;
+    i2c_access_handle.tca_word     = (uint8_t)(channel / 16);
+    i2c_access_handle.tca_out_mask = (uint16_t)BIT(channel % 16);
+    i2c_access_handle.tca_timer    = timer;
+    i2c_access_handle.duration_ms  = duration_ms;
+    i2c_access_handle.ingress_us   = ingress_us;
+    i2c_access_handle.ack_tag      = ack_tag;
+
+    if(user_i2c_send(&i2c_access_handle,pdMS_TO_TICKS(50)) != pdTRUE)
+    {
+        ESP_LOGW(TAG,"MQTT output %u queue answer timeout",channel);
+        return false;
+    }
+
+    return true;
+}
+
+
+// ------------------------------------------------------
+// Routes that accept the "@client,seq;" envelope
+static bool mqtt_route_is_output(mqtt_route_t route)
+{
+    switch(route)
+    {
+    case MQTT_ROUTE_OUTPUT_SET:
+    case MQTT_ROUTE_BITS_SET:
+    case MQTT_ROUTE_BITS_CLEAR:
+    case MQTT_ROUTE_BITS_TOGGLE:
+    case MQTT_ROUTE_OUTPUT_WRITE:
+    case MQTT_ROUTE_CHANNEL_SET:
+    case MQTT_ROUTE_CHANNEL_PULSE:
+    case MQTT_ROUTE_CHANNEL_DELAY_OFF:
+    case MQTT_ROUTE_CHANNEL_REVERT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// ------------------------------------------------------
+// "@client,seq;" at the start of the payload, which is moved past it
+static bool mqtt_envelope_parse(const char** payload, int* len, mqtt_envelope_t* env)
+{
+    const char* p   = *payload + 1;
+    const char* end = *payload + *len;
+    int         n = 0;
+    int         digits = 0;
+    uint64_t    seq = 0;
+    char        c;
+
+    while((p < end) && (*p != ','))
+    {
+        c = *p++;
+        if((n == MQTT_CLIENT_ID_LEN) || !(((c >= '0') && (c <= '9')) || ((c >= 'a') && (c <= 'z')) || 
+                                          ((c >= 'A') && (c <= 'Z')) || (c == '_') || (c == '-')))
+            return false;
+        env->client[n++] = c;
+    }
+    env->client[n] = '\0';
+    if((n == 0) || (p == end))
+        return false;
+
+    for(p++; (p < end) && (*p != ';'); p++, digits++)
+    {
+        if((*p < '0') || (*p > '9') || (digits == 10))
+            return false;
+        seq = seq * 10 + (uint64_t)(*p - '0');
+    }
+    if((digits == 0) || (p == end) || (seq > UINT32_MAX))
+        return false;
+
+    env->seq  = (uint32_t)seq;
+    *len     -= (int)(p + 1 - *payload);
+    *payload  = p + 1;
+    return true;
+}
+
+// ------------------------------------------------------
+static mqtt_dedup_t* mqtt_dedup_find(const char* client)
+{
+    for(int i = 0; i < MQTT_DEDUP_CLIENTS; i++)
+        if((mqtt_dedup[i].client[0] != '\0') && (strcmp(mqtt_dedup[i].client,client) == 0))
+            return &mqtt_dedup[i];
+
+    return NULL;
+}
+
+// ------------------------------------------------------
+// Sequence number already applied, or too old to tell
+static bool mqtt_dedup_seen(const mqtt_envelope_t* env)
+{
+    mqtt_dedup_t* d = mqtt_dedup_find(env->client);
+    uint32_t diff;
+
+    if((d == NULL) || (env->seq > d->top))
+        return false;
+
+    diff = d->top - env->seq;
+    return (diff >= MQTT_DEDUP_WINDOW) || (d->window & (1UL << diff));
+}
+
+// ------------------------------------------------------
+// Applied sequence number, a new client takes a free entry or 
+// the least recently seen one
+static void mqtt_dedup_record(const mqtt_envelope_t* env)
+{
+    mqtt_dedup_t* d = mqtt_dedup_find(env->client);
+    uint32_t shift;
+
+    if(d == NULL)
+    {
+        d = &mqtt_dedup[0];
+        for(int i = 0; i < MQTT_DEDUP_CLIENTS; i++)
+        {
+            if(mqtt_dedup[i].client[0] == '\0')
+            {
+                d = &mqtt_dedup[i];
+                break;
+            }
+            if(mqtt_dedup[i].last_us < d->last_us)
+                d = &mqtt_dedup[i];
+        }
+        memcpy(d->client,env->client,sizeof(d->client));
+        d->top    = env->seq;
+        d->window = 0;
+    }
+
+    if(env->seq > d->top)
+    {
+        shift     = env->seq - d->top;
+        d->window = (shift >= MQTT_DEDUP_WINDOW) ? 0 : (d->window << shift);
+        d->top    = env->seq;
+    }
+    d->window |= 1UL << (d->top - env->seq);
+    d->last_us = esp_timer_get_time();
+}
+
+// ------------------------------------------------------
+// Acknowledgement slot of a command, 0 when every slot is in use
+static uint32_t mqtt_ack_open(const mqtt_envelope_t* env)
+{
+    uint32_t tag = 0;
+
+    portENTER_CRITICAL(&mqtt_mailbox_mux);
+    for(int i = 0; i < MQTT_ACK_SLOTS; i++)
+    {
+        if(mqtt_ack[i].state != MQTT_ACK_FREE)
+            continue;
+
+        if(((++mqtt_ack_gen << 8) & UINT32_MAX) == 0)
+            mqtt_ack_gen++;
+        tag = (mqtt_ack_gen << 8) | (uint32_t)i;
+        mqtt_ack[i].state = MQTT_ACK_WAITING;
+        mqtt_ack[i].tag   = tag;
+        mqtt_ack[i].env   = *env;
+        break;
+    }
+    portEXIT_CRITICAL(&mqtt_mailbox_mux);
+
+    if(tag == 0)
+    {
+        portENTER_CRITICAL(&mqtt_stats_mux);
+        mqtt_stats.ack_dropped++;
+        portEXIT_CRITICAL(&mqtt_stats_mux);
+    }
+
+    return tag;
+}
+
+// ------------------------------------------------------
+// Command not queued, its slot is not acknowledged
+static void mqtt_ack_release(uint32_t tag)
+{
+    mqtt_ack_t* ack = &mqtt_ack[(tag & 0xFF) % MQTT_ACK_SLOTS];
+
+    if(tag == 0)
+        return;
+
+    portENTER_CRITICAL(&mqtt_mailbox_mux);
+    if((ack->state == MQTT_ACK_WAITING) && (ack->tag == tag))
+        ack->state = MQTT_ACK_FREE;
+    portEXIT_CRITICAL(&mqtt_mailbox_mux);
+}
+
+// ------------------------------------------------------
+// I2C task: the command holding tag was committed at actuated_us, 
+// out is the output state read back after it
+void user_mqtt_ack_post(uint32_t tag, const tca_bank_t* out, uint8_t words, int64_t actuated_us)
+{
+    mqtt_ack_t*  ack = &mqtt_ack[(tag & 0xFF) % MQTT_ACK_SLOTS];
+    TaskHandle_t listener;
+
+    portENTER_CRITICAL(&mqtt_mailbox_mux);
+    if((ack->state == MQTT_ACK_WAITING) && (ack->tag == tag))
+    {
+        ack->state       = MQTT_ACK_DONE;
+        ack->out         = *out;
+        ack->words       = words;
+        ack->actuated_us = actuated_us;
+    }
+    listener = mqtt_pub_listener;
+    portEXIT_CRITICAL(&mqtt_mailbox_mux);
+
+    if(listener != NULL)
+        xTaskNotify(listener,MQTT_NOTIFY_STATE,eSetBits);
+}
+
+// ------------------------------------------------------
+static int mqtt_ack_json(char* buf, size_t size, const mqtt_envelope_t* env, const tca_bank_t* out, 
+                         uint8_t words, int64_t ts_us, bool dup)
+{
+    char hex[4*TCA_MAX_DEVICES+1];
+
+    if(tca_bank_to_hex(out,words,hex,sizeof(hex)) == 0)
+        hex[0] = '\0';
+
+    return snprintf(buf,size,"{\"client\":\"%s\",\"seq\":%"PRIu32",\"out\":\"%s\",\"ts\":%"PRIi64",\"dup\":%s}",
+                    env->client,env->seq,hex,ts_us,dup ? "true" : "false");
+}
+
+// ------------------------------------------------------
+// Replayed command: not applied, acknowledged at once with the 
+// current output state
+static void mqtt_ack_duplicate(const mqtt_envelope_t* env)
+{
+    char        buff[64 + MQTT_CLIENT_ID_LEN + 4*TCA_MAX_DEVICES];
+    tca_state_t state;
+
+    portENTER_CRITICAL(&mqtt_stats_mux);
+    mqtt_stats.duplicates++;
+    portEXIT_CRITICAL(&mqtt_stats_mux);
+
+    user_i2c_state_get(&state);
+    mqtt_ack_json(buff,sizeof(buff),env,&state.out,state.out_words,state.timestamp_us,true);
+    mqtt_enqueue(RELAY_OUTPUT_ACK,buff,1,false);
+    ESP_LOGD(TAG,"Command %s,%"PRIu32" already applied",env->client,env->seq);
+}
+
+// ------------------------------------------------------
+// Publication task: send the acknowledgements of the applied 
+// commands, a refused one is tried again MQTT_PUB_RETRY_MS later
+static void mqtt_ack_flush(int64_t now_us)
+{
+    char       buff[64 + MQTT_CLIENT_ID_LEN + 4*TCA_MAX_DEVICES];
+    mqtt_ack_t ack;
+    bool       done;
+
+    if(!user_mqtt_con_status() || (now_us < mqtt_ack_due_us))
+        return;
+
+    mqtt_ack_due_us = 0;
+    for(int i = 0; i < MQTT_ACK_SLOTS; i++)
+    {
+        portENTER_CRITICAL(&mqtt_mailbox_mux);
+        done = (mqtt_ack[i].state == MQTT_ACK_DONE);
+        if(done)
+            ack = mqtt_ack[i];
+        portEXIT_CRITICAL(&mqtt_mailbox_mux);
+        if(!done)
+            continue;
+
+        mqtt_ack_json(buff,sizeof(buff),&ack.env,&ack.out,ack.words,ack.actuated_us,false);
+        if(mqtt_enqueue(RELAY_OUTPUT_ACK,buff,1,false) < 0)
+        {
+            mqtt_ack_due_us = now_us + MQTT_PUB_RETRY_MS * 1000;
+            break;
+        }
+
+        portENTER_CRITICAL(&mqtt_mailbox_mux);
+        mqtt_ack[i].state = MQTT_ACK_FREE;
+        portEXIT_CRITICAL(&mqtt_mailbox_mux);
+    }
+}
+
+
+// ------------------------------------------------------
+// Non blocking publication: the message goes to the client outbox, 
+// bounded by MQTT_OUTBOX_LIMIT_BYTES, and is sent by the client task. 
+// Returns the message id, negative when it was not queued
+static int mqtt_enqueue(const char* topic, const char* payload, int qos, bool retain)
+{
+    return mqtt_enqueue_len(topic,payload,(int)strlen(payload),qos,retain);
+}
+
+// Same, for a binary payload of len bytes
+static int mqtt_enqueue_len(const char* topic, const char* payload, int len, int qos, bool retain)
+{
+    int msg_id;
+
+    // Nothing is queued offline, the states wait as pending instead
+    if(!user_mqtt_con_status())
+        return -1;
+
+    msg_id = esp_mqtt_client_enqueue(mqtt_client,topic,payload,len,qos,(int)retain,true);
+
+    portENTER_CRITICAL(&mqtt_stats_mux);
+    if(msg_id < 0)
+        mqtt_stats.publish_errors++;
+    else
+        mqtt_stats.published++;
+    portEXIT_CRITICAL(&mqtt_stats_mux);
+
+    return msg_id;
+}
+
+
+// ------------------------------------------------------
+// Publish prefix<n>/state for the channels that differ from last, 
+// every channel when last_words is 0
+// - last, last_words: channel states sent, only updated for the 
+//   channels that were queued
+// Returns false if a channel could not be queued
+static bool mqtt_channel_states_publish(const char* prefix, const tca_bank_t* bank, uint8_t words,
+                                        tca_bank_t* last, uint8_t* last_words)
+{
+    char     topic[sizeof(RELAY_OUTPUT_CHANNEL_PREFIX) + sizeof(RELAY_CHANNEL_STATE_SUFFIX) + 4];
+    uint16_t changed;
+    uint16_t sent;
+    bool     all_sent = true;
+
+    for(uint8_t k = 0; k < words; k++)
+    {
+        changed = (k < *last_words) ? (bank->word[k] ^ last->word[k]) : 0xFFFF;
+        sent    = 0;
+        for(uint16_t i = 0; i < 16; i++)
+        {
+            if(!(changed & BIT(i)))
+                continue;
+            if((mqtt_channel_topic(topic,sizeof(topic),prefix,(uint16_t)(16*k + i),RELAY_CHANNEL_STATE_SUFFIX) > 0) &&
+               (mqtt_enqueue(topic,(bank->word[k] & BIT(i)) ? "1" : "0",1,true) >= 0))
+                sent |= (uint16_t)BIT(i);
+        }
+
+        if(k >= *last_words)
+            last->word[k] = ~bank->word[k]; // Channels not sent stay different
+        last->word[k] = (last->word[k] & ~sent) | (bank->word[k] & sent);
+        if(sent != changed)
+            all_sent = false;
+    }
+
+    *last_words = words;
+    return all_sent;
+}
+
+
+// ------------------------------------------------------
+// Latest value mailbox of a state topic. Never blocks: a state 
+// not taken yet is replaced, keeping the oldest command ingress 
+// (latency tracing), the last edge and a pending get
+void user_mqtt_state_post(const mqtt_access_ctrl_handle_t* msg)
+{
+    mqtt_mailbox_t* box = &mqtt_mailbox[(msg->mqtt_action == MQTT_TCA_INP_PUB) ? MQTT_STATE_INPUT : MQTT_STATE_OUTPUT];
+    mqtt_access_ctrl_handle_t merged = *msg;
+    TaskHandle_t listener;
+    bool overwritten;
+
+    portENTER_CRITICAL(&mqtt_mailbox_mux);
+    overwritten = box->full;
+    if(overwritten)
+    {
+        if((box->msg.ingress_us != 0) && ((merged.ingress_us == 0) || (box->msg.ingress_us < merged.ingress_us)))
+        {
+            merged.ingress_us = box->msg.ingress_us;
+            merged.enqueue_us = box->msg.enqueue_us;
+        }
+        if(merged.timestamp_us == 0)
+            merged.timestamp_us = box->msg.timestamp_us;
+        merged.force |= box->msg.force;
+    }
+    box->msg  = merged;
+    box->full = true;
+    listener  = mqtt_pub_listener;
+    portEXIT_CRITICAL(&mqtt_mailbox_mux);
+
+    if(overwritten)
+    {
+        portENTER_CRITICAL(&mqtt_stats_mux);
+        mqtt_stats.overwritten++;
+        portEXIT_CRITICAL(&mqtt_stats_mux);
+    }
+
+    if(listener != NULL)
+        xTaskNotify(listener,MQTT_NOTIFY_STATE,eSetBits);
+}
+
+// ------------------------------------------------------
+// Take the state posted for action (MQTT_TCA_INP_PUB / MQTT_TCA_OUT_PUB)
+bool user_mqtt_state_take(mqtt_action_type_h action, mqtt_access_ctrl_handle_t* msg)
+{
+    mqtt_mailbox_t* box = &mqtt_mailbox[(action == MQTT_TCA_INP_PUB) ? MQTT_STATE_INPUT : MQTT_STATE_OUTPUT];
+    bool full;
+
+    portENTER_CRITICAL(&mqtt_mailbox_mux);
+    full = box->full;
+    if(full)
+        *msg = box->msg;
+    box->full = false;
+    portEXIT_CRITICAL(&mqtt_mailbox_mux);
+
+    return full;
+}
+
+// ------------------------------------------------------
+// Progress of the sequence run in slot, never blocks: a status 
+// not taken yet is replaced
+void user_mqtt_seq_post(uint8_t slot, const mqtt_seq_status_t* status)
+{
+    TaskHandle_t listener;
+    bool overwritten;
+
+    if(slot >= SEQ_RUNNING_MAX)
+        return;
+
+    portENTER_CRITICAL(&mqtt_mailbox_mux);
+    overwritten = mqtt_seq_mailbox[slot].full;
+    mqtt_seq_mailbox[slot].status = *status;
+    mqtt_seq_mailbox[slot].full   = true;
+    listener = mqtt_pub_listener;
+    portEXIT_CRITICAL(&mqtt_mailbox_mux);
+
+    if(overwritten)
+    {
+        portENTER_CRITICAL(&mqtt_stats_mux);
+        mqtt_stats.overwritten++;
+        portEXIT_CRITICAL(&mqtt_stats_mux);
+    }
+
+    if(listener != NULL)
+        xTaskNotify(listener,MQTT_NOTIFY_STATE,eSetBits);
+}
+
+// ------------------------------------------------------
+// Take the posted sequence statuses and publish the pending ones, 
+// a status the outbox could not take is tried again later
+static void mqtt_seq_flush(int64_t now_us)
+{
+    char buff[96];
+    mqtt_seq_pub_t* sp;
+
+    for(int i = 0; i < SEQ_RUNNING_MAX; i++)
+    {
+        sp = &mqtt_seq_pub[i];
+
+        portENTER_CRITICAL(&mqtt_mailbox_mux);
+        if(mqtt_seq_mailbox[i].full)
+        {
+            sp->status      = mqtt_seq_mailbox[i].status;
+            sp->has_pending = true;
+            sp->due_us      = 0;
+        }
+        mqtt_seq_mailbox[i].full = false;
+        portEXIT_CRITICAL(&mqtt_mailbox_mux);
+
+        if(!sp->has_pending || (now_us < sp->due_us) || !user_mqtt_con_status())
+            continue;
+
+        snprintf(buff,sizeof(buff),"{\"name\":\"%s\",\"state\":\"%s\",\"step\":%u,\"steps\":%u}",
+                 sp->status.name,sp->status.state,sp->status.step,sp->status.steps);
+        if(mqtt_enqueue(RELAY_SEQ_STATUS,buff,1,false) >= 0)
+            sp->has_pending = false;
+        else
+            sp->due_us = now_us + MQTT_PUB_RETRY_MS * 1000;
+    }
+}
+
+// ------------------------------------------------------
+// Task woken on every mailbox post and mqtt_tca_exchange_queue send
+void user_mqtt_pub_listener_set(TaskHandle_t task)
+{
+    portENTER_CRITICAL(&mqtt_mailbox_mux);
+    mqtt_pub_listener = task;
+    portEXIT_CRITICAL(&mqtt_mailbox_mux);
+}
+
+
+// ------------------------------------------------------
+// New state for a state topic: dropped when it is already the 
+// published one, pending otherwise
+static void mqtt_state_update(int index, const mqtt_access_ctrl_handle_t* msg, const tca_bank_t* bank)
+{
+    mqtt_state_pub_t* st = &mqtt_state_pub[index];
+    size_t size = msg->words * sizeof(bank->word[0]);
+
+    // Changes only go out on the combined topic
+    if(!MQTT_STATE_SPLIT_TOPICS && !msg->force && !st->force)
+        return;
+
+    if(!st->has_pending)
+        st->due_us = (st->published_words != 0) ? st->last_us + (int64_t)st->min_interval_ms * 1000 : 0;
+
+    st->pending       = *bank;
+    st->pending_words = msg->words;
+    st->force        |= msg->force;
+
+    if(!st->force && (st->published_words == msg->words) && (st->channel_words == msg->words) &&
+       (memcmp(st->published.word,bank->word,size) == 0) && (memcmp(st->channels.word,bank->word,size) == 0))
+    {
+        // Back to the published state (or no change at all)
+        st->has_pending = false;
+        st->edge_us     = 0;
+        st->ingress_us  = 0;
+        return;
+    }
+
+    st->has_pending = true;
+    if(msg->timestamp_us != 0)
+        st->edge_us = msg->timestamp_us;
+    if((msg->ingress_us != 0) && ((st->ingress_us == 0) || (msg->ingress_us < st->ingress_us)))
+    {
+        st->ingress_us = msg->ingress_us;
+        st->enqueue_us = msg->enqueue_us;
+    }
+}
+
+// ------------------------------------------------------
+// Publish the pending states that are due. A state the outbox 
+// could not take (full or offline) stays pending and is tried 
+// again MQTT_PUB_RETRY_MS later, newer states still replace it
+static void mqtt_state_flush(int64_t now_us)
+{
+    char strbuff[4*TCA_MAX_DEVICES+1];
+    char eventbuff[sizeof(strbuff)+24];
+    mqtt_state_pub_t* st;
+    size_t size;
+
+    // Offline: everything stays pending until mqtt_online()
+    if(!user_mqtt_con_status())
+        return;
+
+    for(int i = 0; i < MQTT_STATE_TOPICS; i++)
+    {
+        st = &mqtt_state_pub[i];
+        if(!st->has_pending || (now_us < st->due_us))
+            continue;
+
+        // Bank topic, skipped when only channel topics are left to send
+        size = st->pending_words * sizeof(st->pending.word[0]);
+        if(st->force || (st->published_words != st->pending_words) ||
+           (memcmp(st->published.word,st->pending.word,size) != 0))
+        {
+            // No word on this side (e.g. no input expander fitted): nothing to send
+            if(tca_bank_to_hex(&st->pending,st->pending_words,strbuff,sizeof(strbuff)) == 0)
+            {
+                st->has_pending = false;
+                st->force       = false;
+                st->edge_us     = 0;
+                st->ingress_us  = 0;
+                continue;
+            }
+            ESP_LOGD(TAG,"Publishing %s %s",st->topic,strbuff);
+            if(mqtt_enqueue(st->topic,strbuff,1,true) < 0)
+            {
+                st->due_us = now_us + MQTT_PUB_RETRY_MS * 1000;
+                continue;
+            }
+            st->published       = st->pending;
+            st->published_words = st->pending_words;
+            st->last_us         = now_us;
+            st->force           = false;
+
+            if(st->ingress_us != 0)
+            {
+                int64_t now = esp_timer_get_time();
+                trace_record(TRACE_PUBLISH,st->enqueue_us,now);
+                trace_record(TRACE_E2E_PUB,st->ingress_us,now);
+                st->ingress_us = 0;
+            }
+
+            // Interruption driven change, publish with the edge capture time
+            if(st->edge_us != 0)
+            {
+                snprintf(eventbuff,sizeof(eventbuff),"%s,%"PRIi64,strbuff,st->edge_us);
+                mqtt_enqueue(RELAY_INPUT_EVENT,eventbuff,1,false);
+                st->edge_us = 0;
+            }
+        }
+
+        if(mqtt_channel_states_publish(st->channel_prefix,&st->pending,st->pending_words,
+                                       &st->channels,&st->channel_words))
+            st->has_pending = false;
+        else
+            st->due_us = now_us + MQTT_PUB_RETRY_MS * 1000;
+    }
+}
+
+// ------------------------------------------------------
+// Publish the latest TCA snapshot on relay/state when it is not 
+// the one sent last. States replaced in between are skipped, the 
+// sequence number shows the gap
+static void mqtt_snapshot_flush(int64_t now_us)
+{
+    char        buff[160]; // Binary 16 + 4*TCA_MAX_DEVICES bytes, JSON below 76 + 8*TCA_MAX_DEVICES
+    tca_state_t state;
+    int         len = 0;
+
+    if((MQTT_STATE_FORMAT == MQTT_STATE_FORMAT_OFF) || !user_mqtt_con_status() || (now_us < mqtt_snapshot_pub.due_us))
+        return;
+
+    user_i2c_state_get(&state);
+    if(mqtt_snapshot_pub.published && (state.seq == mqtt_snapshot_pub.seq))
+        return;
+
+#if MQTT_STATE_FORMAT == MQTT_STATE_FORMAT_BINARY
+    buff[len++] = MQTT_STATE_BINARY_VERSION;
+    buff[len++] = (char)state.in_words;
+    buff[len++] = (char)state.out_words;
+    buff[len++] = state.stale ? MQTT_STATE_FLAG_STALE : 0;
+    for(int i = 0; i < 4; i++)
+        buff[len++] = (char)(state.seq >> (8*i));
+    for(int i = 0; i < 8; i++)
+        buff[len++] = (char)((uint64_t)state.timestamp_us >> (8*i));
+    for(int k = 0; k < state.in_words; k++)
+    {
+        buff[len++] = (char)(state.in.word[k] & 0xFF);
+        buff[len++] = (char)(state.in.word[k] >> 8);
+    }
+    for(int k = 0; k < state.out_words; k++)
+    {
+        buff[len++] = (char)(state.out.word[k] & 0xFF);
+        buff[len++] = (char)(state.out.word[k] >> 8);
+    }
+#else
+    len = snprintf(buff,sizeof(buff),"{\"seq\":%"PRIu32",\"ts\":%"PRIi64",\"in\":\"",state.seq,state.timestamp_us);
+    len += tca_bank_to_hex(&state.in,state.in_words,buff + len,sizeof(buff) - len);
+    len += snprintf(buff + len,sizeof(buff) - len,"\",\"out\":\"");
+    len += tca_bank_to_hex(&state.out,state.out_words,buff + len,sizeof(buff) - len);
+    len += snprintf(buff + len,sizeof(buff) - len,state.stale ? "\",\"stale\":true}" : "\"}");
+#endif
+
+    if(mqtt_enqueue_len(RELAY_STATE,buff,len,1,true) >= 0)
+    {
+        mqtt_snapshot_pub.seq       = state.seq;
+        mqtt_snapshot_pub.published = true;
+        mqtt_snapshot_pub.due_us    = 0;
+    }
+    else
+        mqtt_snapshot_pub.due_us = now_us + MQTT_PUB_RETRY_MS * 1000;
+}
+
+// ------------------------------------------------------
+// Wait of the publication task: until the first pending state 
+// is due, forever if there is none or the broker is not connected
+static TickType_t mqtt_state_wait(int64_t now_us)
+{
+    TickType_t wait = portMAX_DELAY;
+    TickType_t ticks;
+    int64_t    remaining_us;
+
+    if(!user_mqtt_con_status())
+        return portMAX_DELAY;
+
+    for(int i = 0; i < MQTT_STATE_TOPICS; i++)
+    {
+        if(!mqtt_state_pub[i].has_pending)
+            continue;
+
+        remaining_us = mqtt_state_pub[i].due_us - now_us;
+        ticks = (remaining_us > 0) ? pdMS_TO_TICKS((remaining_us + 999) / 1000) + 1 : 0;
+        if(ticks < wait)
+            wait = ticks;
+    }
+
+    // Acknowledgement refused by the outbox
+    if(mqtt_ack_due_us != 0)
+    {
+        remaining_us = mqtt_ack_due_us - now_us;
+        ticks = (remaining_us > 0) ? pdMS_TO_TICKS((remaining_us + 999) / 1000) + 1 : 0;
+        if(ticks < wait)
+            wait = ticks;
+    }
+
+    // Combined state refused by the outbox, the next change also wakes the task
+    if(mqtt_snapshot_pub.due_us != 0)
+    {
+        remaining_us = mqtt_snapshot_pub.due_us - now_us;
+        ticks = (remaining_us > 0) ? pdMS_TO_TICKS((remaining_us + 999) / 1000) + 1 : 0;
+        if(ticks < wait)
+            wait = ticks;
+    }
+
+    for(int i = 0; i < SEQ_RUNNING_MAX; i++)
+    {
+        if(!mqtt_seq_pub[i].has_pending)
+            continue;
+
+        remaining_us = mqtt_seq_pub[i].due_us - now_us;
+        ticks = (remaining_us > 0) ? pdMS_TO_TICKS((remaining_us + 999) / 1000) + 1 : 0;
+        if(ticks < wait)
+            wait = ticks;
+    }
+
+    return wait;
+}
+
+
 // ------------------------------------------------------
 // Task for topics publications 
+// States come from the mailboxes, gets and diagnostics from 
+// mqtt_tca_exchange_queue, both wake the task with a notification. 
+// The notification wait doubles as the minimum interval timer
 static void mqtt_pub_task(void* PvParameters)
 {   
-    char strbuff[10]; 
+    static char diagbuff[MQTT_DIAG_BUFFER_LEN];
     mqtt_access_ctrl_handle_t topic;
+
+    user_mqtt_pub_listener_set(xTaskGetCurrentTaskHandle());
+
     while(true)
     {
-        xQueueReceive(mqtt_tca_exchange_queue,&topic,portMAX_DELAY);
+        if(user_mqtt_state_take(MQTT_TCA_INP_PUB,&topic))
+            mqtt_state_update(MQTT_STATE_INPUT,&topic,&topic.tca_in_payload);
+        if(user_mqtt_state_take(MQTT_TCA_OUT_PUB,&topic))
+            mqtt_state_update(MQTT_STATE_OUTPUT,&topic,&topic.tca_out_payload);
 
-        switch(topic.mqtt_action)
+        while(xQueueReceive(mqtt_tca_exchange_queue,&topic,0) == pdTRUE)
         {
-            case MQTT_TCA_INP_PUB: // publish input status
+            switch(topic.mqtt_action)
+            {
+                case MQTT_TCA_INP_PUB: // input status get
+                    mqtt_state_update(MQTT_STATE_INPUT,&topic,&topic.tca_in_payload);
+                    break;
+                case MQTT_TCA_OUT_PUB: // output status get
+                    mqtt_state_update(MQTT_STATE_OUTPUT,&topic,&topic.tca_out_payload);
+                    break; 
+                case MQTT_DIAG_PUB: // publish the latency histograms
 
-                sprintf(strbuff,"%x",topic.tca_in_payload);
-                printf("Publishing %s\n",strbuff);
-                user_mqtt_publish(RELAY_INPUT_PUB,strbuff,1,false);
+                    if(mqtt_diag_latency_json(diagbuff,sizeof(diagbuff)) > 0)
+                        mqtt_enqueue(RELAY_DIAG_LATENCY,diagbuff,0,false);
 
-                break;
-            case MQTT_TCA_OUT_PUB: // publish output status
+                    break;
+                default:
+            }
+        }
 
-                sprintf(strbuff,"%x",topic.tca_out_payload);
-                printf("Publishing %s\n",strbuff);
-                user_mqtt_publish(RELAY_OUTPUT_PUB,strbuff,1,false);
+        mqtt_state_flush(esp_timer_get_time());
+        mqtt_seq_flush(esp_timer_get_time());
+        mqtt_snapshot_flush(esp_timer_get_time());
+        mqtt_ack_flush(esp_timer_get_time());
 
-                break; 
-            default:
-        }
+        xTaskNotifyWait(0,UINT32_MAX,NULL,mqtt_state_wait(esp_timer_get_time()));
     }
-}
\ No newline at end of file
+}
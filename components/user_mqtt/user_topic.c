@@ -0,0 +1,149 @@
+/*
+ * MQTT topic routing
+ * One constant trie node per topic segment, a topic is routed 
+ * with one pass over its bytes: no copy, no allocation and no 
+ * strcmp against every known topic
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "user_i2c.h"
+#include "user_topic.h"
+
+#define TOPIC_SEGMENT_CHANNEL NULL // Segment matching a decimal channel index
+
+typedef struct topic_node_t
+{
+    const char*  segment;     // Segment text, TOPIC_SEGMENT_CHANNEL for <n>
+    uint8_t      len;
+    uint8_t      first_child; // Index of the first child in topic_trie
+    uint8_t      child_count;
+    mqtt_route_t route;       // Route of a topic ending on this node
+} topic_node_t;
+
+#define TOPIC_NODE(seg, first, count, route) { seg, sizeof(seg) - 1, first, count, route }
+#define TOPIC_NODE_CHANNEL(first, count, route) { TOPIC_SEGMENT_CHANNEL, 0, first, count, route }
+
+// Children of a node are contiguous, literal segments before <n>
+static const topic_node_t topic_trie[] =
+{
+    /*  0 */ TOPIC_NODE("",       1, 1, MQTT_ROUTE_NONE),  // Root
+    /*  1 */ TOPIC_NODE("relay",  2, 5, MQTT_ROUTE_NONE),
+    /*  2 */ TOPIC_NODE("output", 7, 5, MQTT_ROUTE_NONE),
+    /*  3 */ TOPIC_NODE("input", 12, 1, MQTT_ROUTE_NONE),
+    /*  4 */ TOPIC_NODE("diag",  13, 1, MQTT_ROUTE_NONE),
+    /*  5 */ TOPIC_NODE("seq",   14, 3, MQTT_ROUTE_NONE),
+    /*  6 */ TOPIC_NODE("rules", 17, 1, MQTT_ROUTE_NONE),
+    /*  7 */ TOPIC_NODE("set",    0, 0, MQTT_ROUTE_OUTPUT_SET),
+    /*  8 */ TOPIC_NODE("get",    0, 0, MQTT_ROUTE_OUTPUT_GET),
+    /*  9 */ TOPIC_NODE("write",  0, 0, MQTT_ROUTE_OUTPUT_WRITE),
+    /* 10 */ TOPIC_NODE("bits",  18, 3, MQTT_ROUTE_NONE),
+    /* 11 */ TOPIC_NODE_CHANNEL( 21, 4, MQTT_ROUTE_NONE),
+    /* 12 */ TOPIC_NODE("get",    0, 0, MQTT_ROUTE_INPUT_GET),
+    /* 13 */ TOPIC_NODE("get",    0, 0, MQTT_ROUTE_DIAG_GET),
+    /* 14 */ TOPIC_NODE("set",    0, 0, MQTT_ROUTE_SEQ_SET),
+    /* 15 */ TOPIC_NODE("run",    0, 0, MQTT_ROUTE_SEQ_RUN),
+    /* 16 */ TOPIC_NODE("cancel", 0, 0, MQTT_ROUTE_SEQ_CANCEL),
+    /* 17 */ TOPIC_NODE("set",    0, 0, MQTT_ROUTE_RULES_SET),
+    /* 18 */ TOPIC_NODE("set",    0, 0, MQTT_ROUTE_BITS_SET),
+    /* 19 */ TOPIC_NODE("clear",  0, 0, MQTT_ROUTE_BITS_CLEAR),
+    /* 20 */ TOPIC_NODE("toggle", 0, 0, MQTT_ROUTE_BITS_TOGGLE),
+    /* 21 */ TOPIC_NODE("set",    0, 0, MQTT_ROUTE_CHANNEL_SET),
+    /* 22 */ TOPIC_NODE("pulse",  0, 0, MQTT_ROUTE_CHANNEL_PULSE),
+    /* 23 */ TOPIC_NODE("delay_off", 0, 0, MQTT_ROUTE_CHANNEL_DELAY_OFF),
+    /* 24 */ TOPIC_NODE("revert", 0, 0, MQTT_ROUTE_CHANNEL_REVERT),
+};
+
+
+// -------------------------------------------------------------------
+// Decimal channel index, no sign, no leading zeros, below TCA_MAX_CHANNELS
+static bool topic_channel_parse(const char* seg, int len, uint16_t* channel)
+{
+    uint32_t value = 0;
+
+    if((len == 0) || (len > 3) || ((seg[0] == '0') && (len > 1)))
+        return false;
+
+    for(int i = 0; i < len; i++)
+    {
+        if((seg[i] < '0') || (seg[i] > '9'))
+            return false;
+        value = value * 10 + (uint32_t)(seg[i] - '0');
+    }
+
+    if(value >= TCA_MAX_CHANNELS)
+        return false;
+
+    *channel = (uint16_t)value;
+    return true;
+}
+
+// -------------------------------------------------------------------
+// Route a received topic, MQTT_ROUTE_NONE if it is not handled
+mqtt_route_t mqtt_topic_route(const char* topic, int len, uint16_t* channel)
+{
+    const topic_node_t* node = &topic_trie[0];
+    const topic_node_t* child;
+    const char* seg = topic;
+    const char* end = topic + len;
+    const char* slash;
+    int seg_len;
+    int i;
+
+    while(seg <= end)
+    {
+        slash   = memchr(seg, '/', (size_t)(end - seg));
+        seg_len = (slash != NULL) ? (int)(slash - seg) : (int)(end - seg);
+
+        for(i = 0; i < node->child_count; i++)
+        {
+            child = &topic_trie[node->first_child + i];
+            if(child->segment == TOPIC_SEGMENT_CHANNEL)
+            {
+                if(topic_channel_parse(seg, seg_len, channel))
+                    break;
+            }
+            else if((child->len == seg_len) && (memcmp(child->segment, seg, (size_t)seg_len) == 0))
+                break;
+        }
+        if(i == node->child_count)
+            return MQTT_ROUTE_NONE;
+
+        node = child;
+        if(slash == NULL)
+            return node->route;
+        seg = slash + 1;
+    }
+
+    return MQTT_ROUTE_NONE;
+}
+
+// -------------------------------------------------------------------
+// prefix<n>suffix, returns the length or 0 if buf is too small
+int mqtt_channel_topic(char* buf, size_t size, const char* prefix, uint16_t channel, const char* suffix)
+{
+    size_t prefix_len = strlen(prefix);
+    size_t suffix_len = strlen(suffix);
+    char   digits[5];
+    char*  d = digits + sizeof(digits);
+    size_t digits_len;
+
+    do
+    {
+        *--d = (char)('0' + channel % 10);
+        channel /= 10;
+    } while(channel != 0);
+    digits_len = (size_t)(digits + sizeof(digits) - d);
+
+    if(prefix_len + digits_len + suffix_len >= size)
+        return 0;
+
+    memcpy(buf, prefix, prefix_len);
+    memcpy(buf + prefix_len, d, digits_len);
+    memcpy(buf + prefix_len + digits_len, suffix, suffix_len);
+    buf[prefix_len + digits_len + suffix_len] = '\0';
+
+    return (int)(prefix_len + digits_len + suffix_len);
+}
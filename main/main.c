@@ -10,13 +10,18 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <inttypes.h>
 
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/event_groups.h"
 
 #include "nvs_flash.h"
 
@@ -32,13 +37,49 @@
 #include "user_mqtt.h"
 
 QueueHandle_t i2C_access_queue = NULL;        // Access control to i2c bus
-QueueHandle_t http_tca_out_get_queue = NULL;  // Http get output status
-QueueHandle_t http_tca_inp_get_queue = NULL;  // Http get input status
 QueueHandle_t mqtt_tca_exchange_queue = NULL; // data exchange between MQTT and tca expansions
 
 static const char* TAG = "MAIN";
 
 failure_chain_t check_chain;
+static boot_timing_t boot_timing;
+
+// ----------------------------------------------
+// Boot state machine: local control (I2C/TCA) is up before the 
+// network, Ethernet/DHCP and the broker come up in background
+#define BOOT_IP_BIT        BIT0
+#define BOOT_POLL_MS       1000 // Failure report period while waiting
+#define BOOT_I2C_READY_MS  100  // Wait of the first input read
+
+typedef enum
+{
+    BOOT_WAIT_IP,     // Ethernet driver started, waiting for DHCP
+    BOOT_WAIT_BROKER, // Web server up, MQTT client connecting
+    BOOT_RUNNING
+} boot_phase_t;
+
+static EventGroupHandle_t boot_event_group = NULL;
+
+// ----------------------------------------------
+// IP_EVENT_ETH_GOT_IP, along with the handler of user_ethernet
+static void boot_got_ip_handler(void* arg, esp_event_base_t event_base, 
+                                int32_t event_id, void* event_data)
+{
+    xEventGroupSetBits(boot_event_group,BOOT_IP_BIT);
+}
+
+// ----------------------------------------------
+// Boot phases timing, from the esp_timer start
+static void boot_report(void)
+{
+    i2c_stats_t i2c;
+
+    user_i2c_stats_get(&i2c);
+    ESP_LOGI(TAG,"Boot timing: outputs restored %"PRIi64" ms, i2c ready %"PRIi64" ms, "
+             "ip %"PRIi64" ms, http %"PRIi64" ms, broker %"PRIi64" ms",
+             i2c.restore_us/1000,boot_timing.i2c_ready_us/1000,boot_timing.ip_us/1000,
+             boot_timing.http_us/1000,boot_timing.broker_us/1000);
+}
 
 void app_main(void)
 {
@@ -86,50 +127,95 @@ void app_main(void)
             check_chain.bit.tca_failure = true; // There is an error on tca initialization
             ESP_LOGE(TAG,"%s",esp_err_to_name(err));
         }
+        else
+        {
+            // Answered once the configuration and the first input 
+            // read queued by tca9555_init() went through
+            i2c_access_ctrl_handle_t ready = {0};
+            tca_state_t tca_state;
+
+            ready.i2c_action = TCA_REFRESH_INP;
+            if(user_i2c_request(&ready,&tca_state,pdMS_TO_TICKS(BOOT_I2C_READY_MS)) == ESP_OK)
+                boot_timing.i2c_ready_us = esp_timer_get_time();
+            else
+                ESP_LOGW(TAG,"TCA first input read timeout");
+        }
     }
     
     // ----------------------------------------------
-    // Ethernet initialization
+    // Ethernet initialization, returns with the driver started
+    boot_phase_t phase = BOOT_RUNNING;
+    boot_event_group = xEventGroupCreate();
     if(!check_chain.bit.nvs_failure)
     {
         ESP_LOGI(TAG,"Ethernet initialization.");
         err = ethernet_setup();
+        if(err == ESP_OK)
+            err = esp_event_handler_register(IP_EVENT,IP_EVENT_ETH_GOT_IP,&boot_got_ip_handler,NULL);
+
         if(err != ESP_OK)
         {
             check_chain.bit.eth_failure = true; // There is an error on ethernet initialization
             ESP_LOGE(TAG,"%s",esp_err_to_name(err));
         }
+        else
+            phase = BOOT_WAIT_IP;
     }
-    
 
-    // ----------------------------------------------
-    // Web based 
-    if((!check_chain.bit.eth_failure) && (!check_chain.bit.i2c_failure))
+    while(true)
     {
-        err = user_mqtt_start();
-        if(err != ESP_OK)
+        switch(phase)
         {
-            check_chain.bit.eth_failure = true; // There is an error on mqtt initialization
-            ESP_LOGE(TAG,"%s",esp_err_to_name(err));
+        case BOOT_WAIT_IP:
+            // The address may come before boot_got_ip_handler is 
+            // registered (the default event loop is created by 
+            // ethernet_setup()), the connection status covers it
+            if(!(xEventGroupWaitBits(boot_event_group,BOOT_IP_BIT,pdTRUE,pdTRUE,
+                                     pdMS_TO_TICKS(BOOT_POLL_MS)) & BOOT_IP_BIT) && 
+               !user_eth_con_status())
+                break;
+            boot_timing.ip_us = esp_timer_get_time();
+
+            // ----------------------------------------------
+            // Web server initialization
+            start_webserver(check_chain.bit.tca_failure | check_chain.bit.i2c_failure,
+                            "I2C device failure");
+            boot_timing.http_us = esp_timer_get_time();
+
+            // ----------------------------------------------
+            // MQTT client, connects in background
+            phase = BOOT_RUNNING;
+            if(!check_chain.bit.i2c_failure)
+            {
+                err = user_mqtt_start();
+                if(err != ESP_OK)
+                {
+                    check_chain.bit.mqtt_failure = true; // There is an error on mqtt initialization
+                    ESP_LOGE(TAG,"%s",esp_err_to_name(err));
+                }
+                else
+                    phase = BOOT_WAIT_BROKER;
+            }
+            if(phase == BOOT_RUNNING)
+                boot_report();
+            break;
+
+        case BOOT_WAIT_BROKER:
+            if(!user_mqtt_wait_connected(pdMS_TO_TICKS(BOOT_POLL_MS)))
+                break;
+            boot_timing.broker_us = esp_timer_get_time();
+            boot_report();
+            phase = BOOT_RUNNING;
+            break;
+
+        case BOOT_RUNNING:
+        default:
+            vTaskDelay(pdMS_TO_TICKS(BOOT_POLL_MS));
+            break;
         }
-    }
-
-    // ----------------------------------------------
-    // Web server initialization
-    if(!check_chain.bit.eth_failure)
-    {   
-        start_webserver(check_chain.bit.tca_failure | check_chain.bit.i2c_failure,
-                        "I2C device failure");
-    }
-
-    
 
-    while(true)
-    {
         if(check_chain.all != 0)
             ESP_LOGE(TAG,"Device initialization failure ");
-
-        vTaskDelay(pdMS_TO_TICKS(1000));
     }
 }
 
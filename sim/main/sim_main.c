@@ -0,0 +1,752 @@
+/*
+ * Remote relay host simulation
+ * Runs the I2C task and the MQTT command handler against the
+ * TCA9555 model and reports command throughput, request latency,
+ * coalescing and input edge handling, then the cost of the /status 
+ * encoders
+ * Environment:
+ * - TCA_SIM_LATENCY_US: bus time per transaction (default TCA_SIM_LATENCY_US)
+ * - SIM_COMMANDS:       commands per scenario (default SIM_COMMANDS_DEFAULT)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "user_i2c.h"
+#include "user_persist.h"
+#include "user_mqtt.h"
+#include "user_trace.h"
+#include "user_json.h"
+#include "tca9555.h"
+#include "tca9555_sim.h"
+
+QueueHandle_t i2C_access_queue = NULL;        // Access control to i2c bus
+QueueHandle_t mqtt_tca_exchange_queue = NULL; // data exchange between MQTT and tca expansions
+
+static const char* TAG = "SIM";
+
+#define SIM_COMMANDS_DEFAULT 10000
+#define SIM_PRODUCERS        4    // Concurrent command sources
+#define SIM_EDGES            200  // Input edges injected, one per tick
+#define SIM_BARRIER_MS       5000
+#define SIM_RX_FRAGMENT      8    // Fragment size of the reassembly scenarios
+#define SIM_SOAK_MESSAGES    100000
+#define SIM_TIMER_ROUNDS     50   // Rounds of one pulse per output channel
+#define SIM_TIMER_PULSE_MS   20
+#define SIM_RULE_EDGES       50   // Input 0 changes with output 0 following it
+#define SIM_RECOVERY_MS      1000 // Longest wait for the output expander to come back
+#define SIM_JSON_DOCS        100000 // /status documents per encoder
+#define SIM_BOOT_OUTPUTS     0x0081 // Saved output word restored at boot
+#define SIM_PERSIST_MS       200  // Time left to the NVS writer after boot
+
+// Latency accumulator
+typedef struct sim_latency_t
+{
+    uint32_t count;
+    int64_t  total_us;
+    int64_t  min_us;
+    int64_t  max_us;
+} sim_latency_t;
+
+// Snapshot of every counter, scenarios report the difference
+typedef struct sim_counters_t
+{
+    int64_t         time_us;
+    i2c_stats_t     i2c;
+    tca_sim_stats_t bus;
+    uint32_t        pub_out;
+    uint32_t        pub_inp;
+} sim_counters_t;
+
+static volatile uint32_t sim_pub_out = 0;
+static volatile uint32_t sim_pub_inp = 0;
+static TaskHandle_t      sim_main_task = NULL;
+static uint32_t          sim_commands = SIM_COMMANDS_DEFAULT;
+
+
+// -------------------------------------------------------------------
+// Stands in for mqtt_pub_task: counts the publications
+static void sim_pub_task(void* PvParameters)
+{
+    mqtt_access_ctrl_handle_t topic;
+
+    user_mqtt_pub_listener_set(xTaskGetCurrentTaskHandle());
+
+    while(true)
+    {
+        if(user_mqtt_state_take(MQTT_TCA_OUT_PUB,&topic))
+            sim_pub_out++;
+        if(user_mqtt_state_take(MQTT_TCA_INP_PUB,&topic))
+            sim_pub_inp++;
+        while(xQueueReceive(mqtt_tca_exchange_queue,&topic,0) == pdTRUE)
+        {
+            if(topic.mqtt_action == MQTT_TCA_OUT_PUB)
+                sim_pub_out++;
+            else if(topic.mqtt_action == MQTT_TCA_INP_PUB)
+                sim_pub_inp++;
+        }
+        xTaskNotifyWait(0,UINT32_MAX,NULL,portMAX_DELAY);
+    }
+}
+
+// -------------------------------------------------------------------
+static void sim_latency_add(sim_latency_t* lat, int64_t us)
+{
+    if(lat->count == 0 || us < lat->min_us)
+        lat->min_us = us;
+    if(us > lat->max_us)
+        lat->max_us = us;
+    lat->total_us += us;
+    lat->count++;
+}
+
+// -------------------------------------------------------------------
+static void sim_counters_get(sim_counters_t* c)
+{
+    c->time_us = esp_timer_get_time();
+    user_i2c_stats_get(&c->i2c);
+    tca_sim_stats_get(&c->bus);
+    c->pub_out = sim_pub_out;
+    c->pub_inp = sim_pub_inp;
+}
+
+// -------------------------------------------------------------------
+// Saved state found by the boot: the outputs channel restore policy 
+// is all on in the simulated configuration
+static void sim_boot_seed(void)
+{
+    tca_bank_t saved = {0};
+    esp_err_t  err;
+
+    err = nvs_flash_init();
+    if((err == ESP_ERR_NVS_NO_FREE_PAGES) || (err == ESP_ERR_NVS_NEW_VERSION_FOUND))
+    {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(err);
+
+    saved.word[0] = SIM_BOOT_OUTPUTS;
+    ESP_ERROR_CHECK(persist_out_save(&saved,1));
+}
+
+// -------------------------------------------------------------------
+// Wait until every queued command went through the I2C task: the
+// barrier request is answered once the queue ahead of it is drained
+static void sim_barrier(void)
+{
+    i2c_access_ctrl_handle_t cmd = {0};
+    tca_state_t state;
+
+    cmd.i2c_action = TCA_REFRESH_INP;
+    if(user_i2c_request(&cmd,&state,pdMS_TO_TICKS(SIM_BARRIER_MS)) != ESP_OK)
+        ESP_LOGE(TAG,"Barrier timeout");
+}
+
+// -------------------------------------------------------------------
+static void sim_report(const char* name, const sim_counters_t* a, const sim_counters_t* b)
+{
+    double   elapsed_s = (b->time_us - a->time_us) / 1e6;
+    uint32_t cmds  = b->i2c.cmd_received - a->i2c.cmd_received;
+    uint32_t trans = b->bus.transactions - a->bus.transactions;
+
+    printf("%-12s %8"PRIu32" cmd %9.0f cmd/s  bus %6"PRIu32" (w %5"PRIu32" r %5"PRIu32")  "
+           "batches %6"PRIu32"  cmd/trans %5.2f  pub out %5"PRIu32" in %5"PRIu32"\n",
+           name, cmds, elapsed_s > 0 ? cmds / elapsed_s : 0.0, trans,
+           b->bus.writes - a->bus.writes, b->bus.reads - a->bus.reads,
+           b->i2c.batches - a->i2c.batches, trans ? (double)cmds / trans : 0.0,
+           b->pub_out - a->pub_out, b->pub_inp - a->pub_inp);
+}
+
+// -------------------------------------------------------------------
+// Fire and forget toggles, as several HTTP/MQTT clients would send
+static void sim_producer_task(void* PvParameters)
+{
+    uint32_t id = (uint32_t)(uintptr_t)PvParameters;
+    i2c_access_ctrl_handle_t cmd = {0};
+
+    cmd.i2c_action = TCA_OUT_BITS_TOGGLE;
+    for(uint32_t i = 0; i < sim_commands / SIM_PRODUCERS; i++)
+    {
+        cmd.tca_out_mask = (uint16_t)BIT((id * 4 + i) % 16);
+        user_i2c_send(&cmd,portMAX_DELAY);
+    }
+
+    xTaskNotifyGive(sim_main_task);
+    vTaskDelete(NULL);
+}
+
+// -------------------------------------------------------------------
+// Boot with a saved state: the restored word is published, driven on 
+// the pins with no other output going high on the way, and the NVS 
+// writer finds nothing new to save
+static void sim_scenario_boot(void)
+{
+    persist_stats_t persist;
+    tca_bank_t  saved = {0};
+    tca_state_t state;
+    uint16_t driven;
+
+    vTaskDelay(pdMS_TO_TICKS(SIM_PERSIST_MS));
+    user_i2c_state_get(&state);
+    driven = tca_sim_driven_get(TCA_ADDR_1);
+    persist_out_read(&saved,state.out_words);
+    persist_stats_get(&persist);
+
+    printf("%-12s published 0x%04x, outputs 0x%04x, driven high 0x%04x (0x0000), "
+           "saved 0x%04x (0x%04x), %"PRIu32" NVS writes (0)\n",
+           "boot", state.out.word[0], tca_sim_output_get(TCA_ADDR_1),
+           driven & ~SIM_BOOT_OUTPUTS, saved.word[0], SIM_BOOT_OUTPUTS, persist.writes);
+}
+
+// -------------------------------------------------------------------
+static void sim_scenario_burst(void)
+{
+    sim_counters_t a, b;
+
+    sim_counters_get(&a);
+    for(uint32_t i = 0; i < SIM_PRODUCERS; i++)
+        xTaskCreate(sim_producer_task,"SimProducer",configMINIMAL_STACK_SIZE+2048,
+                    (void*)(uintptr_t)i,4,NULL);
+    for(uint32_t i = 0; i < SIM_PRODUCERS; i++)
+        ulTaskNotifyTake(pdFALSE,portMAX_DELAY);
+    sim_barrier();
+    sim_counters_get(&b);
+
+    sim_report("burst",&a,&b);
+}
+
+// -------------------------------------------------------------------
+// One request at a time: end to end latency through the I2C task
+static void sim_scenario_request(void)
+{
+    sim_counters_t a, b;
+    sim_latency_t lat = {0};
+    i2c_access_ctrl_handle_t cmd = {0};
+    tca_state_t state;
+    int64_t start;
+
+    cmd.i2c_action   = TCA_OUT_BITS_TOGGLE;
+    cmd.tca_out_mask = 0x0001;
+
+    sim_counters_get(&a);
+    for(uint32_t i = 0; i < sim_commands; i++)
+    {
+        start = esp_timer_get_time();
+        if(user_i2c_request(&cmd,&state,pdMS_TO_TICKS(SIM_BARRIER_MS)) == ESP_OK)
+            sim_latency_add(&lat,esp_timer_get_time() - start);
+    }
+    sim_counters_get(&b);
+
+    sim_report("request",&a,&b);
+    if(lat.count != 0)
+        printf("%-12s latency min %"PRIi64" us avg %"PRIi64" us max %"PRIi64" us\n",
+               "", lat.min_us, lat.total_us / lat.count, lat.max_us);
+}
+
+// -------------------------------------------------------------------
+// Commands through the MQTT event handler
+static void sim_scenario_mqtt(void)
+{
+    sim_counters_t a, b;
+    char payload[8];
+    int len;
+
+    sim_counters_get(&a);
+    for(uint32_t i = 0; i < sim_commands; i++)
+    {
+        len = snprintf(payload,sizeof(payload),"%x",(unsigned)BIT(i % 16));
+        user_mqtt_inject(RELAY_OUTPUT_BITS_TOGGLE,payload,len);
+    }
+    sim_barrier();
+    sim_counters_get(&b);
+
+    sim_report("mqtt",&a,&b);
+}
+
+// -------------------------------------------------------------------
+// Per channel commands through the MQTT event handler
+static void sim_scenario_channel(void)
+{
+    sim_counters_t a, b;
+    char topic[32];
+
+    sim_counters_get(&a);
+    for(uint32_t i = 0; i < sim_commands; i++)
+    {
+        snprintf(topic,sizeof(topic),RELAY_OUTPUT_CHANNEL_SET,(unsigned)(i % 16));
+        user_mqtt_inject(topic,"toggle",6);
+    }
+    sim_barrier();
+    sim_counters_get(&b);
+
+    sim_report("channel",&a,&b);
+}
+
+// -------------------------------------------------------------------
+// MQTT_EVENT_DATA handling cost alone: empty masks route and parse 
+// the whole message but never reach the I2C queue
+static void sim_scenario_rx(void)
+{
+    static const char bits[] = "00000000000000000000000000000000"; // 8 words, no bit set
+    int64_t start;
+    double  whole_s, frag_s;
+
+    start = esp_timer_get_time();
+    for(uint32_t i = 0; i < sim_commands; i++)
+        user_mqtt_inject(RELAY_OUTPUT_BITS_TOGGLE,bits,sizeof(bits) - 1);
+    whole_s = (esp_timer_get_time() - start) / 1e6;
+
+    start = esp_timer_get_time();
+    for(uint32_t i = 0; i < sim_commands; i++)
+        user_mqtt_inject_fragmented(RELAY_OUTPUT_BITS_TOGGLE,bits,sizeof(bits) - 1,SIM_RX_FRAGMENT);
+    frag_s = (esp_timer_get_time() - start) / 1e6;
+
+    printf("%-12s %8"PRIu32" msg %9.0f msg/s whole, %9.0f msg/s in %d byte fragments\n",
+           "rx",sim_commands,whole_s > 0 ? sim_commands / whole_s : 0.0,
+           frag_s > 0 ? sim_commands / frag_s : 0.0,SIM_RX_FRAGMENT);
+}
+
+// -------------------------------------------------------------------
+// Heap soak: mixed whole, fragmented and oversized messages, the 
+// heap in use must not move
+static void sim_scenario_soak(void)
+{
+    static char big[MQTT_RX_PAYLOAD_LEN + 64];
+    static const char bits[] = "0000000000000000";
+    struct mallinfo2 before, after;
+    mqtt_stats_t stats_a, stats_b;
+
+    memset(big,'0',sizeof(big));
+    user_mqtt_stats_get(&stats_a);
+    before = mallinfo2();
+    for(uint32_t i = 0; i < SIM_SOAK_MESSAGES; i++)
+    {
+        if((i % 1000) == 999)
+            user_mqtt_inject_fragmented(RELAY_OUTPUT_WRITE,big,sizeof(big),SIM_RX_FRAGMENT * 16);
+        else if(i % 2)
+            user_mqtt_inject_fragmented(RELAY_OUTPUT_BITS_SET,bits,1 + i % (sizeof(bits) - 1),1 + i % 5);
+        else
+            user_mqtt_inject(RELAY_OUTPUT_BITS_CLEAR,bits,1 + i % (sizeof(bits) - 1));
+    }
+    after = mallinfo2();
+    user_mqtt_stats_get(&stats_b);
+
+    printf("%-12s %8d msg  heap in use %zu -> %zu bytes, %"PRIu32" rejected\n","soak",
+           SIM_SOAK_MESSAGES,before.uordblks,after.uordblks,stats_b.rejected - stats_a.rejected);
+}
+
+// -------------------------------------------------------------------
+// Input edges every tick, merged by the TCA_INTR_DEBOUNCE_US window
+static void sim_scenario_edges(void)
+{
+    sim_counters_t a, b;
+    uint16_t pins = 0xFFFF;
+
+    sim_counters_get(&a);
+    for(int i = 0; i < SIM_EDGES; i++)
+    {
+        pins ^= 0x0001;
+        tca_sim_input_set(TCA_ADDR_2,pins);
+        vTaskDelay(1);
+    }
+    vTaskDelay(pdMS_TO_TICKS(2 * TCA_INTR_DEBOUNCE_US / 1000));
+    sim_barrier();
+    sim_counters_get(&b);
+
+    sim_report("edges",&a,&b);
+    printf("%-12s %"PRIu32" edges injected, %"PRIu32" latched by the I2C task\n",
+           "", b.bus.edges - a.bus.edges, b.i2c.intr_edges - a.i2c.intr_edges);
+}
+
+
+// -------------------------------------------------------------------
+// A pulse on every output channel per round, through MQTT: the 
+// 16 expiries of a round fall in the merge window and cost one write
+static void sim_scenario_timers(void)
+{
+    sim_counters_t a, b;
+    char topic[32];
+    char payload[12];
+    int  len;
+
+    len = snprintf(payload,sizeof(payload),"%d",SIM_TIMER_PULSE_MS);
+
+    sim_counters_get(&a);
+    for(int round = 0; round < SIM_TIMER_ROUNDS; round++)
+    {
+        for(unsigned ch = 0; ch < 16; ch++)
+        {
+            snprintf(topic,sizeof(topic),RELAY_OUTPUT_CHANNEL_PREFIX "%u/pulse",ch);
+            user_mqtt_inject(topic,payload,len);
+        }
+        vTaskDelay(pdMS_TO_TICKS(2 * SIM_TIMER_PULSE_MS));
+    }
+    sim_barrier();
+    sim_counters_get(&b);
+
+    sim_report("timers",&a,&b);
+    printf("%-12s %"PRIu32" expiries in %"PRIu32" commits, outputs 0x%04x after the last pulse\n",
+           "", b.i2c.timer_expiries - a.i2c.timer_expiries, b.i2c.timer_commits - a.i2c.timer_commits,
+           tca_sim_output_get(TCA_ADDR_1));
+}
+
+// -------------------------------------------------------------------
+// Output 0 follows input 0 through a local rule (inputs are active 
+// low): each edge costs one input read and one output write in the 
+// same commit, no command goes through the queue
+static void sim_scenario_rules(void)
+{
+    static const char rules[] = "o0=!i0";
+    i2c_access_ctrl_handle_t cmd = {0};
+    sim_counters_t a, b;
+    tca_state_t state;
+    uint16_t pins = 0xFFFF;
+    uint32_t mismatches = 0;
+    bool     held;
+
+    user_mqtt_inject(RELAY_RULES_SET,rules,sizeof(rules) - 1);
+    sim_barrier();
+
+    sim_counters_get(&a);
+    for(int i = 0; i < SIM_RULE_EDGES; i++)
+    {
+        pins ^= 0x0001;
+        tca_sim_input_set(TCA_ADDR_2,pins);
+        vTaskDelay(pdMS_TO_TICKS(2 * TCA_INTR_DEBOUNCE_US / 1000));
+        if(((tca_sim_output_get(TCA_ADDR_1) ^ ~pins) & 0x0001) != 0)
+            mismatches++;
+    }
+    sim_barrier();
+    sim_counters_get(&b);
+
+    // A command against the rule holds over input refreshes, the 
+    // rule acts again on the next input change only
+    cmd.i2c_action   = TCA_OUT_BITS_TOGGLE;
+    cmd.tca_out_mask = 0x0001;
+    user_i2c_request(&cmd,&state,pdMS_TO_TICKS(SIM_BARRIER_MS));
+    sim_barrier();
+    held = ((tca_sim_output_get(TCA_ADDR_1) ^ ~pins) & 0x0001) != 0;
+
+    user_mqtt_inject(RELAY_RULES_SET,"",0);
+    sim_barrier();
+
+    sim_report("rules",&a,&b);
+    printf("%-12s %"PRIu32" evaluations, %"PRIu32" output changes, %"PRIu32" edges not followed, "
+           "command %s over a refresh\n",
+           "", b.i2c.rule_evals - a.i2c.rule_evals, b.i2c.rule_writes - a.i2c.rule_writes, mismatches,
+           held ? "held" : "NOT held");
+}
+
+// -------------------------------------------------------------------
+// Sequence pulse shorter than the timer merge window: both steps 
+// are due in the same commit, the output must still go high
+static void sim_scenario_seq(void)
+{
+    static const char seq[] = "pulse:0001,0001;w1;0001,0000";
+    i2c_access_ctrl_handle_t cmd = {0};
+    sim_counters_t a, b;
+    tca_state_t state;
+    uint16_t driven;
+
+    cmd.i2c_action   = TCA_OUT_BITS_CLEAR;
+    cmd.tca_out_mask = 0x0001;
+    user_i2c_request(&cmd,&state,pdMS_TO_TICKS(SIM_BARRIER_MS));
+    user_mqtt_inject(RELAY_SEQ_SET,seq,sizeof(seq) - 1);
+    tca_sim_driven_get(TCA_ADDR_1);
+
+    sim_counters_get(&a);
+    user_mqtt_inject(RELAY_SEQ_RUN,"pulse",5);
+    vTaskDelay(pdMS_TO_TICKS(50));
+    sim_barrier();
+    sim_counters_get(&b);
+    driven = tca_sim_driven_get(TCA_ADDR_1);
+
+    sim_report("seq",&a,&b);
+    printf("%-12s %"PRIu32" steps, output 0 %s, ends %s\n",
+           "", b.i2c.seq_steps - a.i2c.seq_steps, (driven & 0x0001) ? "pulsed" : "NOT pulsed",
+           (tca_sim_output_get(TCA_ADDR_1) & 0x0001) ? "high" : "low");
+}
+
+// -------------------------------------------------------------------
+// Bus errors on the output expander: a glitch absorbed by the retries, 
+// then a brown-out (registers lost, no answer for a while) that takes 
+// the device down. The state stays served, flagged stale, until the 
+// recovery replays the output word and configures the device again. 
+// No output may go high on the way, not even between two writes
+static void sim_scenario_faults(void)
+{
+    i2c_access_ctrl_handle_t cmd = {0};
+    sim_counters_t a, b;
+    tca_state_t state;
+    bool glitch_ok, stale_seen;
+    int  waited_ms = 0;
+    uint16_t driven;
+
+    cmd.i2c_action   = TCA_OUT_BITS_WRITE;
+    cmd.tca_out_mask = 0xFFFF;
+
+    sim_counters_get(&a);
+
+    // Glitch: fewer failures than retries
+    tca_sim_fault_inject(TCA_ADDR_1,I2C_RETRIES,false);
+    cmd.tca_out_stat = 0x00AA;
+    user_i2c_request(&cmd,&state,pdMS_TO_TICKS(SIM_BARRIER_MS));
+    glitch_ok = !state.stale && (tca_sim_output_get(TCA_ADDR_1) == 0x00AA);
+
+    // Brown-out: the write and the first recovery attempts fail
+    tca_sim_fault_inject(TCA_ADDR_1,I2C_RETRIES + 1 + 3,true);
+    tca_sim_driven_get(TCA_ADDR_1);
+    cmd.tca_out_stat = 0x0F0F;
+    user_i2c_request(&cmd,&state,pdMS_TO_TICKS(SIM_BARRIER_MS));
+    stale_seen = state.stale;
+    do
+    {
+        vTaskDelay(pdMS_TO_TICKS(10));
+        waited_ms += 10;
+        user_i2c_state_get(&state);
+    } while(state.stale && (waited_ms < SIM_RECOVERY_MS));
+    sim_barrier();
+    driven = tca_sim_driven_get(TCA_ADDR_1);
+    sim_counters_get(&b);
+
+    sim_report("faults",&a,&b);
+    printf("%-12s glitch %s, stale %s, outputs 0x%04x after recovery (0x0f0f), driven high 0x%04x (0x0000)\n",
+           "", glitch_ok ? "absorbed" : "NOT absorbed", stale_seen ? "flagged" : "NOT flagged",
+           tca_sim_output_get(TCA_ADDR_1), driven & ~0x0F0F);
+    printf("%-12s %"PRIu32" faults, %"PRIu32" retries, %"PRIu32" bus resets, %"PRIu32" failed attempts, "
+           "recovered in %"PRIi64" us\n",
+           "", b.bus.faults - a.bus.faults, b.i2c.i2c_retries - a.i2c.i2c_retries,
+           b.i2c.bus_resets - a.i2c.bus_resets, b.i2c.recovery_failures - a.i2c.recovery_failures,
+           b.i2c.recovery_last_us);
+}
+
+// -------------------------------------------------------------------
+// Scrubber: the output expander loses its registers without any bus 
+// error (brown-out between two commits), then an input changes with 
+// the interruption line cut. Both are found by the background passes, 
+// the repair drives no output high, not even between two writes
+static void sim_scenario_scrub(void)
+{
+    i2c_access_ctrl_handle_t cmd = {0};
+    sim_counters_t a, b;
+    tca_state_t state;
+    uint16_t pins = 0xFFFE; // Input 0 active
+    uint16_t driven;
+
+    cmd.i2c_action   = TCA_OUT_BITS_WRITE;
+    cmd.tca_out_mask = 0xFFFF;
+    cmd.tca_out_stat = 0x3C3C;
+    user_i2c_request(&cmd,&state,pdMS_TO_TICKS(SIM_BARRIER_MS));
+
+    sim_counters_get(&a);
+    tca_sim_fault_inject(TCA_ADDR_1,0,true);
+    tca_sim_driven_get(TCA_ADDR_1);
+    tca_sim_intr_enable(false);
+    tca_sim_input_set(TCA_ADDR_2,pins);
+    vTaskDelay(pdMS_TO_TICKS(2 * I2C_SCRUB_OUTPUT_MS + 2 * I2C_SCRUB_INPUT_MS));
+    user_i2c_state_get(&state);
+    sim_counters_get(&b);
+    driven = tca_sim_driven_get(TCA_ADDR_1);
+    tca_sim_intr_enable(true);
+    tca_sim_input_set(TCA_ADDR_2,0xFFFF);
+    sim_barrier();
+
+    sim_report("scrub",&a,&b);
+    printf("%-12s %"PRIu32" passes, %"PRIu32" config, %"PRIu32" output, %"PRIu32" input discrepancies, "
+           "outputs 0x%04x (0x3c3c), driven high 0x%04x (0x0000), input 0 change %s\n",
+           "", b.i2c.scrub_passes - a.i2c.scrub_passes, b.i2c.scrub_config - a.i2c.scrub_config,
+           b.i2c.scrub_output - a.i2c.scrub_output, b.i2c.scrub_input - a.i2c.scrub_input,
+           tca_sim_output_get(TCA_ADDR_1), driven & ~0x3C3C, (state.in.word[0] & 0x0001) ? "NOT seen" : "seen");
+}
+
+// -------------------------------------------------------------------
+// /status document as status_handler built it before user_json: 
+// snprintf per channel into a stack buffer, one word per side
+static int sim_json_legacy(char* buffer, size_t size, const tca_state_t* state)
+{
+    int offset = 0;
+
+    offset += snprintf(buffer + offset, size - offset, "{");
+    offset += snprintf(buffer + offset, size - offset, "\"outputs\":{");
+    for (int i = 0; i < 16; i++)
+        offset += snprintf(buffer + offset, size - offset, "\"%d\":%d%s", i, 
+                           (state->out.word[0] >> i) & 0x0001, (i < 15 ? "," : ""));
+    offset += snprintf(buffer + offset, size - offset, "},");
+    offset += snprintf(buffer + offset, size - offset, "\"inputs\":{");
+    for (int i = 0; i < 16; i++)
+        offset += snprintf(buffer + offset, size - offset, "\"%d\":%d%s", i, 
+                           (state->in.word[0] >> i) & 0x0001, (i < 15 ? "," : ""));
+    offset += snprintf(buffer + offset, size - offset, "},");
+    offset += snprintf(buffer + offset, size - offset, "\"seq\":%"PRIu32"}", state->seq);
+
+    return offset;
+}
+
+// Same documents as status_handler, default and fmt=hex
+static size_t sim_json_stream(char* buffer, size_t size, const tca_state_t* state, bool hex)
+{
+    json_writer_t w;
+
+    json_init(&w, buffer, size);
+    json_obj_begin(&w);
+    if(hex)
+    {
+        json_key(&w, "out");
+        json_hex_words(&w, state->out.word, state->out_words);
+        json_key(&w, "in");
+        json_hex_words(&w, state->in.word, state->in_words);
+    }
+    else
+    {
+        json_key(&w, "outputs");
+        json_bitmap_words(&w, state->out.word, state->out_words);
+        json_key(&w, "inputs");
+        json_bitmap_words(&w, state->in.word, state->in_words);
+    }
+    json_key(&w, "seq");
+    json_u32(&w, state->seq);
+    json_key(&w, "stale");
+    json_bool(&w, state->stale);
+    json_obj_end(&w);
+
+    return json_finish(&w);
+}
+
+// -------------------------------------------------------------------
+// Bytes and time per /status document (single expander state): the 
+// snprintf encoder it replaced against the streaming encoder, in the 
+// map and hex formats, and the fixed /status.bin layout
+static void sim_scenario_json(void)
+{
+    static const char* name[] = {"snprintf", "json map", "json hex", "binary"};
+    char        buffer[320];
+    tca_state_t state = {0};
+    size_t      bytes[4] = {0};
+    int64_t     start_us, elapsed_us[4];
+
+    state.out_words = 1;
+    state.in_words  = 1;
+
+    for(int enc = 0; enc < 4; enc++)
+    {
+        start_us = esp_timer_get_time();
+        for(uint32_t i = 0; i < SIM_JSON_DOCS; i++)
+        {
+            state.out.word[0] = (uint16_t)(i * 40503u);
+            state.in.word[0]  = (uint16_t)~i;
+            state.seq = i;
+            switch(enc)
+            {
+                case 0:  bytes[enc] = (size_t)sim_json_legacy(buffer,sizeof(buffer),&state); break;
+                case 1:  bytes[enc] = sim_json_stream(buffer,sizeof(buffer),&state,false);   break;
+                case 2:  bytes[enc] = sim_json_stream(buffer,sizeof(buffer),&state,true);    break;
+                default: // Layout of status_bin_handler
+                    memcpy(buffer,&state.out.word[0],2);
+                    memcpy(buffer + 2,&state.in.word[0],2);
+                    memcpy(buffer + 4,&state.seq,4);
+                    memcpy(buffer + 8,&state.timestamp_us,8);
+                    buffer[16] = (char)state.out_words;
+                    buffer[17] = (char)state.in_words;
+                    memcpy(buffer + 18,state.out.word,2);
+                    memcpy(buffer + 20,state.in.word,2);
+                    bytes[enc] = 22;
+                    break;
+            }
+            __asm__ volatile("" : : "r"(buffer) : "memory"); // Keep every document
+        }
+        elapsed_us[enc] = esp_timer_get_time() - start_us;
+    }
+
+    printf("\n%-12s %8s %10s %8s\n","encoder","bytes","ns/doc","speedup");
+    for(int enc = 0; enc < 4; enc++)
+        printf("%-12s %8zu %10.1f %7.1fx\n",name[enc],bytes[enc],
+               elapsed_us[enc] * 1000.0 / SIM_JSON_DOCS,
+               elapsed_us[enc] ? (double)elapsed_us[0] / elapsed_us[enc] : 0.0);
+}
+
+// -------------------------------------------------------------------
+// Per stage latency of every command traced in the run
+static void sim_trace_report(void)
+{
+    trace_summary_t summary;
+
+    printf("\n%-12s %8s %8s %8s %8s\n","stage","n","p50 us","p99 us","max us");
+    for(int stage = 0; stage < TRACE_STAGES; stage++)
+    {
+        trace_summary_get((trace_stage_t)stage,&summary);
+        printf("%-12s %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32"\n",trace_stage_name((trace_stage_t)stage),
+               summary.count,summary.p50_us,summary.p99_us,summary.max_us);
+    }
+}
+
+// -------------------------------------------------------------------
+// Queue occupancy and drops over the whole run
+static void sim_queue_report(void)
+{
+    i2c_stats_t  i2c;
+    mqtt_stats_t mqtt;
+
+    user_i2c_stats_get(&i2c);
+    user_mqtt_stats_get(&mqtt);
+    printf("\n%-12s high water %2"PRIu32"/%d dropped %"PRIu32"  bus time %"PRIu64" us  errors %"PRIu32"\n",
+           "i2c queue",i2c.queue_high_water,I2C_ACCESS_QUEUE_LEN,i2c.cmd_dropped,
+           i2c.bus_time_us,i2c.i2c_errors);
+    printf("%-12s high water %2"PRIu32"/%d dropped %"PRIu32"  state overwritten %"PRIu32"\n",
+           "mqtt queue",mqtt.queue_high_water,MQTT_PUB_QUEUE_LEN,mqtt.dropped,mqtt.overwritten);
+}
+
+
+// -------------------------------------------------------------------
+void app_main(void)
+{
+    const char* env;
+
+    sim_main_task = xTaskGetCurrentTaskHandle();
+
+    if((env = getenv("TCA_SIM_LATENCY_US")) != NULL)
+        tca_sim_set_latency_us((uint32_t)strtoul(env,NULL,10));
+    if((env = getenv("SIM_COMMANDS")) != NULL)
+        sim_commands = (uint32_t)strtoul(env,NULL,10);
+
+    mqtt_tca_exchange_queue = xQueueCreate(MQTT_PUB_QUEUE_LEN,sizeof(mqtt_access_ctrl_handle_t));
+    xTaskCreate(sim_pub_task,"SimPubTask",configMINIMAL_STACK_SIZE+2048,NULL,3,NULL);
+
+    sim_boot_seed();
+    ESP_ERROR_CHECK(user_i2c0_init());
+    ESP_ERROR_CHECK(tca9555_init());
+    sim_barrier();
+
+    sim_scenario_boot();
+    sim_scenario_burst();
+    sim_scenario_request();
+    sim_scenario_mqtt();
+    sim_scenario_channel();
+    sim_scenario_rx();
+    sim_scenario_soak();
+    sim_scenario_edges();
+    sim_scenario_timers();
+    sim_scenario_rules();
+    sim_scenario_seq();
+    sim_scenario_faults();
+    sim_scenario_scrub();
+    sim_trace_report();
+    sim_queue_report();
+    sim_scenario_json();
+
+    exit(0);
+}